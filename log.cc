@@ -33,11 +33,33 @@
  *
  */
 
+#include <algorithm>
+#include <charconv>
+#include <functional>
+#include <string_view>
+
 #include <execinfo.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <wchar.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <elf.h>
+#include <link.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
 #include "log.h"
@@ -46,6 +68,99 @@
 // Declarations
 bool logging::is_logging_initialized = false;
 logging::Log * logging::log = NULL;
+logging::log_level_t logging::current_level = logging::DEBUG;
+
+// Source of Log::instance_id, so that thread caches can tell logs apart.
+static uint64_t log_instances = 0;
+
+// Per-thread cache of the ThreadBuffer of the most recently used Log.
+static __thread logging::ThreadBuffer * tls_buffer = NULL;
+static __thread uint64_t tls_buffer_owner = 0;
+
+// Per-thread cache of the debug history of the most recently used Log.
+static __thread logging::History * tls_history = NULL;
+static __thread uint64_t tls_history_owner = 0;
+
+/*
+ * Slot of each thread among the stats shards, handed out on first use
+ * and taken back when the thread exits. The last shard is shared by the
+ * threads that find all the others taken.
+ */
+#define STATS_SHARED_SLOT (STATS_SHARDS - 1)
+static uint8_t stats_slot_taken[STATS_SHARED_SLOT];
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static __thread int tls_stats_slot = -1;
+
+// Kernel id of the thread, cached on first use; reset in a forked child.
+static __thread uint32_t tls_thread_id = 0;
+static pthread_once_t thread_id_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Name and context fields of the thread, with the two preformatted as
+ * "[<name> <key>=<value> ...] " in text, which log_body() copies to the
+ * start of every message.
+ */
+typedef struct {
+  char name[THREAD_NAME_SIZE];
+  size_t fields;
+  char keys[CONTEXT_FIELDS][CONTEXT_KEY_SIZE];
+  char values[CONTEXT_FIELDS][CONTEXT_VALUE_SIZE];
+  char text[CONTEXT_SIZE];
+  size_t len;
+} thread_context_t;
+
+static __thread thread_context_t tls_context;
+
+/*
+ * Histograms of a thread, one per scope timer, allocated on its first
+ * use of the timer. Only the thread writes them; when it exits, they
+ * are handed to the next new thread, like the debug histories.
+ */
+typedef struct timer_thread_t {
+  logging::timer_hist_t * hists[TIMERS_MAX];
+  bool orphaned;
+  struct timer_thread_t * next;
+} timer_thread_t;
+
+/*
+ * Scope timers, never freed, and the totals of each already logged. Only
+ * the root log summarizes them, so there is one set of totals.
+ */
+static pthread_mutex_t timers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static logging::log_timer_t timers[TIMERS_MAX];
+static unsigned int timer_count = 0;
+static logging::timer_hist_t * timers_logged[TIMERS_MAX];
+static uint64_t timer_buckets[TIMER_BUCKETS];   // Merged, under timers_mutex.
+static timer_thread_t * timer_threads = NULL;
+static pthread_key_t timer_key;
+static pthread_once_t timer_key_once = PTHREAD_ONCE_INIT;
+static __thread timer_thread_t * tls_timer_thread = NULL;
+
+static uint64_t monotonic_ns(void);
+
+/*
+ * Add to a counter of a stats shard. A shard has only one writer, so
+ * this is a plain load and store rather than a locked add, except for
+ * the shared one, used once STATS_SHARDS - 1 threads are logging.
+ */
+static inline void
+stats_add(uint64_t * counter,
+          uint64_t n)
+{
+  if (__builtin_expect(tls_stats_slot == STATS_SHARED_SLOT, 0)) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+#define RECORD_WRAP 0x1
+#define RECORD_DEFERRED 0x2
+#define RECORD_CONTEXT 0x4
+#define RECORD_ALIGN(len) (((len) + 7) & ~((size_t) 7))
+#define SINK_IOV_MAX 256
 
 const char * logging::log_level_str[logging::TOTAL_LOG_LEVELS] = { 
   "FATAL",
@@ -56,330 +171,6905 @@ const char * logging::log_level_str[logging::TOTAL_LOG_LEVELS] = {
 };
 
 
-// Initialize the logging library.
-void
-logging::init_logging(const std::string& path,
-                      logging::log_level_t level,
-                      bool sigsegv_handling,
-                      bool fatal_handling)
+// Default logging options.
+logging::log_options_t::log_options_t()
 {
-  if (logging::is_logging_initialized) {
-    fprintf(stderr, "You called init_logging() twice!\n");
-    return;
-  }
+  this->sigsegv_handling = true;
+  this->fatal_handling = true;
+  this->mode = logging::SYNC_LOGGING;
+  this->ring_size = ASYNC_RING_SIZE;
+  this->poll_usec = ASYNC_POLL_USEC;
+  this->per_cpu_buffers = false;
+  this->deferred_format = false;
+  this->time_precision = logging::TIME_SEC;
+  this->utc_time = false;
+  this->iso8601_time = false;
+  this->coarse_clock = false;
+  this->batch_size = 0;
+  this->batch_msec = 0;
+  this->rotate_bytes = 0;
+  this->rotate_sec = 0;
+  this->rotate_naming = ROTATE_NUMBERED;
+  this->rotate_keep = 0;
+  this->stats_sec = 0;
+  this->overflow_policy = logging::OVERFLOW_FLUSH;
+  this->overflow_wait_usec = OVERFLOW_WAIT_USEC;
+  this->overflow_max_bytes = OVERFLOW_MAX_BYTES;
+  this->recorder_size = RECORDER_SIZE;
+  this->history_entries = 0;
+  this->history_level = logging::DEBUG;
+  this->history_all_threads = false;
+  this->index_bytes = 0;
+  this->index_records = 0;
+  this->multi_process = false;
+  this->stack_trace_depth = STACK_TRACE_DEPTH;
+  this->dedup_msec = 0;
+  this->dedup_by_site = false;
+  this->block_size = 0;
+  this->block_msec = BLOCK_MSEC;
+  this->timer_sec = 0;
+}
 
-  try {
-    log = new logging::Log(path, level,
-                           sigsegv_handling, fatal_handling);
-  } catch (const char * err) {
-    throw err;
-  }
 
-  logging::is_logging_initialized = true;
+// Default query: every line.
+logging::log_query_t::log_query_t()
+{
+  this->from_ns = 0;
+  this->to_ns = UINT64_MAX;
+  this->level = logging::DEBUG;
+  this->thread = -1;
+  this->utc = false;
 }
 
 
-// Stop the logging.
-void 
-logging::stop_logging(void)
+/*
+ * Registry of the call sites that have run, and the rules that enable
+ * or disable them regardless of the log level. Both are only changed
+ * under sites_mutex; the sites only see the result, in their state.
+ */
+typedef struct {
+  std::string file_glob;
+  unsigned int line;          // 0 for any line.
+  logging::log_level_t level; // Enable the sites at least this severe.
+  bool enabled;
+} site_rule_t;
+
+static pthread_mutex_t sites_mutex = PTHREAD_MUTEX_INITIALIZER;
+static logging::log_site_t * sites = NULL;
+static std::vector<site_rule_t> site_rules;
+static std::string site_rules_file;
+static bool site_rules_reload = false;
+static int history_level = -1;     // Sites kept in the debug history.
+
+
+// Whether a rule applies to a call site.
+static bool
+site_rule_matches(const site_rule_t& rule,
+                  const logging::log_site_t * site)
 {
-  if (!logging::is_logging_initialized) {
-    fprintf(stderr, "You should call init_logging() before stop_logging()!\n");
-    return;
-  }
+  return (rule.line == 0 || rule.line == site->line) &&
+         (!rule.enabled || site->level <= rule.level) &&
+         fnmatch(rule.file_glob.c_str(), site->file, 0) == 0;
+}
 
-  if (logging::log) {
-    delete logging::log;
-    logging::log = NULL;
-  }
 
-  logging::is_logging_initialized = false;
+/*
+ * State of a call site: the last rule that applies, or the log level.
+ * A site below the log level may still be kept in the debug history.
+ */
+static uint8_t
+site_state(const logging::log_site_t * site)
+{
+  logging::log_level_t level =
+      __atomic_load_n(&logging::current_level, __ATOMIC_RELAXED);
+  uint8_t state = (site->level <= level) ? logging::SITE_ON :
+                  ((int) site->level <= history_level) ? logging::SITE_HISTORY :
+                  logging::SITE_OFF;
+  for (size_t i = 0; i < site_rules.size(); ++i) {
+    if (site_rule_matches(site_rules[i], site)) {
+      state = site_rules[i].enabled ? logging::SITE_ON : logging::SITE_OFF;
+    }
+  }
+  return state;
 }
 
 
-// Constructor
-logging::Log::Log(const std::string& path,
-                  logging::log_level_t level,
-                  bool sigsegv_handling,
-                  bool fatal_handling)
+// Recompute the state of every registered call site.
+static void
+refresh_sites(void)
 {
-  // Default values.
-  this->path = path;
-  this->outfp = NULL;
-  this->log_level = level;
-  this->log_buf_size = 0;
-  this->kill_runner = false;
-  this->fatal_handling = fatal_handling;
+  pthread_mutex_lock(&sites_mutex);
+  for (logging::log_site_t * site = sites; site; site = site->next) {
+    __atomic_store_n(&(site->state), site_state(site), __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&sites_mutex);
+}
 
-  // Create the log buffer.
-  this->log_buf = new char[LOG_BUF_SIZE];
-  if (this->log_buf == NULL) {
-    throw "Unable to create log buffer";
+
+// Register a call site on its first call, and tell whether it is enabled.
+bool
+logging::register_site(logging::log_site_t * site)
+{
+  pthread_mutex_lock(&sites_mutex);
+  if (site->state == SITE_UNREGISTERED) {
+    site->next = sites;
+    sites = site;
   }
+  uint8_t state = site_state(site);
+  __atomic_store_n(&(site->state), state, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&sites_mutex);
+  return state == SITE_ON;
+}
 
-  pthread_mutex_init(&(this->mutex), NULL);
 
-  // sanity check, and set the log output.
-  if (path.empty() ||
-      path.at(0) != '/') {
-    fprintf(stderr, "No valid log path specified. Redirecting to stderr\n");
-    outfp = stderr;
-  } else {
-    try {
-      set_log_file(path);
-    } catch (const char* err) {
-      throw err;
+// Add a rule, and apply it to the registered call sites.
+static size_t
+add_site_rule(const site_rule_t& rule)
+{
+  size_t count = 0;
+  pthread_mutex_lock(&sites_mutex);
+  site_rules.push_back(rule);
+  for (logging::log_site_t * site = sites; site; site = site->next) {
+    if (site_rule_matches(rule, site)) {
+      __atomic_store_n(&(site->state), site_state(site), __ATOMIC_RELAXED);
+      ++count;
     }
   }
+  pthread_mutex_unlock(&sites_mutex);
+  return count;
+}
 
-  // Handle SIGSEGV if required.
-  if (sigsegv_handling) {
-    signal(SIGSEGV, detect_sigsegv);
-  }
-  signal(SIGUSR1, sigusr1_handler);
 
-  // Runnner thread to flush log buffer every 5 min.
-  pthread_create(&(this->runner_id), NULL, Runner, NULL);
+/*
+ * Enable the call sites of the files matching file_glob (an fnmatch(3)
+ * pattern on __FILE__), at line unless it is 0, and at least as severe as
+ * level, whatever the log level. Sites that have not run yet are enabled
+ * when they do. Returns the number of registered sites it applies to.
+ */
+size_t
+logging::enable_sites(const char * file_glob,
+                      unsigned int line,
+                      logging::log_level_t level)
+{
+  site_rule_t rule = { file_glob, line, level, true };
+  return add_site_rule(rule);
 }
 
 
-// Destructor
-logging::Log::~Log()
+// Disable the matching call sites, whatever the log level.
+size_t
+logging::disable_sites(const char * file_glob,
+                       unsigned int line)
 {
-  this->destroy_runner();
-  sleep(1);
-  pthread_kill(this->runner_id, SIGUSR1);
-  pthread_join(this->runner_id, NULL);
-  this->flush_buffer();
-  this->do_cleanup();
-  signal(SIGSEGV, SIG_DFL);
-  signal(SIGUSR1, SIG_DFL);
+  site_rule_t rule = { file_glob, line, logging::DEBUG, false };
+  return add_site_rule(rule);
 }
 
 
-// Ask the runner thread to destroy.
+// Drop all the rules; the call sites follow the log level again.
 void
-logging::Log::destroy_runner(void)
+logging::clear_site_rules(void)
 {
-  pthread_mutex_lock(&(this->mutex));
-  this->kill_runner = true;
-  pthread_mutex_unlock(&(this->mutex));
+  pthread_mutex_lock(&sites_mutex);
+  site_rules.clear();
+  pthread_mutex_unlock(&sites_mutex);
+  refresh_sites();
 }
 
 
-// Function to flush the log buffer.
-void
-logging::Log::flush_buffer(void)
+/*
+ * Replace the rules with those of a control file, one per line:
+ *   enable <file glob>[:<line>] [FATAL|ERROR|WARNING|INFO|DEBUG]
+ *   disable <file glob>[:<line>]
+ * Blank lines and lines starting with '#' are skipped.
+ */
+bool
+logging::load_site_rules(const char * path)
 {
-  pthread_mutex_lock(&(this->mutex));
+  FILE * fp = fopen(path, "r");
+  if (fp == NULL) {
+    return false;
+  }
 
-  if (this->log_buf_size > 0) {
-    this->log_buf[this->log_buf_size] = '\0';
-    fputs(this->log_buf, this->outfp);
-    this->log_buf_size = 0;
+  std::vector<site_rule_t> rules;
+  char buf[LOG_BUF_SIZE];
+  while (fgets(buf, sizeof buf, fp)) {
+    char action[16], glob[LOG_BUF_SIZE], level_str[16];
+    int fields = sscanf(buf, "%15s %4095s %15s", action, glob, level_str);
+    if (fields < 2 || action[0] == '#') {
+      continue;
+    }
+
+    site_rule_t rule = { glob, 0, logging::DEBUG, strcmp(action, "enable") == 0 };
+    if (!rule.enabled && strcmp(action, "disable") != 0) {
+      continue;
+    }
+    size_t colon = rule.file_glob.rfind(':');
+    if (colon != std::string::npos &&
+        strspn(rule.file_glob.c_str() + colon + 1, "0123456789") ==
+        rule.file_glob.size() - colon - 1) {
+      rule.line = atoi(rule.file_glob.c_str() + colon + 1);
+      rule.file_glob.erase(colon);
+    }
+    if (fields == 3) {
+      for (int l = 0; l < TOTAL_LOG_LEVELS; ++l) {
+        if (strcmp(level_str, logging::log_level_str[l]) == 0) {
+          rule.level = (logging::log_level_t) l;
+        }
+      }
+    }
+    rules.push_back(rule);
   }
+  fclose(fp);
 
-  pthread_mutex_unlock(&(this->mutex));
+  pthread_mutex_lock(&sites_mutex);
+  site_rules.swap(rules);
+  pthread_mutex_unlock(&sites_mutex);
+  refresh_sites();
+  return true;
 }
 
 
-// Flush the log buffer, and write a string to the log file.
+/*
+ * Ask the runner to reload log_options_t::site_rules_file. It only sets
+ * a flag, so it may be called from a signal handler.
+ */
 void
-logging::Log::write_to_log(char * str,
-                           size_t len)
+logging::reload_site_rules(void)
 {
-  this->flush_buffer();
-  str[len] = '\0';
-  pthread_mutex_lock(&(this->mutex));
-  fputs(str, this->outfp);
-  pthread_mutex_unlock(&(this->mutex));
+  __atomic_store_n(&site_rules_reload, true, __ATOMIC_RELAXED);
 }
 
 
-// Free all memory and destroy mutex.
-void
-logging::Log::do_cleanup(void)
+// Reload the site rules if asked to; called by the runner.
+static void
+reload_site_rules_if_requested(void)
 {
-  pthread_mutex_lock(&(this->mutex));
-  if (this->kill_runner) {
-    if (this->outfp != stderr) {
-      fclose(this->outfp);
+  if (__atomic_exchange_n(&site_rules_reload, false, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&sites_mutex);
+    std::string path = site_rules_file;
+    pthread_mutex_unlock(&sites_mutex);
+    if (!path.empty()) {
+      logging::load_site_rules(path.c_str());
     }
-    delete[] this->log_buf;
-  }
-  pthread_mutex_unlock(&(this->mutex));
-  if (this->kill_runner) {
-    pthread_mutex_destroy(&(this->mutex));
   }
 }
 
 
-// Set the path to log file.
-void
-logging::Log::set_log_file(const std::string& path)
+// Get the call sites registered so far; returns how many there are.
+size_t
+logging::get_sites(std::vector<logging::log_site_t *> * list)
 {
-  FILE * fp = NULL;
-  if ((fp = fopen(path.c_str(), "a")) == NULL) {
-    outfp = stderr;
-    throw "Unable to create log file";
+  pthread_mutex_lock(&sites_mutex);
+  for (logging::log_site_t * site = sites; site; site = site->next) {
+    list->push_back(site);
   }
-
-  outfp = fp;
-  setvbuf(outfp, NULL, _IOLBF, 0);
+  pthread_mutex_unlock(&sites_mutex);
+  return list->size();
 }
 
 
-// Get the current time.
-void
-logging::get_current_time(char ** time_str)
+/*
+ * Registry of the named loggers, newest first, ending with the root
+ * logger. Loggers are only added, under loggers_mutex, which also guards
+ * what they have of their own; LOG_TO() only reads what is in effect.
+ */
+static pthread_mutex_t loggers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static logging::logger_t root_logger = { "", NULL, NULL, logging::DEBUG, NULL,
+                                         true, logging::DEBUG, NULL };
+static logging::logger_t * loggers = &root_logger;
+
+
+/*
+ * Recompute the level and the output in effect of every logger, from
+ * the nearest ancestor that has its own. The caller holds loggers_mutex.
+ */
+static void
+refresh_loggers(void)
 {
-  time_t t;
-  time(&t);
-  struct tm* tm = localtime(&t);
-  sprintf(*time_str, "%02d-%02d-%04d %02d:%02d:%02d",
-                      tm->tm_mday, tm->tm_mon + 1,
-                      tm->tm_year + 1900, tm->tm_hour,
-                      tm->tm_min, tm->tm_sec);
+  for (logging::logger_t * logger = loggers; logger; logger = logger->next) {
+    logging::logger_t * p = logger;
+    while (!p->has_level) {
+      p = p->parent;
+    }
+    __atomic_store_n(&(logger->level), p->own_level, __ATOMIC_RELAXED);
+    p = logger;
+    while (p->own_log == NULL && p->parent) {
+      p = p->parent;
+    }
+    __atomic_store_n(&(logger->log), p->own_log, __ATOMIC_RELEASE);
+  }
 }
 
 
-// Function to log a message depending on its severity.
-void
-logging::Log::log_msg(LOG_FUNC_SIGNATURE,
-                      const char *fmt,
-                      ...)
+/*
+ * Find a logger by name, creating it and its missing ancestors. The
+ * caller holds loggers_mutex.
+ */
+static logging::logger_t *
+get_logger_locked(const char * name)
 {
-  if (level <= this->log_level) {
-    char tmp[LOG_BUF_SIZE];
-    memset(tmp, 0, sizeof tmp);
-    va_list args;
-    va_start(args, fmt);
-    vsprintf(tmp, fmt, args);
-    va_end(args);
+  for (logging::logger_t * logger = loggers; logger; logger = logger->next) {
+    if (strcmp(logger->name, name) == 0) {
+      return logger;
+    }
+  }
 
-    // Get current time
-    char * time_str = new char[TIME_BUF_SIZE];
-    get_current_time(&time_str);
+  const char * dot = strrchr(name, '.');
+  logging::logger_t * parent = dot ?
+      get_logger_locked(std::string(name, dot - name).c_str()) : &root_logger;
+  logging::logger_t * logger = new logging::logger_t;
+  logger->name = strdup(name);
+  logger->parent = parent;
+  logger->level = parent->level;
+  logger->log = parent->log;
+  logger->has_level = false;
+  logger->own_level = logging::DEBUG;
+  logger->own_log = NULL;
+  logger->next = loggers;
+  __atomic_store_n(&loggers, logger, __ATOMIC_RELEASE);
+  return logger;
+}
 
-    // Generate the complete log message.
-    char log_str[LOG_BUF_SIZE];
-    memset(log_str, 0, sizeof log_str);
-    int str_size = sprintf(log_str, "%s, %7s Thread %5d, %s:%d => %s\n",
-                           time_str, get_level_str(level), uid,
-                           file_name, line, tmp);
-    delete[] time_str;
-
-    if (level == FATAL) {
-      this->write_to_log(log_str, str_size);
-      if (this->fatal_handling) {
-        pthread_mutex_lock(&(this->mutex));
-        fprintf(logging::log->outfp, "\n*** FATAL Error detected; stack trace: ***\n");
-        size_t size = 0;
-        char **str = get_stack_trace(&size);
-        for (size_t i = 0; i < size; ++i) {
-          fprintf(this->outfp, "@\t%s\n", str[i]);
-        }
-        free(str);
-        pthread_mutex_unlock(&(this->mutex));
 
-        logging::stop_logging();
-        exit(EXIT_STATUS_FATAL);
-      }
-    } else if (log_buf_size + str_size >= LOG_BUF_SIZE ||
-               level == ERROR) {
-      this->write_to_log(log_str, str_size);
-    } else {
-      // Buffer the log messages if not required instantly.
-      pthread_mutex_lock(&(this->mutex));
-      memcpy(this->log_buf + this->log_buf_size, log_str, str_size);
-      this->log_buf_size += str_size;
-      pthread_mutex_unlock(&(this->mutex));
+// Set what the root logger has of its own: the log of init_logging().
+static void
+set_root_logger(logging::Log * log,
+                logging::log_level_t level)
+{
+  pthread_mutex_lock(&loggers_mutex);
+  root_logger.own_log = log;
+  root_logger.own_level = level;
+  refresh_loggers();
+  pthread_mutex_unlock(&loggers_mutex);
+}
+
+
+// Close the outputs of all the named loggers, which then use the root log.
+static void
+stop_loggers(void)
+{
+  std::vector<logging::Log *> logs;
+  pthread_mutex_lock(&loggers_mutex);
+  for (logging::logger_t * logger = loggers; logger; logger = logger->next) {
+    if (logger != &root_logger && logger->own_log) {
+      logs.push_back(logger->own_log);
+      logger->own_log = NULL;
     }
   }
+  refresh_loggers();
+  pthread_mutex_unlock(&loggers_mutex);
+
+  for (size_t i = 0; i < logs.size(); ++i) {
+    delete logs[i];
+  }
 }
 
 
 /*
- * Runner thread that flushes the log buffer
- * every 5 minutes.
+ * Get the logger of a name, such as "net.rpc", creating it if needed;
+ * "" is the root logger. The result never changes, so it may be kept.
  */
-void *
-logging::Runner(void *arg)
+logging::logger_t *
+logging::get_logger(const char * name)
 {
-  while (1) {
-    sleep(300);     // Sleep for 5 minutes.
+  pthread_mutex_lock(&loggers_mutex);
+  logging::logger_t * logger = get_logger_locked(name);
+  pthread_mutex_unlock(&loggers_mutex);
+  return logger;
+}
 
-    pthread_mutex_lock(&(logging::log->mutex));
-    if (logging::log->kill_runner) {
-      pthread_mutex_unlock(&(logging::log->mutex));
-      return NULL;
-    }
-    pthread_mutex_unlock(&(logging::log->mutex));
 
-    logging::log->flush_buffer();
+/*
+ * Set the level of a logger, and of its descendants that do not have
+ * their own. For the root logger, this is set_log_level().
+ */
+void
+logging::set_logger_level(const char * name,
+                          logging::log_level_t level)
+{
+  if (name[0] == '\0') {
+    logging::set_log_level(level);
+    return;
   }
 
-  return NULL;
+  pthread_mutex_lock(&loggers_mutex);
+  logging::logger_t * logger = get_logger_locked(name);
+  logger->has_level = true;
+  logger->own_level = level;
+  refresh_loggers();
+  pthread_mutex_unlock(&loggers_mutex);
 }
 
 
-// Get the logging severity level in string form.
-const char *
-logging::get_level_str(logging::log_level_t level)
+/*
+ * Give a logger a log of its own, with its own file, options and level,
+ * for it and its descendants that do not have theirs. It has its own
+ * mutex, buffers and runner thread, so that it does not contend with the
+ * others. For the root logger, this is init_logging().
+ */
+void
+logging::init_logger(const char * name,
+                     const std::string& path,
+                     logging::log_level_t level,
+                     const logging::log_options_t& options)
 {
-  if (level >= 0 && level < TOTAL_LOG_LEVELS) {
-    return log_level_str[level];
+  if (name[0] == '\0') {
+    logging::init_logging(path, level, options);
+    return;
   }
-  return NULL;
+
+  pthread_mutex_lock(&loggers_mutex);
+  logging::logger_t * logger = get_logger_locked(name);
+  if (logger->own_log) {
+    pthread_mutex_unlock(&loggers_mutex);
+    fprintf(stderr, "You called init_logger() twice for %s!\n", name);
+    return;
+  }
+
+  // The scope timers are summarized by the root log only.
+  logging::log_options_t own_options = options;
+  own_options.timer_sec = 0;
+  try {
+    logger->own_log = new logging::Log(path, level, own_options);
+  } catch (const char * err) {
+    pthread_mutex_unlock(&loggers_mutex);
+    throw err;
+  }
+  logger->has_level = true;
+  logger->own_level = level;
+  refresh_loggers();
+  pthread_mutex_unlock(&loggers_mutex);
 }
 
 
-// Get the current thread id.
-uint16_t
-logging::Log::get_thread_id(void)
+/*
+ * Close the log of a logger, which then uses that of its ancestors; it
+ * keeps its level. No thread should be logging to it any more.
+ */
+void
+logging::stop_logger(const char * name)
 {
-  return pthread_self();
+  if (name[0] == '\0') {
+    logging::stop_logging();
+    return;
+  }
+
+  pthread_mutex_lock(&loggers_mutex);
+  logging::logger_t * logger = get_logger_locked(name);
+  logging::Log * log = logger->own_log;
+  logger->own_log = NULL;
+  refresh_loggers();
+  pthread_mutex_unlock(&loggers_mutex);
+
+  if (log == NULL) {
+    fprintf(stderr, "You should call init_logger() before stop_logger()!\n");
+    return;
+  }
+  delete log;
 }
 
 
-// Get the current stack trace.
-char **
-logging::get_stack_trace(size_t *size)
+// Initialize the logging library.
+void
+logging::init_logging(const std::string& path,
+                      logging::log_level_t level,
+                      bool sigsegv_handling,
+                      bool fatal_handling)
 {
-  void *arr[STACK_TRACE_LIMIT];
-  *size = backtrace(arr, STACK_TRACE_LIMIT);
-  char **str  = backtrace_symbols(arr, *size);
-  return str;
+  logging::log_options_t options;
+  options.sigsegv_handling = sigsegv_handling;
+  options.fatal_handling = fatal_handling;
+  logging::init_logging(path, level, options);
 }
 
 
-// Detect SIGSEGV and log stack trace.
+// Initialize the logging library with the given options.
 void
-logging::detect_sigsegv(int sig_no)
+logging::init_logging(const std::string& path,
+                      logging::log_level_t level,
+                      const logging::log_options_t& options)
+{
+  if (logging::is_logging_initialized) {
+    fprintf(stderr, "You called init_logging() twice!\n");
+    return;
+  }
+
+  try {
+    log = new logging::Log(path, level, options);
+  } catch (const char * err) {
+    throw err;
+  }
+
+  logging::is_logging_initialized = true;
+  __atomic_store_n(&logging::current_level, level, __ATOMIC_RELAXED);
+  set_root_logger(log, level);
+  pthread_mutex_lock(&sites_mutex);
+  site_rules_file = options.site_rules_file;
+  history_level = (options.history_entries > 0) ? options.history_level : -1;
+  pthread_mutex_unlock(&sites_mutex);
+  if (!options.site_rules_file.empty()) {
+    logging::load_site_rules(options.site_rules_file.c_str());
+  }
+  refresh_sites();
+}
+
+
+// Stop the logging.
+void 
+logging::stop_logging(void)
 {
-  // Get the current time.
-  char * time_str = new char[TIME_BUF_SIZE];
-  get_current_time(&time_str);
+  if (!logging::is_logging_initialized) {
+    fprintf(stderr, "You should call init_logging() before stop_logging()!\n");
+    return;
+  }
 
-  logging::log->destroy_runner();
-  logging::log->flush_buffer();
+  // The logs of the named loggers are closed too.
+  stop_loggers();
 
-  // Get the stack trace, and log it.
-  size_t size = 0;
-  char ** str = logging::get_stack_trace(&size);
-  pthread_mutex_lock(&(logging::log->mutex));
-  fprintf(logging::log->outfp, "\n*** Aborted at %s ***\n", time_str);
-  fprintf(logging::log->outfp, "*** SIGSEGV received by PID %d; stack trace: ***\n",
-                               logging::log->get_thread_id());
-  for (size_t i = 0; i < size; ++i) {
-    fprintf(logging::log->outfp, "@\t%s\n", str[i]);
-  }
-  free(str);
-  delete[] time_str;
-  pthread_mutex_unlock(&(logging::log->mutex));
-
-  logging::stop_logging();
-  exit(EXIT_STATUS_SIGSEGV);
+  // No more messages for the debug history of the log going away.
+  pthread_mutex_lock(&sites_mutex);
+  history_level = -1;
+  pthread_mutex_unlock(&sites_mutex);
+  refresh_sites();
+
+  set_root_logger(NULL, logging::DEBUG);
+  if (logging::log) {
+    delete logging::log;
+    logging::log = NULL;
+  }
+
+  logging::is_logging_initialized = false;
+  __atomic_store_n(&logging::current_level, logging::DEBUG, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&sites_mutex);
+  site_rules_file.clear();
+  pthread_mutex_unlock(&sites_mutex);
+  refresh_sites();
+}
+
+
+// Change the logging severity level at runtime.
+void
+logging::set_log_level(logging::log_level_t level)
+{
+  if (!logging::is_logging_initialized) {
+    fprintf(stderr, "Should call init_logging() first!\n");
+    return;
+  }
+
+  logging::log->set_log_level(level);
+  __atomic_store_n(&logging::current_level, level, __ATOMIC_RELAXED);
+  set_root_logger(logging::log, level);
+  refresh_sites();
+}
+
+
+// Add a sink to the log, which then owns it.
+void
+logging::add_sink(logging::Sink * sink)
+{
+  if (!logging::is_logging_initialized) {
+    fprintf(stderr, "Should call init_logging() first!\n");
+    return;
+  }
+
+  logging::log->add_sink(sink);
+}
+
+
+// Remove a sink from the log; the caller owns it again.
+bool
+logging::remove_sink(logging::Sink * sink)
+{
+  if (!logging::is_logging_initialized) {
+    fprintf(stderr, "Should call init_logging() first!\n");
+    return false;
+  }
+
+  return logging::log->remove_sink(sink);
+}
+
+
+// Ask for the log files to be reopened; safe in a signal handler.
+void
+logging::reopen(void)
+{
+  logging::Log * log = logging::log;
+  if (log) {
+    log->reopen();
+  }
+}
+
+
+// Snapshot of the log's own counters; false if logging is not initialized.
+bool
+logging::get_stats(logging::log_stats_t * stats)
+{
+  logging::Log * log = logging::log;
+  if (log == NULL) {
+    memset(stats, 0, sizeof *stats);
+    return false;
+  }
+  log->get_stats(stats);
+  return true;
+}
+
+
+/*
+ * Write the stats on one line, as space separated name=value pairs;
+ * flush_p99_ns is the upper bound of the histogram bucket. Returns the
+ * length, like snprintf().
+ */
+size_t
+logging::format_stats(char * buf,
+                      size_t size,
+                      const logging::log_stats_t& stats)
+{
+  static const char * causes[logging::TOTAL_FLUSH_CAUSES] = {
+    "full", "error", "timer", "shutdown", "request",
+  };
+
+  size_t len = 0;
+#define STATS_PRINT(...) \
+  len += snprintf(buf + (len < size ? len : size), \
+                  len < size ? size - len : 0, __VA_ARGS__)
+
+  for (int i = 0; i < logging::TOTAL_LOG_LEVELS; ++i) {
+    STATS_PRINT("%s%s=%lu/%lu", i ? " " : "", logging::log_level_str[i],
+                (unsigned long) stats.messages[i],
+                (unsigned long) stats.bytes[i]);
+  }
+  uint64_t flushes = 0;
+  for (int i = 0; i < logging::TOTAL_FLUSH_CAUSES; ++i) {
+    STATS_PRINT(" flush_%s=%lu", causes[i], (unsigned long) stats.flushes[i]);
+    flushes += stats.flushes[i];
+  }
+
+  uint64_t p99 = 0, seen = 0;
+  for (size_t i = 0; i < STATS_HIST_BUCKETS && flushes > 0; ++i) {
+    seen += stats.flush_hist[i];
+    if (seen * 100 >= flushes * 99) {
+      p99 = (2ULL << i) - 1;
+      break;
+    }
+  }
+  STATS_PRINT(" dropped=%lu truncated=%lu collapsed=%lu lock_acquires=%lu "
+              "lock_waits=%lu lock_wait_ns=%lu flush_avg_ns=%lu "
+              "flush_p99_ns=%lu flush_max_ns=%lu",
+              (unsigned long) stats.dropped, (unsigned long) stats.truncated,
+              (unsigned long) stats.collapsed,
+              (unsigned long) stats.lock_acquires,
+              (unsigned long) stats.lock_waits,
+              (unsigned long) stats.lock_wait_ns,
+              (unsigned long) (flushes ? stats.flush_ns / flushes : 0),
+              (unsigned long) p99, (unsigned long) stats.flush_max_ns);
+#undef STATS_PRINT
+
+  return len;
+}
+
+
+// Constructor
+logging::Log::Log(const std::string& path,
+                  logging::log_level_t level,
+                  bool sigsegv_handling,
+                  bool fatal_handling)
+{
+  logging::log_options_t options;
+  options.sigsegv_handling = sigsegv_handling;
+  options.fatal_handling = fatal_handling;
+  this->init(path, level, options);
+}
+
+
+// Constructor
+logging::Log::Log(const std::string& path,
+                  logging::log_level_t level,
+                  const logging::log_options_t& options)
+{
+  this->init(path, level, options);
+}
+
+
+// Signals caught by detect_sigsegv().
+static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+#define CRASH_SIGNALS (sizeof crash_signals / sizeof crash_signals[0])
+
+// Preallocated for the crash handler, which must not allocate.
+static char crash_stack[CRASH_STACK_SIZE];
+static char crash_buf[2 * LOG_BUF_SIZE];
+static void * crash_frames[STACK_TRACE_LIMIT];
+static int crash_in_progress = 0;
+
+// Logs that installed the crash handler; the last one puts back the default.
+static int crash_handler_users = 0;
+
+
+/*
+ * Catch the crash signals on an alternate stack, so that a stack
+ * overflow in the thread that called init_logging() is caught too.
+ */
+static void
+install_crash_handler(void)
+{
+  // backtrace() loads libgcc on its first call, which allocates.
+  void * arr[1];
+  backtrace(arr, 1);
+  __atomic_add_fetch(&crash_handler_users, 1, __ATOMIC_ACQ_REL);
+
+  stack_t ss;
+  ss.ss_sp = crash_stack;
+  ss.ss_size = sizeof crash_stack;
+  ss.ss_flags = 0;
+  sigaltstack(&ss, NULL);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_sigaction = logging::detect_sigsegv;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;
+  for (size_t i = 0; i < CRASH_SIGNALS; ++i) {
+    sigaction(crash_signals[i], &sa, NULL);
+  }
+}
+
+
+// Thread exit hook; the runner frees the buffer once it is drained.
+static void
+release_thread_buffer(void * arg)
+{
+  logging::ThreadBuffer * tb = (logging::ThreadBuffer *) arg;
+  __atomic_store_n(&(tb->orphaned), true, __ATOMIC_RELEASE);
+}
+
+
+// Thread exit hook; the history is handed to the next new thread.
+static void
+release_history(void * arg)
+{
+  logging::History * history = (logging::History *) arg;
+  __atomic_store_n(&(history->orphaned), true, __ATOMIC_RELEASE);
+}
+
+
+// Thread exit hook; the stats slot goes to the next new thread.
+static void
+release_stats_slot(void * arg)
+{
+  size_t slot = (uintptr_t) arg - 1;
+  __atomic_store_n(&(stats_slot_taken[slot]), 0, __ATOMIC_RELEASE);
+}
+
+
+// Create the key that tells when a thread with a stats slot exits.
+static void
+create_stats_key(void)
+{
+  pthread_key_create(&stats_key, release_stats_slot);
+}
+
+
+// Thread exit hook; the timer histograms go to the next new thread.
+static void
+release_timer_thread(void * arg)
+{
+  timer_thread_t * t = (timer_thread_t *) arg;
+  __atomic_store_n(&(t->orphaned), true, __ATOMIC_RELEASE);
+}
+
+
+// Create the key that tells when a thread with timer histograms exits.
+static void
+create_timer_key(void)
+{
+  pthread_key_create(&timer_key, release_timer_thread);
+}
+
+
+// Bytes taken by a log_buffer_t and what it points to.
+#define LOG_BUFFER_BYTES (sizeof(logging::log_buffer_t) + 2 * LOG_BUF_SIZE + \
+                          LOG_BUF_RECS * sizeof(logging::log_record_t))
+
+// Allocate an empty log buffer.
+static logging::log_buffer_t *
+new_log_buffer(void)
+{
+  logging::log_buffer_t * lb = new logging::log_buffer_t;
+  lb->buf = new char[2 * LOG_BUF_SIZE];
+  lb->recs = new logging::log_record_t[LOG_BUF_RECS];
+  lb->size = 0;
+  lb->count = 0;
+  lb->next = NULL;
+  return lb;
+}
+
+
+// Free a log buffer.
+static void
+delete_log_buffer(logging::log_buffer_t * lb)
+{
+  delete[] lb->buf;
+  delete[] lb->recs;
+  delete lb;
+}
+
+
+// Shared constructor body.
+void
+logging::Log::init(const std::string& path,
+                   logging::log_level_t level,
+                   const logging::log_options_t& options)
+{
+  // Default values.
+  this->path = path;
+  this->default_sink = NULL;
+  this->batch_size = options.batch_size;
+  this->batch_msec = options.batch_msec;
+  this->rotate_bytes = options.rotate_bytes;
+  this->rotate_sec = options.rotate_sec;
+  this->rotate_naming = options.rotate_naming;
+  this->rotate_keep = options.rotate_keep;
+  this->index_bytes = options.index_bytes;
+  this->index_records = options.index_records;
+  this->multi_process = options.multi_process;
+  this->block_size = options.block_size;
+  this->block_msec = options.block_msec;
+  this->reopen_requested = false;
+  // The runner checks for reload_site_rules() requests as often.
+  this->tick_msec = options.site_rules_file.empty() ? 0 : REOPEN_CHECK_MSEC;
+  this->log_recs_count = 0;
+  this->out_recs = NULL;
+  this->log_level = level;
+  this->log_buf_size = 0;
+  this->kill_runner = false;
+  this->fatal_handling = options.fatal_handling;
+  this->mode = options.mode;
+  this->instance_id = __atomic_add_fetch(&log_instances, 1, __ATOMIC_RELAXED);
+  this->runner_alive = true;
+  this->flush_requests = 0;
+  this->flush_done = 0;
+  this->poll_usec = options.poll_usec > 0 ? options.poll_usec : ASYNC_POLL_USEC;
+  this->threads = NULL;
+  this->cpu_buffers = NULL;
+  this->cpu_count = 0;
+  this->record_seq = 0;
+  this->draining = false;
+  this->out_buf = NULL;
+  this->deferred_format = options.deferred_format;
+  this->time_precision = options.time_precision;
+  this->utc_time = options.utc_time;
+  this->iso8601_time = options.iso8601_time;
+  this->clock_id = options.coarse_clock ? CLOCK_REALTIME_COARSE
+                                        : CLOCK_REALTIME;
+  this->stats = new logging::stats_shard_t[STATS_SHARDS]();
+  this->stats_sec = options.stats_sec;
+  this->timer_sec = options.timer_sec;
+  this->overflow_policy = options.overflow_policy;
+  this->overflow_wait_usec = options.overflow_wait_usec;
+  this->overflow_max_bytes = options.overflow_max_bytes;
+  this->pending = NULL;
+  this->spare = NULL;
+  this->buffers_bytes = 0;
+  this->handoff_requested = false;
+  this->overflow_dropped = 0;
+  this->async_dropped = 0;
+  this->recorder = NULL;
+  this->history_entries = options.history_entries;
+  this->history_all_threads = options.history_all_threads;
+  this->histories = NULL;
+  this->stack_trace_depth = (options.stack_trace_depth < STACK_TRACE_LIMIT) ?
+                            options.stack_trace_depth : STACK_TRACE_LIMIT;
+  this->sigsegv_handling = options.sigsegv_handling;
+  this->dedup_ns = (uint64_t) options.dedup_msec * 1000000;
+  this->dedup_by_site = options.dedup_by_site;
+  this->dedup_slots = NULL;
+  if (this->dedup_ns > 0) {
+    this->dedup_slots = new logging::dedup_slot_t[DEDUP_SLOTS]();
+  }
+
+  // Rings are a power of two, and hold a few records of the maximum size.
+  size_t min_size = 4 * (sizeof(logging::ring_record_t) + LOG_BUF_SIZE);
+  this->ring_size = 1;
+  while (this->ring_size < min_size ||
+         this->ring_size < options.ring_size) {
+    this->ring_size <<= 1;
+  }
+
+  // Create the log buffer, with room for the message that fills it.
+  this->log_buf = new char[2 * LOG_BUF_SIZE];
+  this->log_recs = new logging::log_record_t[LOG_BUF_RECS];
+  if (this->log_buf == NULL) {
+    throw "Unable to create log buffer";
+  }
+
+  pthread_mutex_init(&(this->mutex), NULL);
+  pthread_mutex_init(&(this->runner_mutex), NULL);
+  pthread_mutex_init(&(this->threads_mutex), NULL);
+  pthread_mutex_init(&(this->sinks_mutex), NULL);
+  pthread_mutex_init(&(this->io_mutex), NULL);
+  pthread_mutex_init(&(this->history_mutex), NULL);
+  pthread_cond_init(&(this->runner_cond), NULL);
+  pthread_cond_init(&(this->flush_cond), NULL);
+  pthread_cond_init(&(this->space_cond), NULL);
+
+  if (this->mode == logging::ASYNC_LOGGING) {
+    this->out_buf = new char[ASYNC_OUT_BUF_SIZE];
+    this->out_recs = new logging::log_record_t[ASYNC_OUT_RECS];
+    pthread_key_create(&(this->thread_key), release_thread_buffer);
+  }
+  if (this->mode == logging::ASYNC_LOGGING && options.per_cpu_buffers) {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    this->cpu_count = (cpus > 0) ? cpus : 1;
+    this->cpu_buffers = new logging::ThreadBuffer *[this->cpu_count];
+    for (unsigned int cpu = 0; cpu < this->cpu_count; ++cpu) {
+      logging::ThreadBuffer * tb = new logging::ThreadBuffer(this->ring_size,
+                                                             true);
+      tb->next = this->threads;
+      this->threads = tb;
+      this->cpu_buffers[cpu] = tb;
+    }
+  }
+  if (this->history_entries > 0) {
+    pthread_key_create(&(this->history_key), release_history);
+  }
+
+  if (!options.recorder_path.empty()) {
+    this->recorder = new logging::Recorder(options.recorder_path,
+                                           options.recorder_size);
+  }
+
+  // sanity check, and set the log output.
+  if (path.empty() ||
+      path.at(0) != '/') {
+    fprintf(stderr, "No valid log path specified. Redirecting to stderr\n");
+    this->default_sink = new logging::StderrSink();
+    this->sinks.push_back(this->default_sink);
+  } else {
+    try {
+      set_log_file(path);
+    } catch (const char* err) {
+      throw err;
+    }
+  }
+
+  // Handle SIGSEGV and the other crash signals if required.
+  if (options.sigsegv_handling) {
+    install_crash_handler();
+  }
+
+  /*
+   * Runner thread to flush log buffer every 5 min,
+   * or to drain the thread rings in ASYNC_LOGGING mode.
+   */
+  pthread_create(&(this->runner_id), NULL, Runner, this);
+}
+
+
+// Destructor
+logging::Log::~Log()
+{
+  if (this->mode == logging::ASYNC_LOGGING) {
+    pthread_key_delete(this->thread_key);
+  }
+  if (this->history_entries > 0) {
+    pthread_key_delete(this->history_key);
+  }
+  this->destroy_runner();
+  pthread_join(this->runner_id, NULL);
+  if (this->dedup_slots && this->mode != logging::ASYNC_LOGGING) {
+    this->expire_repeats(UINT64_MAX);
+  }
+  this->flush_buffer(logging::FLUSH_SHUTDOWN);
+  this->do_cleanup();
+  if (this->sigsegv_handling &&
+      __atomic_sub_fetch(&crash_handler_users, 1, __ATOMIC_ACQ_REL) == 0) {
+    for (size_t i = 0; i < CRASH_SIGNALS; ++i) {
+      signal(crash_signals[i], SIG_DFL);
+    }
+  }
+}
+
+
+// Ask the runner thread to destroy.
+void
+logging::Log::destroy_runner(void)
+{
+  pthread_mutex_lock(&(this->runner_mutex));
+  this->kill_runner = true;
+  pthread_cond_signal(&(this->runner_cond));
+  pthread_mutex_unlock(&(this->runner_mutex));
+}
+
+
+/*
+ * Wait until the runner has drained everything that was queued
+ * before this call. Drain on the caller's thread if the runner is gone.
+ */
+void
+logging::Log::sync_backend(void)
+{
+  pthread_mutex_lock(&(this->runner_mutex));
+  if (this->runner_alive) {
+    uint64_t ticket = ++this->flush_requests;
+    pthread_cond_signal(&(this->runner_cond));
+    while (this->runner_alive && this->flush_done < ticket) {
+      pthread_cond_wait(&(this->flush_cond), &(this->runner_mutex));
+    }
+  }
+  bool drain = !this->runner_alive;
+  pthread_mutex_unlock(&(this->runner_mutex));
+
+  if (drain) {
+    this->drain_rings(true);
+  }
+}
+
+
+// Function to flush the log buffer.
+void
+logging::Log::flush_buffer(logging::flush_cause_t cause)
+{
+  uint64_t start = monotonic_ns();
+  if (this->mode == logging::ASYNC_LOGGING) {
+    this->sync_backend();
+  }
+
+  this->lock_mutex();
+  pthread_mutex_lock(&(this->io_mutex));
+  this->flush_locked();
+  this->flush_sinks();
+  if (this->recorder) {
+    this->recorder->set_flushed(this->recorder->get_head());
+  }
+  pthread_mutex_unlock(&(this->io_mutex));
+  pthread_mutex_unlock(&(this->mutex));
+  this->record_flush(cause, start);
+}
+
+
+/*
+ * Flush the buffers waiting for the runner, and then the log buffer, to
+ * the sinks; the caller holds the log mutex and io_mutex.
+ */
+void
+logging::Log::flush_locked(void)
+{
+  while (this->pending) {
+    logging::log_buffer_t * lb = this->pending;
+    this->pending = lb->next;
+    this->dispatch(lb->recs, lb->count);
+    lb->size = 0;
+    lb->count = 0;
+    lb->next = this->spare;
+    this->spare = lb;
+    pthread_cond_broadcast(&(this->space_cond));
+  }
+
+  if (this->log_recs_count > 0) {
+    this->dispatch(this->log_recs, this->log_recs_count);
+    this->log_recs_count = 0;
+    this->log_buf_size = 0;
+    this->log_buf[0] = '\0';
+  }
+}
+
+
+// Flush the log buffer, and write a record to the sinks right away.
+void
+logging::Log::write_to_log(logging::log_level_t level,
+                           uint64_t ns,
+                           const char * str,
+                           size_t len)
+{
+  uint64_t start = monotonic_ns();
+  if (this->mode == logging::ASYNC_LOGGING) {
+    this->sync_backend();
+  }
+
+  logging::log_record_t rec = { level, ns, str, len };
+  this->lock_mutex();
+  pthread_mutex_lock(&(this->io_mutex));
+  this->flush_locked();
+  if (this->recorder) {
+    this->recorder->append(str, len);
+  }
+  this->dispatch(&rec, 1);
+  this->flush_sinks();
+  if (this->recorder) {
+    this->recorder->set_flushed(this->recorder->get_head());
+  }
+  pthread_mutex_unlock(&(this->io_mutex));
+  pthread_mutex_unlock(&(this->mutex));
+  this->record_flush(level <= ERROR ? logging::FLUSH_ERROR
+                                    : logging::FLUSH_FULL, start);
+}
+
+
+/*
+ * Hand records to every sink that wants them; the caller holds the
+ * io_mutex. Sinks that want all the records get the batch as it is.
+ */
+void
+logging::Log::dispatch(const logging::log_record_t * records,
+                       size_t count)
+{
+  uint64_t messages[TOTAL_LOG_LEVELS] = { 0 };
+  uint64_t bytes[TOTAL_LOG_LEVELS] = { 0 };
+  logging::log_level_t least = FATAL;
+  for (size_t i = 0; i < count; ++i) {
+    if (records[i].level > least) {
+      least = records[i].level;
+    }
+    ++messages[records[i].level];
+    bytes[records[i].level] += records[i].len;
+  }
+  logging::log_stats_t * stats = this->get_stats_shard();
+  for (int i = 0; i < TOTAL_LOG_LEVELS; ++i) {
+    if (messages[i] > 0) {
+      stats_add(&(stats->messages[i]), messages[i]);
+      stats_add(&(stats->bytes[i]), bytes[i]);
+    }
+  }
+
+  for (size_t s = 0; s < this->sinks.size(); ++s) {
+    logging::Sink * sink = this->sinks[s];
+    logging::log_level_t level = sink->get_level();
+    if (least <= level) {
+      sink->write(records, count);
+      continue;
+    }
+
+    logging::log_record_t selected[LOG_BUF_RECS];
+    size_t n = 0;
+    for (size_t i = 0; i < count; ++i) {
+      if (records[i].level <= level) {
+        selected[n++] = records[i];
+        if (n == LOG_BUF_RECS) {
+          sink->write(selected, n);
+          n = 0;
+        }
+      }
+    }
+    if (n > 0) {
+      sink->write(selected, n);
+    }
+  }
+}
+
+
+// Flush every sink; the caller holds io_mutex.
+void
+logging::Log::flush_sinks(void)
+{
+  for (size_t s = 0; s < this->sinks.size(); ++s) {
+    this->sinks[s]->flush();
+  }
+}
+
+
+// Let the sinks write out batches that are due.
+void
+logging::Log::tick_sinks(void)
+{
+  uint64_t now = get_time_ns();
+  pthread_mutex_lock(&(this->io_mutex));
+  for (size_t s = 0; s < this->sinks.size(); ++s) {
+    this->sinks[s]->tick(now);
+  }
+  pthread_mutex_unlock(&(this->io_mutex));
+}
+
+
+/*
+ * Stats shard of the calling thread. Its slot is the same in every log,
+ * so that it can be handed back once, when the thread exits.
+ */
+logging::log_stats_t *
+logging::Log::get_stats_shard(void)
+{
+  if (tls_stats_slot < 0) {
+    pthread_once(&stats_key_once, create_stats_key);
+    int slot = STATS_SHARED_SLOT;
+    for (int i = 0; i < STATS_SHARED_SLOT; ++i) {
+      uint8_t free_slot = 0;
+      if (__atomic_compare_exchange_n(&(stats_slot_taken[i]), &free_slot, 1,
+                                      false, __ATOMIC_ACQUIRE,
+                                      __ATOMIC_RELAXED)) {
+        pthread_setspecific(stats_key, (void *) (uintptr_t) (i + 1));
+        slot = i;
+        break;
+      }
+    }
+    tls_stats_slot = slot;
+  }
+  return &(this->stats[tls_stats_slot].stats);
+}
+
+
+// Take the log mutex, counting the times it had to be waited for.
+void
+logging::Log::lock_mutex(void)
+{
+  logging::log_stats_t * stats = this->get_stats_shard();
+  if (pthread_mutex_trylock(&(this->mutex)) != 0) {
+    uint64_t start = monotonic_ns();
+    pthread_mutex_lock(&(this->mutex));
+    stats_add(&(stats->lock_waits), 1);
+    stats_add(&(stats->lock_wait_ns), monotonic_ns() - start);
+  }
+  stats_add(&(stats->lock_acquires), 1);
+}
+
+
+// Count a flush that started at start (monotonic_ns()).
+void
+logging::Log::record_flush(logging::flush_cause_t cause,
+                           uint64_t start)
+{
+  uint64_t ns = monotonic_ns() - start;
+  size_t bucket = (ns > 1) ? 63 - __builtin_clzll(ns) : 0;
+  if (bucket >= STATS_HIST_BUCKETS) {
+    bucket = STATS_HIST_BUCKETS - 1;
+  }
+
+  logging::log_stats_t * stats = this->get_stats_shard();
+  stats_add(&(stats->flushes[cause]), 1);
+  stats_add(&(stats->flush_ns), ns);
+  stats_add(&(stats->flush_hist[bucket]), 1);
+  uint64_t max = __atomic_load_n(&(stats->flush_max_ns), __ATOMIC_RELAXED);
+  while (ns > max &&
+         !__atomic_compare_exchange_n(&(stats->flush_max_ns), &max, ns, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+
+// Sum the shards into *stats.
+void
+logging::Log::get_stats(logging::log_stats_t * stats)
+{
+  memset(stats, 0, sizeof *stats);
+  uint64_t max = 0;
+  for (size_t i = 0; i < STATS_SHARDS; ++i) {
+    const uint64_t * shard = (const uint64_t *) &(this->stats[i].stats);
+    uint64_t * sum = (uint64_t *) stats;
+    for (size_t n = 0; n < sizeof *stats / sizeof *sum; ++n) {
+      sum[n] += __atomic_load_n(&shard[n], __ATOMIC_RELAXED);
+    }
+    uint64_t shard_max = __atomic_load_n(&(this->stats[i].stats.flush_max_ns),
+                                         __ATOMIC_RELAXED);
+    if (shard_max > max) {
+      max = shard_max;
+    }
+  }
+  stats->flush_max_ns = max;
+}
+
+
+// Log the stats as an INFO message, from the runner, whatever the level.
+void
+logging::Log::log_stats(void)
+{
+  logging::log_stats_t stats;
+  this->get_stats(&stats);
+  char buf[LOG_BUF_SIZE];
+  logging::format_stats(buf, sizeof buf, stats);
+  this->log_site_msg(logging::INFO, __FILE__, __LINE__, this->get_thread_id(),
+                     false, "Logging stats: %s", buf);
+}
+
+
+/*
+ * Merge the histograms of all the threads, and log one INFO message per
+ * scope timer with its count, median, 99th percentile and maximum since
+ * the last call; timers with nothing new are left out. Percentiles are
+ * the upper bound of their bucket, capped at the maximum. The totals
+ * and maximums are taken by the call, so only the root log makes it.
+ */
+void
+logging::Log::log_timers(void)
+{
+  typedef struct {
+    const char * name;
+    uint64_t count;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+  } timer_summary_t;
+
+  timer_summary_t summaries[TIMERS_MAX];
+  size_t summary_count = 0;
+  uint64_t * buckets = timer_buckets;
+
+  // Log with the timers unlocked, so that a slow sink does not hold up
+  // the threads timing their first scope.
+  pthread_mutex_lock(&timers_mutex);
+  for (unsigned int i = 0; i < timer_count; ++i) {
+    memset(buckets, 0, TIMER_BUCKETS * sizeof *buckets);
+    uint64_t max_ns = 0;
+    for (timer_thread_t * t = timer_threads; t; t = t->next) {
+      logging::timer_hist_t * hist =
+          __atomic_load_n(&(t->hists[i]), __ATOMIC_ACQUIRE);
+      if (hist == NULL) {
+        continue;
+      }
+      for (size_t b = 0; b < TIMER_BUCKETS; ++b) {
+        buckets[b] += __atomic_load_n(&(hist->buckets[b]), __ATOMIC_RELAXED);
+      }
+      uint64_t hist_max = __atomic_exchange_n(&(hist->max_ns), 0,
+                                              __ATOMIC_RELAXED);
+      if (hist_max > max_ns) {
+        max_ns = hist_max;
+      }
+    }
+
+    if (timers_logged[i] == NULL) {
+      timers_logged[i] = new logging::timer_hist_t();
+    }
+    uint64_t count = 0;
+    for (size_t b = 0; b < TIMER_BUCKETS; ++b) {
+      uint64_t total = buckets[b];
+      buckets[b] -= timers_logged[i]->buckets[b];
+      timers_logged[i]->buckets[b] = total;
+      count += buckets[b];
+    }
+    if (count == 0) {
+      continue;
+    }
+
+    timer_summary_t * s = &summaries[summary_count++];
+    s->name = timers[i].name;
+    s->count = count;
+    s->max_ns = max_ns;
+    uint64_t p50_rank = (count + 1) / 2;
+    uint64_t p99_rank = count - count / 100;
+    uint64_t seen = 0;
+    s->p50_ns = s->p99_ns = 0;
+    for (size_t b = 0; b < TIMER_BUCKETS && seen < p99_rank; ++b) {
+      uint64_t upper = logging::timer_bucket_max(b);
+      if (upper > max_ns) {
+        upper = max_ns;
+      }
+      if (seen < p50_rank && seen + buckets[b] >= p50_rank) {
+        s->p50_ns = upper;
+      }
+      seen += buckets[b];
+      if (seen >= p99_rank) {
+        s->p99_ns = upper;
+      }
+    }
+  }
+  pthread_mutex_unlock(&timers_mutex);
+
+  for (size_t i = 0; i < summary_count; ++i) {
+    const timer_summary_t * s = &summaries[i];
+    this->log_site_msg(logging::INFO, __FILE__, __LINE__, this->get_thread_id(),
+                       false,
+                       "Logging timer %s: count=%lu p50_ns=%lu p99_ns=%lu max_ns=%lu",
+                       s->name, (unsigned long) s->count, (unsigned long) s->p50_ns,
+                       (unsigned long) s->p99_ns, (unsigned long) s->max_ns);
+  }
+}
+
+
+// Free all memory and destroy mutex.
+void
+logging::Log::do_cleanup(void)
+{
+  pthread_mutex_lock(&(this->runner_mutex));
+  bool killed = this->kill_runner;
+  pthread_mutex_unlock(&(this->runner_mutex));
+
+  pthread_mutex_lock(&(this->mutex));
+  if (killed) {
+    for (size_t s = 0; s < this->sinks.size(); ++s) {
+      delete this->sinks[s];
+    }
+    this->sinks.clear();
+    this->default_sink = NULL;
+    delete[] this->log_buf;
+    delete[] this->log_recs;
+    delete[] this->out_buf;
+    delete[] this->out_recs;
+    delete[] this->stats;
+    delete[] this->dedup_slots;
+    this->dedup_slots = NULL;
+    delete this->recorder;
+    this->recorder = NULL;
+    for (int list = 0; list < 2; ++list) {
+      logging::log_buffer_t ** head = list ? &(this->spare) : &(this->pending);
+      while (*head) {
+        logging::log_buffer_t * lb = *head;
+        *head = lb->next;
+        delete_log_buffer(lb);
+      }
+    }
+
+    // Every ring has been drained by now.
+    pthread_mutex_lock(&(this->threads_mutex));
+    while (this->threads) {
+      logging::ThreadBuffer * tb = this->threads;
+      this->threads = tb->next;
+      delete tb;
+    }
+    delete[] this->cpu_buffers;
+    this->cpu_buffers = NULL;
+    pthread_mutex_unlock(&(this->threads_mutex));
+
+    pthread_mutex_lock(&(this->history_mutex));
+    while (this->histories) {
+      logging::History * history = this->histories;
+      this->histories = history->next;
+      delete history;
+    }
+    pthread_mutex_unlock(&(this->history_mutex));
+  }
+  pthread_mutex_unlock(&(this->mutex));
+  if (killed) {
+    pthread_mutex_destroy(&(this->mutex));
+    pthread_mutex_destroy(&(this->runner_mutex));
+    pthread_mutex_destroy(&(this->threads_mutex));
+    pthread_mutex_destroy(&(this->sinks_mutex));
+    pthread_mutex_destroy(&(this->io_mutex));
+    pthread_mutex_destroy(&(this->history_mutex));
+    pthread_cond_destroy(&(this->runner_cond));
+    pthread_cond_destroy(&(this->flush_cond));
+    pthread_cond_destroy(&(this->space_cond));
+  }
+}
+
+
+/*
+ * Set the path to log file. It replaces the log file or stderr given
+ * to the constructor, but not the sinks added with add_sink().
+ */
+void
+logging::Log::set_log_file(const std::string& path)
+{
+  logging::Sink * sink = NULL;
+  try {
+    if (this->block_size > 0) {
+      sink = new logging::BlockFileSink(path, DEBUG, this->block_size,
+                                        this->block_msec);
+    } else {
+      logging::FileSink * file_sink =
+          new logging::FileSink(path, DEBUG, this->batch_size, this->batch_msec);
+      file_sink->set_rotation(this->rotate_bytes, this->rotate_sec,
+                              this->rotate_naming, this->rotate_keep);
+      if (this->multi_process) {
+        file_sink->set_multi_process(true);
+      }
+      if (this->index_bytes > 0 || this->index_records > 0) {
+        file_sink->set_index(this->index_bytes, this->index_records);
+      }
+      sink = file_sink;
+    }
+  } catch (const char * err) {
+    if (this->default_sink == NULL) {
+      this->add_sink(new logging::StderrSink());
+      this->default_sink = this->sinks.back();
+    }
+    throw err;
+  }
+
+  if (this->default_sink) {
+    logging::Sink * old_sink = this->default_sink;
+    this->remove_sink(old_sink);
+    delete old_sink;
+  }
+  this->add_sink(sink);
+  this->default_sink = sink;
+}
+
+
+// Add a sink to the log, which then owns it.
+void
+logging::Log::add_sink(logging::Sink * sink)
+{
+  pthread_mutex_lock(&(this->sinks_mutex));
+  this->lock_mutex();
+  pthread_mutex_lock(&(this->io_mutex));
+  this->sinks.push_back(sink);
+  unsigned int tick_msec = sink->get_tick_msec();
+  if (tick_msec > 0 && (this->tick_msec == 0 || tick_msec < this->tick_msec)) {
+    __atomic_store_n(&(this->tick_msec), tick_msec, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&(this->io_mutex));
+  pthread_mutex_unlock(&(this->mutex));
+  pthread_mutex_unlock(&(this->sinks_mutex));
+
+  // The runner may have to wake up more often now.
+  pthread_mutex_lock(&(this->runner_mutex));
+  pthread_cond_signal(&(this->runner_cond));
+  pthread_mutex_unlock(&(this->runner_mutex));
+}
+
+
+/*
+ * Remove a sink from the log, after flushing the buffered records to it.
+ * The caller owns it again. Returns false if the sink was not found.
+ */
+bool
+logging::Log::remove_sink(logging::Sink * sink)
+{
+  bool found = false;
+  pthread_mutex_lock(&(this->sinks_mutex));
+  this->lock_mutex();
+  pthread_mutex_lock(&(this->io_mutex));
+  this->flush_locked();
+  for (size_t s = 0; s < this->sinks.size(); ++s) {
+    if (this->sinks[s] == sink) {
+      sink->flush();
+      this->sinks.erase(this->sinks.begin() + s);
+      found = true;
+      break;
+    }
+  }
+  if (sink == this->default_sink) {
+    this->default_sink = NULL;
+  }
+  pthread_mutex_unlock(&(this->io_mutex));
+  pthread_mutex_unlock(&(this->mutex));
+  pthread_mutex_unlock(&(this->sinks_mutex));
+  return found;
+}
+
+
+/*
+ * Ask the runner to reopen the log files, e.g. after they have been
+ * moved away. It only sets a flag, so it may be called from a signal
+ * handler; the runner acts on it within REOPEN_CHECK_MSEC.
+ */
+void
+logging::Log::reopen(void)
+{
+  __atomic_store_n(&(this->reopen_requested), true, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Let the sinks rotate or reopen their files. Called by the runner;
+ * the sinks only take io_mutex to switch to the new file.
+ */
+void
+logging::Log::reopen_sinks(void)
+{
+  bool force = __atomic_exchange_n(&(this->reopen_requested), false,
+                                   __ATOMIC_RELAXED);
+  uint64_t now = get_time_ns();
+  pthread_mutex_lock(&(this->sinks_mutex));
+  for (size_t s = 0; s < this->sinks.size(); ++s) {
+    this->sinks[s]->reopen(now, force, &(this->io_mutex));
+  }
+  pthread_mutex_unlock(&(this->sinks_mutex));
+}
+
+
+// Set the logging severity level.
+void
+logging::Log::set_log_level(logging::log_level_t level)
+{
+  __atomic_store_n(&(this->log_level), level, __ATOMIC_RELAXED);
+}
+
+
+// Get the logging severity level.
+logging::log_level_t
+logging::Log::get_log_level(void)
+{
+  return __atomic_load_n(&(this->log_level), __ATOMIC_RELAXED);
+}
+
+
+// Get the current time.
+void
+logging::get_current_time(char ** time_str)
+{
+  format_time(*time_str, get_time_ns(), logging::TIME_SEC, false, false);
+}
+
+
+// Get the current wall clock time in nanoseconds.
+uint64_t
+logging::get_time_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Monotonic time in nanoseconds, for the rate limits.
+static uint64_t
+monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Let a message through; report how many were held back before it.
+static bool
+rate_allow(logging::rate_site_t * site,
+           uint64_t * suppressed)
+{
+  *suppressed = __atomic_exchange_n(&(site->suppressed), 0, __ATOMIC_RELAXED);
+  return true;
+}
+
+
+// Hold a message back.
+static bool
+rate_suppress(logging::rate_site_t * site)
+{
+  __atomic_add_fetch(&(site->suppressed), 1, __ATOMIC_RELAXED);
+  return false;
+}
+
+
+// Allow the 1st, (n+1)th, (2n+1)th ... message of a call site.
+bool
+logging::rate_every_n(logging::rate_site_t * site,
+                      uint64_t n,
+                      uint64_t * suppressed)
+{
+  uint64_t count = __atomic_fetch_add(&(site->count), 1, __ATOMIC_RELAXED);
+  if (n <= 1 || count % n == 0) {
+    return rate_allow(site, suppressed);
+  }
+  return rate_suppress(site);
+}
+
+
+// Allow the first n messages of a call site.
+bool
+logging::rate_first_n(logging::rate_site_t * site,
+                      uint64_t n,
+                      uint64_t * suppressed)
+{
+  if (__atomic_load_n(&(site->count), __ATOMIC_RELAXED) < n &&
+      __atomic_fetch_add(&(site->count), 1, __ATOMIC_RELAXED) < n) {
+    return rate_allow(site, suppressed);
+  }
+  return rate_suppress(site);
+}
+
+
+// Allow one message of a call site every seconds.
+bool
+logging::rate_every_t(logging::rate_site_t * site,
+                      double seconds,
+                      uint64_t * suppressed)
+{
+  uint64_t now = monotonic_ns();
+  uint64_t next = __atomic_load_n(&(site->next), __ATOMIC_RELAXED);
+  if (now >= next &&
+      __atomic_compare_exchange_n(&(site->next), &next,
+                                  now + (uint64_t) (seconds * 1e9), false,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    return rate_allow(site, suppressed);
+  }
+  return rate_suppress(site);
+}
+
+
+/*
+ * Allow per_sec messages of a call site a second, in bursts of up to
+ * per_sec. This is a token bucket in its GCRA form: site->next is the
+ * theoretical arrival time of the next message, so that a single CAS
+ * updates the bucket.
+ */
+bool
+logging::rate_limit(logging::rate_site_t * site,
+                    double per_sec,
+                    uint64_t * suppressed)
+{
+  uint64_t now = monotonic_ns();
+  uint64_t interval = (per_sec > 0) ? (uint64_t) (1e9 / per_sec) : UINT64_MAX / 2;
+  uint64_t burst = (per_sec > 1) ? (uint64_t) per_sec : 1;
+  uint64_t tolerance = interval * (burst - 1);
+
+  uint64_t tat = __atomic_load_n(&(site->next), __ATOMIC_RELAXED);
+  do {
+    if (tat > now + tolerance) {
+      return rate_suppress(site);
+    }
+  } while (!__atomic_compare_exchange_n(&(site->next), &tat,
+                                        ((tat > now) ? tat : now) + interval,
+                                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return rate_allow(site, suppressed);
+}
+
+
+// Two digit strings of 00 to 99.
+static const char digit_pairs[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+
+// Write v as exactly width decimal digits, two at a time.
+static char *
+put_digits(char * p,
+           uint64_t v,
+           int width)
+{
+  char * end = p + width;
+  char * q = end;
+  while (q - p >= 2) {
+    q -= 2;
+    memcpy(q, digit_pairs + (v % 100) * 2, 2);
+    v /= 100;
+  }
+  if (q > p) {
+    *--q = '0' + v % 10;
+  }
+  return end;
+}
+
+
+/*
+ * Per-thread cache of the formatted date and time of one second,
+ * so that localtime_r() and the formatting run once a second at most.
+ */
+typedef struct {
+  time_t sec;
+  int flags;
+  size_t len;
+  size_t zone_len;
+  char str[TIME_STR_SIZE];
+  char zone[8];
+} time_cache_t;
+
+#define TIME_CACHE_UTC 0x1
+#define TIME_CACHE_ISO8601 0x2
+
+static __thread time_cache_t tls_time_cache = { 0, -1, 0, 0, "", "" };
+
+
+/*
+ * Format a timestamp given in nanoseconds since the epoch, without
+ * allocating or taking any lock. Returns the length of the string.
+ */
+size_t
+logging::format_time(char * buf,
+                     uint64_t ns,
+                     logging::time_precision_t precision,
+                     bool utc,
+                     bool iso8601)
+{
+  time_t sec = ns / 1000000000ULL;
+  uint32_t nsec = ns % 1000000000ULL;
+  int flags = (utc ? TIME_CACHE_UTC : 0) | (iso8601 ? TIME_CACHE_ISO8601 : 0);
+  time_cache_t * cache = &tls_time_cache;
+
+  if (cache->sec != sec || cache->flags != flags) {
+    struct tm tm;
+    if (utc) {
+      gmtime_r(&sec, &tm);
+    } else {
+      localtime_r(&sec, &tm);
+    }
+
+    char * p = cache->str;
+    if (iso8601) {
+      p = put_digits(p, tm.tm_year + 1900, 4);
+      *p++ = '-';
+      p = put_digits(p, tm.tm_mon + 1, 2);
+      *p++ = '-';
+      p = put_digits(p, tm.tm_mday, 2);
+      *p++ = 'T';
+    } else {
+      p = put_digits(p, tm.tm_mday, 2);
+      *p++ = '-';
+      p = put_digits(p, tm.tm_mon + 1, 2);
+      *p++ = '-';
+      p = put_digits(p, tm.tm_year + 1900, 4);
+      *p++ = ' ';
+    }
+    p = put_digits(p, tm.tm_hour, 2);
+    *p++ = ':';
+    p = put_digits(p, tm.tm_min, 2);
+    *p++ = ':';
+    p = put_digits(p, tm.tm_sec, 2);
+    cache->len = p - cache->str;
+
+    // Zone designator, for ISO 8601 only.
+    p = cache->zone;
+    if (iso8601 && utc) {
+      *p++ = 'Z';
+    } else if (iso8601) {
+      long offset = tm.tm_gmtoff / 60;
+      *p++ = (offset < 0) ? '-' : '+';
+      offset = (offset < 0) ? -offset : offset;
+      p = put_digits(p, offset / 60, 2);
+      *p++ = ':';
+      p = put_digits(p, offset % 60, 2);
+    }
+    cache->zone_len = p - cache->zone;
+
+    cache->sec = sec;
+    cache->flags = flags;
+  }
+
+  char * p = buf;
+  memcpy(p, cache->str, cache->len);
+  p += cache->len;
+  switch (precision) {
+    case logging::TIME_MSEC:
+      *p++ = '.';
+      p = put_digits(p, nsec / 1000000, 3);
+      break;
+    case logging::TIME_USEC:
+      *p++ = '.';
+      p = put_digits(p, nsec / 1000, 6);
+      break;
+    case logging::TIME_NSEC:
+      *p++ = '.';
+      p = put_digits(p, nsec, 9);
+      break;
+    default:
+      break;
+  }
+  memcpy(p, cache->zone, cache->zone_len);
+  p += cache->zone_len;
+  *p = '\0';
+
+  return p - buf;
+}
+
+
+// Write v in decimal, right aligned in width characters.
+static char *
+put_uint(char * p,
+         uint64_t v,
+         int width)
+{
+  int digits = 1;
+  for (uint64_t n = v; n >= 10; n /= 10) {
+    ++digits;
+  }
+  while (width-- > digits) {
+    *p++ = ' ';
+  }
+  return put_digits(p, v, digits);
+}
+
+
+// Length of the timestamps written by format_time().
+static size_t
+time_length(logging::time_precision_t precision,
+            bool utc,
+            bool iso8601)
+{
+  static const size_t fraction[] = { 0, 4, 7, 10 };
+  size_t len = 19 + fraction[precision];
+  if (iso8601) {
+    len += utc ? 1 : 6;
+  }
+  return len;
+}
+
+
+// Get the current time of the log's clock, in nanoseconds.
+uint64_t
+logging::Log::get_timestamp(void)
+{
+  struct timespec ts;
+  clock_gettime(this->clock_id, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ * Write the prefix of a log line, that is
+ * "<time>, <level> Thread <uid>, <file>:<line> => ", into buf.
+ * Returns its length; nothing is written if that is size or more.
+ */
+size_t
+logging::Log::format_prefix(char * buf,
+                            size_t size,
+                            LOG_FUNC_SIGNATURE,
+                            uint64_t ns)
+{
+  const char * level_str = get_level_str(level);
+  size_t level_len = strlen(level_str);
+  size_t file_len = strlen(file_name);
+  size_t len = time_length(this->time_precision, this->utc_time,
+                           this->iso8601_time) +
+               2 + 7 + 8 + 10 + 2 + file_len + 1 + 5 + 4;
+  if (len >= size) {
+    return len;
+  }
+
+  char * p = buf + this->format_timestamp(buf, ns);
+  memcpy(p, ", ", 2);
+  p += 2;
+  for (size_t i = level_len; i < 7; ++i) {
+    *p++ = ' ';
+  }
+  memcpy(p, level_str, level_len);
+  p += level_len;
+  memcpy(p, " Thread ", 8);
+  p = put_uint(p + 8, uid, 5);
+  memcpy(p, ", ", 2);
+  memcpy(p + 2, file_name, file_len);
+  p += 2 + file_len;
+  *p++ = ':';
+  p = put_uint(p, line, 0);
+  memcpy(p, " => ", 4);
+  p += 4;
+
+  return p - buf;
+}
+
+
+// Format a timestamp the way this log is configured to.
+size_t
+logging::Log::format_timestamp(char * buf,
+                               uint64_t ns)
+{
+  return format_time(buf, ns, this->time_precision,
+                     this->utc_time, this->iso8601_time);
+}
+
+
+// Function to log a message depending on its severity.
+void
+logging::Log::log_msg(LOG_FUNC_SIGNATURE,
+                      const char *fmt,
+                      ...)
+{
+  if (level > this->get_log_level()) {
+    return;
+  }
+  va_list args;
+  va_start(args, fmt);
+  this->vlog_msg(level, file_name, line, uid, false, fmt, args);
+  va_end(args);
+}
+
+
+/*
+ * Log a message from a call site that is enabled (see LOG_SITE_ENABLED()),
+ * which a site rule may do below the log level, so that is not checked.
+ */
+void
+logging::Log::log_site_msg(LOG_FUNC_SIGNATURE,
+                           bool literal,
+                           const char * fmt,
+                           ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  this->vlog_msg(level, file_name, line, uid, literal, fmt, args);
+  va_end(args);
+}
+
+
+/*
+ * Function to log a message from a rate-limited call site, reporting
+ * how many messages it held back before this one.
+ */
+void
+logging::Log::log_msg_suppressed(LOG_FUNC_SIGNATURE,
+                                 uint64_t suppressed,
+                                 const char *fmt,
+                                 ...)
+{
+  char msg[LOG_BUF_SIZE];
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(msg, sizeof msg, fmt, args);
+  va_end(args);
+  if (len < 0) {
+    len = 0;
+  } else if ((size_t) len >= sizeof msg) {
+    len = sizeof msg - 1;
+  }
+  snprintf(msg + len, sizeof msg - len, " [%" PRIu64 " similar messages suppressed]",
+           suppressed);
+  this->log_site_msg(level, file_name, line, uid, false, "%s", msg);
+}
+
+
+// Function to log a message whose format is a string literal.
+void
+logging::Log::log_msg_literal(LOG_FUNC_SIGNATURE,
+                              const char *fmt,
+                              ...)
+{
+  if (level > this->get_log_level()) {
+    return;
+  }
+  va_list args;
+  va_start(args, fmt);
+  this->vlog_msg(level, file_name, line, uid, true, fmt, args);
+  va_end(args);
+}
+
+
+// Text of a printf-style message, for vprintf_body().
+typedef struct {
+  const char * fmt;
+  va_list args;
+} vprintf_ctx_t;
+
+
+// Body writer of the printf-style messages.
+static size_t
+vprintf_body(char * buf,
+             size_t size,
+             void * ctx)
+{
+  vprintf_ctx_t * msg = (vprintf_ctx_t *) ctx;
+  va_list args;
+  va_copy(args, msg->args);
+  int len = vsnprintf(buf, size, msg->fmt, args);
+  va_end(args);
+  return (len > 0) ? len : 0;
+}
+
+
+// A message preceded by the context of the thread, for context_body().
+typedef struct {
+  const char * text;
+  size_t len;
+  logging::body_writer_t writer;
+  void * ctx;
+} context_ctx_t;
+
+
+// Body writer copying the context of the thread before the message.
+static size_t
+context_body(char * buf,
+             size_t size,
+             void * ctx)
+{
+  context_ctx_t * msg = (context_ctx_t *) ctx;
+  if (msg->len >= size) {
+    return msg->len + msg->writer(NULL, 0, msg->ctx);
+  }
+  memcpy(buf, msg->text, msg->len);
+  return msg->len + msg->writer(buf + msg->len, size - msg->len, msg->ctx);
+}
+
+
+// Log a printf-style message.
+void
+logging::Log::vlog_msg(LOG_FUNC_SIGNATURE,
+                       bool literal,
+                       const char * fmt,
+                       va_list args)
+{
+  if (this->mode == logging::ASYNC_LOGGING && level != FATAL &&
+      literal && this->deferred_format &&
+      this->async_log_deferred(level, file_name, line, uid, fmt, args)) {
+    return;
+  }
+
+  vprintf_ctx_t ctx;
+  ctx.fmt = fmt;
+  va_copy(ctx.args, args);
+  this->log_body(level, file_name, line, uid, vprintf_body, &ctx, true);
+  va_end(ctx.args);
+}
+
+
+/*
+ * Route a message to the thread ring or to the shared buffer. Unless
+ * it comes from an enabled call site, it is dropped below the log level.
+ */
+void
+logging::Log::log_body(LOG_FUNC_SIGNATURE,
+                       logging::body_writer_t writer,
+                       void * ctx,
+                       bool site_enabled)
+{
+  if (!site_enabled && level > this->get_log_level()) {
+    return;
+  }
+
+  // The debug history leading up to an error goes out before it.
+  if (level <= ERROR && this->history_entries > 0) {
+    this->dump_history();
+  }
+
+  // The name and context of the thread go first, copied as they are.
+  context_ctx_t context;
+  if (tls_context.len > 0) {
+    context.text = tls_context.text;
+    context.len = tls_context.len;
+    context.writer = writer;
+    context.ctx = ctx;
+    writer = context_body;
+    ctx = &context;
+  }
+
+  // FATAL messages are always written out before the process exits.
+  if (this->mode == logging::ASYNC_LOGGING && level != FATAL) {
+    this->async_log_msg(level, file_name, line, uid, writer, ctx);
+    return;
+  }
+
+  uint64_t ns = this->get_timestamp();
+
+  if (level == FATAL || level == ERROR) {
+    // Not buffered: assemble the message on the stack, and write it out.
+    char log_str[LOG_BUF_SIZE];
+    size_t len = this->format_line(log_str, sizeof log_str, level, file_name,
+                                   line, uid, ns, writer, ctx);
+    if (len < sizeof log_str) {
+      this->write_to_log(level, ns, log_str, len);
+    } else {
+      this->spill_line(len, level, file_name, line, uid, ns, writer, ctx);
+    }
+
+    if (level == FATAL && this->fatal_handling) {
+      // Raw frames, for log_symbolize; see format_stack_trace().
+      void * frames[STACK_TRACE_LIMIT];
+      char trace[2 * LOG_BUF_SIZE];
+      int count = backtrace(frames, this->stack_trace_depth);
+      len = snprintf(trace, sizeof trace,
+                     "\n*** FATAL Error detected; stack trace: ***\n");
+      len += format_stack_trace(trace + len, sizeof trace - len, frames, count);
+      this->write_to_log(level, ns, trace, len);
+
+      // Without a root log to close it with the others, this one is only
+      // written out.
+      if (logging::is_logging_initialized) {
+        logging::stop_logging();
+      } else {
+        this->flush_buffer();
+      }
+      exit(EXIT_STATUS_FATAL);
+    }
+    return;
+  }
+
+  /*
+   * Buffer the log messages if not required instantly. The buffer has
+   * LOG_BUF_SIZE bytes of slack, so that a message is always formatted
+   * in one pass; the message that fills the buffer is written out with it.
+   */
+  this->lock_mutex();
+  if (!this->make_room_locked(level)) {
+    ++this->overflow_dropped;
+    pthread_mutex_unlock(&(this->mutex));
+    stats_add(&(this->get_stats_shard()->dropped), 1);
+    return;
+  }
+
+  // Report the messages dropped since the buffer was last full.
+  if (this->overflow_dropped > 0 && this->log_recs_count + 1 < LOG_BUF_RECS) {
+    size_t len = this->format_drops(this->log_buf + this->log_buf_size,
+                                    2 * LOG_BUF_SIZE - this->log_buf_size,
+                                    this->overflow_dropped, ns);
+    this->commit_line_locked(WARNING, ns, len);
+    this->overflow_dropped = 0;
+  }
+
+  // Repeats of a message within dedup_msec are only counted.
+  bool collapse = (this->dedup_slots != NULL && level > ERROR);
+  logging::dedup_slot_t prev;
+  prev.repeats = 0;
+  if (collapse && this->dedup_by_site &&
+      this->collapse_repeat(level, file_name, line, uid, 0, ns, &prev)) {
+    pthread_mutex_unlock(&(this->mutex));
+    return;
+  }
+
+  size_t avail = 2 * LOG_BUF_SIZE - this->log_buf_size;
+  size_t prefix_len = 0;
+  char * str = this->log_buf + this->log_buf_size;
+  size_t len = this->format_line(str, avail, level, file_name, line, uid, ns,
+                                 writer, ctx, &prefix_len);
+  if (collapse && !this->dedup_by_site && len < avail) {
+    uint64_t hash = std::hash<std::string_view>()(
+        std::string_view(str + prefix_len, len - 1 - prefix_len));
+    if (this->collapse_repeat(level, file_name, line, uid, hash, ns, &prev)) {
+      pthread_mutex_unlock(&(this->mutex));
+      return;
+    }
+  }
+
+  /*
+   * The repeats of the message the slot held before go first; if both
+   * do not fit, the message is written out on its own below.
+   */
+  if (prev.repeats > 0) {
+    char report[LOG_BUF_SIZE];
+    size_t report_len = this->format_repeats(report, sizeof report, &prev);
+    if (len < avail && report_len + len < avail &&
+        this->log_recs_count + 1 < LOG_BUF_RECS) {
+      memmove(str + report_len, str, len + 1);
+    } else {
+      len = (len < avail) ? avail : len;
+    }
+    memcpy(str, report, report_len);
+    this->commit_line_locked((logging::log_level_t) prev.level, prev.last, report_len);
+    str += report_len;
+    avail -= report_len;
+  }
+
+  if (len < avail) {
+    this->commit_line_locked(level, ns, len);
+    this->flush_if_full_locked();
+    pthread_mutex_unlock(&(this->mutex));
+    return;
+  }
+
+  // Longer than the buffer itself.
+  this->log_buf[this->log_buf_size] = '\0';
+  pthread_mutex_lock(&(this->io_mutex));
+  this->flush_locked();
+  pthread_mutex_unlock(&(this->io_mutex));
+  pthread_mutex_unlock(&(this->mutex));
+  this->spill_line(len, level, file_name, line, uid, ns, writer, ctx);
+}
+
+
+/*
+ * Hand the full log buffer to the runner, and carry on with a spare
+ * one. Without a spare, a new one is allocated if none has been yet,
+ * or with OVERFLOW_GROW, while they fit in overflow_max_bytes. Returns
+ * false if the log buffer has to stay as it is. The caller holds the
+ * log mutex.
+ */
+bool
+logging::Log::hand_off_locked(void)
+{
+  logging::log_buffer_t * lb = this->spare;
+  if (lb) {
+    this->spare = lb->next;
+  } else if (this->buffers_bytes == 0 ||
+             (this->overflow_policy == logging::OVERFLOW_GROW &&
+              this->buffers_bytes + LOG_BUFFER_BYTES <= this->overflow_max_bytes)) {
+    lb = new_log_buffer();
+    this->buffers_bytes += LOG_BUFFER_BYTES;
+  } else {
+    return false;
+  }
+
+  // The full buffer swaps places with lb, at the end of the queue.
+  std::swap(this->log_buf, lb->buf);
+  std::swap(this->log_recs, lb->recs);
+  lb->size = this->log_buf_size;
+  lb->count = this->log_recs_count;
+  lb->recorder_end = this->recorder ? this->recorder->get_head() : 0;
+  lb->next = NULL;
+  this->log_buf_size = 0;
+  this->log_recs_count = 0;
+  this->log_buf[0] = '\0';
+
+  logging::log_buffer_t ** tail = &(this->pending);
+  while (*tail) {
+    tail = &((*tail)->next);
+  }
+  *tail = lb;
+
+  pthread_mutex_lock(&(this->runner_mutex));
+  this->handoff_requested = true;
+  pthread_cond_signal(&(this->runner_cond));
+  pthread_mutex_unlock(&(this->runner_mutex));
+  return true;
+}
+
+
+/*
+ * Make sure the log buffer can take a message, applying the overflow
+ * policy if it is full. Returns false if the message must be dropped.
+ * The caller holds the log mutex.
+ */
+bool
+logging::Log::make_room_locked(logging::log_level_t level)
+{
+  if (this->log_buf_size < LOG_BUF_SIZE && this->log_recs_count < LOG_BUF_RECS) {
+    return true;
+  }
+  if (this->hand_off_locked()) {
+    return true;
+  }
+
+  switch (this->overflow_policy) {
+    case logging::OVERFLOW_BLOCK: {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      uint64_t nsec = ts.tv_nsec + (uint64_t) this->overflow_wait_usec * 1000;
+      ts.tv_sec += nsec / 1000000000ULL;
+      ts.tv_nsec = nsec % 1000000000ULL;
+      while (!this->hand_off_locked()) {
+        if (pthread_cond_timedwait(&(this->space_cond), &(this->mutex),
+                                   &ts) == ETIMEDOUT) {
+          return this->hand_off_locked();
+        }
+      }
+      return true;
+    }
+    case logging::OVERFLOW_DROP_OLDEST:
+      return this->drop_oldest_locked(level);
+    default:
+      return false;
+  }
+}
+
+
+/*
+ * Drop the oldest buffered messages no more severe than level, until
+ * the log buffer is at most half full. Returns false if that could not
+ * be done. The caller holds the log mutex.
+ */
+bool
+logging::Log::drop_oldest_locked(logging::log_level_t level)
+{
+  size_t excess = this->log_buf_size > LOG_BUF_SIZE / 2
+                      ? this->log_buf_size - LOG_BUF_SIZE / 2 : 0;
+  size_t excess_recs = this->log_recs_count > LOG_BUF_RECS / 2
+                           ? this->log_recs_count - LOG_BUF_RECS / 2 : 0;
+  size_t size = 0;
+  size_t count = 0;
+  uint64_t dropped = 0;
+  for (size_t i = 0; i < this->log_recs_count; ++i) {
+    logging::log_record_t rec = this->log_recs[i];
+    if ((excess > 0 || excess_recs > 0) && rec.level >= level &&
+        rec.level > ERROR) {
+      excess -= (rec.len < excess) ? rec.len : excess;
+      excess_recs -= (excess_recs > 0);
+      ++dropped;
+      continue;
+    }
+    memmove(this->log_buf + size, rec.str, rec.len);
+    rec.str = this->log_buf + size;
+    this->log_recs[count++] = rec;
+    size += rec.len;
+  }
+  this->log_buf_size = size;
+  this->log_recs_count = count;
+  this->log_buf[size] = '\0';
+
+  this->overflow_dropped += dropped;
+  stats_add(&(this->get_stats_shard()->dropped), dropped);
+  return size < LOG_BUF_SIZE && count < LOG_BUF_RECS;
+}
+
+
+/*
+ * Write the line reporting dropped messages into buf, which has room
+ * for it. Returns its length.
+ */
+size_t
+logging::Log::format_drops(char * buf,
+                           size_t size,
+                           uint64_t dropped,
+                           uint64_t ns)
+{
+  size_t len = this->format_prefix(buf, size, WARNING, __FILE__, __LINE__,
+                                   this->get_thread_id(), ns);
+  len += snprintf(buf + len, size - len,
+                  "%lu messages dropped, the log could not keep up\n",
+                  (unsigned long) dropped);
+  return len;
+}
+
+
+// Add the line written at the end of the log buffer to its records.
+void
+logging::Log::commit_line_locked(logging::log_level_t level,
+                                 uint64_t ns,
+                                 size_t len)
+{
+  logging::log_record_t * rec = &(this->log_recs[this->log_recs_count++]);
+  rec->level = level;
+  rec->timestamp = ns;
+  rec->str = this->log_buf + this->log_buf_size;
+  rec->len = len;
+  this->log_buf_size += len;
+  if (this->recorder) {
+    this->recorder->append(rec->str, rec->len);
+  }
+}
+
+
+// Write out, or hand over, the log buffer once it is full.
+void
+logging::Log::flush_if_full_locked(void)
+{
+  if (this->log_buf_size < LOG_BUF_SIZE &&
+      this->log_recs_count < LOG_BUF_RECS) {
+    return;
+  }
+  if (this->overflow_policy == logging::OVERFLOW_FLUSH) {
+    uint64_t start = monotonic_ns();
+    pthread_mutex_lock(&(this->io_mutex));
+    this->flush_locked();
+    pthread_mutex_unlock(&(this->io_mutex));
+    this->record_flush(logging::FLUSH_FULL, start);
+  } else {
+    this->hand_off_locked();
+  }
+}
+
+
+/*
+ * Count a message as a repeat of the one in its slot of dedup_slots:
+ * same call site and level, same text hash (0 with dedup_by_site), and
+ * less than dedup_msec after it. Otherwise the message takes the slot,
+ * and what the slot held is copied to prev, for its repeats, if any, to
+ * be reported before the message. The caller holds the log mutex, or
+ * is the runner in ASYNC_LOGGING mode.
+ */
+bool
+logging::Log::collapse_repeat(LOG_FUNC_SIGNATURE,
+                              uint64_t hash,
+                              uint64_t ns,
+                              logging::dedup_slot_t * prev)
+{
+  size_t i = (((uintptr_t) file_name >> 3) ^ (line * 0x9e3779b1U)) % DEDUP_SLOTS;
+  logging::dedup_slot_t * slot = &(this->dedup_slots[i]);
+  if (slot->file_name == file_name && slot->line == line &&
+      slot->level == level && slot->hash == hash &&
+      ns - slot->start < this->dedup_ns) {
+    ++slot->repeats;
+    slot->last = ns;
+    slot->uid = uid;
+    stats_add(&(this->get_stats_shard()->collapsed), 1);
+    return true;
+  }
+
+  *prev = *slot;
+  slot->file_name = file_name;
+  slot->line = line;
+  slot->level = level;
+  slot->uid = uid;
+  slot->hash = hash;
+  slot->start = ns;
+  slot->last = ns;
+  slot->repeats = 0;
+  return false;
+}
+
+
+/*
+ * Take a slot of dedup_slots whose window has closed by now, with
+ * repeats to report, into slot. Returns false if there is none.
+ */
+bool
+logging::Log::take_expired_repeats(uint64_t now,
+                                   logging::dedup_slot_t * slot)
+{
+  for (size_t i = 0; i < DEDUP_SLOTS; ++i) {
+    logging::dedup_slot_t * s = &(this->dedup_slots[i]);
+    if (s->repeats > 0 && now - s->start >= this->dedup_ns) {
+      *slot = *s;
+      s->file_name = NULL;
+      s->repeats = 0;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/*
+ * Write the line reporting the repeats of the message of slot into
+ * buf, with the call site and thread of the last one. Returns its length.
+ */
+size_t
+logging::Log::format_repeats(char * buf,
+                             size_t size,
+                             const logging::dedup_slot_t * slot)
+{
+  size_t len = this->format_prefix(buf, size, (logging::log_level_t) slot->level,
+                                   slot->file_name, slot->line, slot->uid,
+                                   slot->last);
+  len += snprintf(buf + len, size - len, "last message repeated %lu times\n",
+                  (unsigned long) slot->repeats);
+  return len;
+}
+
+
+/*
+ * Add the line reporting the repeats of the message of slot to the
+ * batch drain_rings() is putting together, writing the batch out first
+ * if it is full.
+ */
+void
+logging::Log::out_repeats(const logging::dedup_slot_t * slot,
+                          size_t * out_len,
+                          size_t * out_count)
+{
+  if (*out_len + LOG_BUF_SIZE >= ASYNC_OUT_BUF_SIZE ||
+      *out_count == ASYNC_OUT_RECS) {
+    uint64_t start = monotonic_ns();
+    pthread_mutex_lock(&(this->io_mutex));
+    this->dispatch(this->out_recs, *out_count);
+    pthread_mutex_unlock(&(this->io_mutex));
+    this->record_flush(logging::FLUSH_FULL, start);
+    *out_len = 0;
+    *out_count = 0;
+  }
+  logging::log_record_t * out = &(this->out_recs[(*out_count)++]);
+  out->level = (logging::log_level_t) slot->level;
+  out->timestamp = slot->last;
+  out->str = this->out_buf + *out_len;
+  out->len = this->format_repeats(this->out_buf + *out_len, LOG_BUF_SIZE, slot);
+  *out_len += out->len;
+}
+
+
+/*
+ * Report the repeats whose window has closed by now (all of them if now
+ * is UINT64_MAX) in the log buffer. Called by the runner, and at exit,
+ * in SYNC_LOGGING mode.
+ */
+void
+logging::Log::expire_repeats(uint64_t now)
+{
+  this->lock_mutex();
+  logging::dedup_slot_t slot;
+  while (this->take_expired_repeats(now, &slot)) {
+    if (!this->make_room_locked((logging::log_level_t) slot.level)) {
+      stats_add(&(this->get_stats_shard()->dropped), 1);
+      continue;
+    }
+    size_t len = this->format_repeats(this->log_buf + this->log_buf_size,
+                                      2 * LOG_BUF_SIZE - this->log_buf_size,
+                                      &slot);
+    this->commit_line_locked((logging::log_level_t) slot.level, slot.last, len);
+    this->flush_if_full_locked();
+  }
+  pthread_mutex_unlock(&(this->mutex));
+}
+
+
+/*
+ * Write out the buffers handed over by hand_off_locked(), oldest first.
+ * Called by the runner; io_mutex is taken before the log mutex is let
+ * go, so that nothing can be written ahead of the buffer.
+ */
+void
+logging::Log::write_pending(void)
+{
+  this->lock_mutex();
+  while (this->pending) {
+    uint64_t start = monotonic_ns();
+    logging::log_buffer_t * lb = this->pending;
+    this->pending = lb->next;
+    pthread_mutex_lock(&(this->io_mutex));
+    pthread_mutex_unlock(&(this->mutex));
+
+    this->dispatch(lb->recs, lb->count);
+    this->flush_sinks();
+    if (this->recorder) {
+      this->recorder->set_flushed(lb->recorder_end);
+    }
+    pthread_mutex_unlock(&(this->io_mutex));
+    this->record_flush(logging::FLUSH_FULL, start);
+
+    this->lock_mutex();
+    lb->size = 0;
+    lb->count = 0;
+    lb->next = this->spare;
+    this->spare = lb;
+    pthread_cond_broadcast(&(this->space_cond));
+  }
+  pthread_mutex_unlock(&(this->mutex));
+}
+
+
+/*
+ * Assemble a complete log line, prefix and message, straight into buf.
+ * Returns the length of the line; if that is size or more, the line did
+ * not fit, buf holds no usable data and the length may be overestimated.
+ * The length of the prefix goes to prefix_len, if given.
+ */
+size_t
+logging::Log::format_line(char * buf,
+                          size_t size,
+                          LOG_FUNC_SIGNATURE,
+                          uint64_t ns,
+                          logging::body_writer_t writer,
+                          void * ctx,
+                          size_t * prefix_len)
+{
+  size_t len = this->format_prefix(buf, size, level, file_name, line, uid, ns);
+  if (prefix_len) {
+    *prefix_len = len;
+  }
+  len += writer(len < size ? buf + len : NULL, len < size ? size - len : 0, ctx);
+  if (len + 1 < size) {
+    buf[len] = '\n';
+    buf[len + 1] = '\0';
+  }
+  return len + 1;
+}
+
+
+// Write out a line too long for the log buffer, assembled on the heap.
+void
+logging::Log::spill_line(size_t len,
+                         LOG_FUNC_SIGNATURE,
+                         uint64_t ns,
+                         logging::body_writer_t writer,
+                         void * ctx)
+{
+  char * str = new char[len + 1];
+  len = this->format_line(str, len + 1, level, file_name, line, uid, ns,
+                          writer, ctx);
+  this->write_to_log(level, ns, str, len);
+  delete[] str;
+}
+
+
+/*
+ * Keep a message below the log level in the debug history of the
+ * calling thread. Nothing is formatted: a literal format keeps its
+ * arguments as capture_args() saves them, any other is formatted into
+ * the entry, truncated to fit. No lock is taken.
+ */
+void
+logging::Log::log_history(LOG_FUNC_SIGNATURE,
+                          bool literal,
+                          const char * fmt,
+                          ...)
+{
+  logging::History * history = this->get_history();
+  uint64_t head = history->head;
+  logging::history_entry_t * entry =
+      &(history->entries[head % history->size]);
+  entry->timestamp = this->get_timestamp();
+  entry->file_name = file_name;
+  entry->line = line;
+  entry->level = level;
+  entry->uid = uid;
+
+  va_list args;
+  va_start(args, fmt);
+  ssize_t len = -1;
+  if (literal) {
+    va_list copy;
+    va_copy(copy, args);
+    len = capture_args(entry->data, sizeof entry->data, fmt, copy);
+    va_end(copy);
+  }
+  if (len >= 0) {
+    entry->fmt = fmt;
+  } else {
+    len = vsnprintf(entry->data, sizeof entry->data, fmt, args);
+    if (len < 0) {
+      len = 0;
+    } else if ((size_t) len >= sizeof entry->data) {
+      len = sizeof entry->data - 1;
+    }
+    entry->fmt = NULL;
+  }
+  va_end(args);
+  entry->len = len;
+
+  // Readers only look at entries before head.
+  __atomic_store_n(&(history->head), head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Get the debug history of the calling thread, creating it on first
+ * use, or taking over that of a thread that has exited.
+ */
+logging::History *
+logging::Log::get_history(void)
+{
+  if (tls_history_owner == this->instance_id) {
+    return tls_history;
+  }
+
+  logging::History * history =
+      (logging::History *) pthread_getspecific(this->history_key);
+  if (history == NULL) {
+    pthread_mutex_lock(&(this->history_mutex));
+    for (history = this->histories; history; history = history->next) {
+      if (__atomic_load_n(&(history->orphaned), __ATOMIC_ACQUIRE)) {
+        // What the old thread left behind is not ours to dump.
+        history->dumped = __atomic_load_n(&(history->head), __ATOMIC_ACQUIRE);
+        __atomic_store_n(&(history->orphaned), false, __ATOMIC_RELAXED);
+        break;
+      }
+    }
+    if (history == NULL) {
+      history = new logging::History(this->history_entries);
+      history->next = this->histories;
+      __atomic_store_n(&(this->histories), history, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&(this->history_mutex));
+    pthread_setspecific(this->history_key, history);
+  }
+
+  tls_history = history;
+  tls_history_owner = this->instance_id;
+  return history;
+}
+
+
+/*
+ * Format an entry of the debug history as a log line, marked as such,
+ * into buf of 2 * LOG_BUF_SIZE bytes. Returns its length; async-signal-safe.
+ */
+size_t
+logging::Log::format_history(char * buf,
+                             const logging::history_entry_t * entry)
+{
+  size_t len = this->format_prefix(buf, LOG_BUF_SIZE,
+                                   (logging::log_level_t) entry->level,
+                                   entry->file_name, entry->line, entry->uid,
+                                   entry->timestamp);
+  if (len >= LOG_BUF_SIZE) {
+    len = 0;
+  }
+  memcpy(buf + len, "(history) ", 10);
+  len += 10;
+  if (entry->fmt) {
+    len += render_args(buf + len, LOG_BUF_SIZE - 16, entry->fmt,
+                       entry->data, entry->len);
+  } else {
+    memcpy(buf + len, entry->data, entry->len);
+    len += entry->len;
+  }
+  buf[len++] = '\n';
+  return len;
+}
+
+
+/*
+ * Write out the debug history of the calling thread, or of every thread
+ * with history_all_threads, that has not been written yet. It goes to
+ * the sinks after the messages logged before, in timestamp order.
+ */
+void
+logging::Log::dump_history(void)
+{
+  std::vector<logging::history_entry_t> entries;
+  logging::History * own =
+      (tls_history_owner == this->instance_id) ? tls_history : NULL;
+
+  pthread_mutex_lock(&(this->history_mutex));
+  for (logging::History * history = this->histories; history;
+       history = history->next) {
+    if (!this->history_all_threads && history != own) {
+      continue;
+    }
+    uint64_t head = __atomic_load_n(&(history->head), __ATOMIC_ACQUIRE);
+    uint64_t start = (head > history->size) ? head - history->size : 0;
+    if (start < history->dumped) {
+      start = history->dumped;
+    }
+    size_t first = entries.size();
+    for (uint64_t i = start; i < head; ++i) {
+      entries.push_back(history->entries[i % history->size]);
+    }
+
+    /*
+     * Entries overwritten by the owner while they were copied are lost;
+     * so may be the one another thread is writing now, at the slot of now.
+     */
+    uint64_t now = __atomic_load_n(&(history->head), __ATOMIC_ACQUIRE) +
+                   (history != own);
+    if (now > start + history->size) {
+      size_t lost = now - history->size - start;
+      if (lost > head - start) {
+        lost = head - start;
+      }
+      entries.erase(entries.begin() + first, entries.begin() + first + lost);
+    }
+    history->dumped = head;
+  }
+  pthread_mutex_unlock(&(this->history_mutex));
+  if (entries.empty()) {
+    return;
+  }
+
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const logging::history_entry_t& a,
+                      const logging::history_entry_t& b) {
+                     return a.timestamp < b.timestamp;
+                   });
+  std::string text;
+  std::vector<logging::log_record_t> records(entries.size());
+  std::vector<size_t> offsets(entries.size());
+  char buf[2 * LOG_BUF_SIZE];
+  for (size_t i = 0; i < entries.size(); ++i) {
+    offsets[i] = text.size();
+    text.append(buf, this->format_history(buf, &entries[i]));
+  }
+  for (size_t i = 0; i < entries.size(); ++i) {
+    records[i].level = (logging::log_level_t) entries[i].level;
+    records[i].timestamp = entries[i].timestamp;
+    records[i].str = text.data() + offsets[i];
+    records[i].len = ((i + 1 < entries.size()) ? offsets[i + 1] : text.size()) -
+                     offsets[i];
+  }
+
+  if (this->mode == logging::ASYNC_LOGGING) {
+    this->sync_backend();
+  }
+  this->lock_mutex();
+  pthread_mutex_lock(&(this->io_mutex));
+  this->flush_locked();
+  if (this->recorder) {
+    this->recorder->append(text.data(), text.size());
+  }
+  this->dispatch(records.data(), records.size());
+  pthread_mutex_unlock(&(this->io_mutex));
+  pthread_mutex_unlock(&(this->mutex));
+}
+
+
+// Get the ring of the calling thread, creating it on first use.
+logging::ThreadBuffer *
+logging::Log::get_thread_buffer(void)
+{
+  if (tls_buffer_owner == this->instance_id) {
+    return tls_buffer;
+  }
+
+  logging::ThreadBuffer * tb =
+      (logging::ThreadBuffer *) pthread_getspecific(this->thread_key);
+  if (tb == NULL) {
+    tb = new logging::ThreadBuffer(this->ring_size);
+    pthread_setspecific(this->thread_key, tb);
+
+    pthread_mutex_lock(&(this->threads_mutex));
+    tb->next = this->threads;
+    this->threads = tb;
+    pthread_mutex_unlock(&(this->threads_mutex));
+  }
+
+  tls_buffer = tb;
+  tls_buffer_owner = this->instance_id;
+  return tb;
+}
+
+
+/*
+ * Get the ring to log to, and hold it until release_buffer(): that of
+ * the calling thread, or with per_cpu_buffers, that of the CPU it runs
+ * on. The thread may move to another CPU after sched_getcpu(), so the
+ * ring is locked, but another thread rarely has it at the same time.
+ */
+logging::ThreadBuffer *
+logging::Log::acquire_buffer(void)
+{
+  if (this->cpu_buffers == NULL) {
+    return this->get_thread_buffer();
+  }
+
+  int cpu = sched_getcpu();
+  logging::ThreadBuffer * tb =
+      this->cpu_buffers[(cpu > 0) ? (unsigned int) cpu % this->cpu_count : 0];
+  pthread_mutex_lock(&(tb->mutex));
+  return tb;
+}
+
+
+/*
+ * Sequence number of a record about to be committed to a ring taken with
+ * acquire_buffer(). A thread that moves to another CPU continues in
+ * another ring, so that, with a coarse clock, its records may carry the
+ * same timestamp in both; the drain orders those by this number. A ring
+ * per thread keeps them in order by itself.
+ */
+uint64_t
+logging::Log::next_record_seq(logging::ThreadBuffer * tb)
+{
+  if (!tb->per_cpu) {
+    return 0;
+  }
+  return __atomic_fetch_add(&(this->record_seq), 1, __ATOMIC_RELAXED);
+}
+
+
+// Let other threads log to a ring taken with acquire_buffer().
+void
+logging::Log::release_buffer(logging::ThreadBuffer * tb)
+{
+  if (tb->per_cpu) {
+    pthread_mutex_unlock(&(tb->mutex));
+  }
+}
+
+
+/*
+ * Reserve room for a message of up to LOG_BUF_SIZE bytes in a ring
+ * taken with acquire_buffer(). If the ring is full, OVERFLOW_BLOCK waits up to
+ * overflow_wait_usec for the runner, the OVERFLOW_DROP_* policies do not
+ * wait at all, and the others wait as long as it takes; ERROR and FATAL
+ * messages always wait. Returns NULL if the message is to be dropped.
+ */
+logging::ring_record_t *
+logging::Log::reserve_record(logging::ThreadBuffer * tb,
+                             logging::log_level_t level)
+{
+  logging::ring_record_t * rec = NULL;
+  uint64_t deadline = 0;
+  while ((rec = tb->ring.reserve(sizeof(*rec) + LOG_BUF_SIZE)) == NULL) {
+    if (level > ERROR) {
+      if (this->overflow_policy == logging::OVERFLOW_DROP_NEWEST ||
+          this->overflow_policy == logging::OVERFLOW_DROP_OLDEST) {
+        break;
+      }
+      if (this->overflow_policy == logging::OVERFLOW_BLOCK) {
+        uint64_t now = monotonic_ns();
+        if (deadline == 0) {
+          deadline = now + (uint64_t) this->overflow_wait_usec * 1000;
+        } else if (now >= deadline) {
+          break;
+        }
+      }
+    }
+    sched_yield();
+  }
+
+  if (rec == NULL) {
+    __atomic_fetch_add(&(this->async_dropped), 1, __ATOMIC_RELAXED);
+    stats_add(&(this->get_stats_shard()->dropped), 1);
+  }
+  return rec;
+}
+
+
+/*
+ * Copy a message into the ring of the calling thread, or of its CPU.
+ * Only the message text is formatted here; the runner adds the prefix.
+ */
+void
+logging::Log::async_log_msg(LOG_FUNC_SIGNATURE,
+                            logging::body_writer_t writer,
+                            void * ctx)
+{
+  logging::ThreadBuffer * tb = this->acquire_buffer();
+  logging::ring_record_t * rec = this->reserve_record(tb, level);
+  if (rec == NULL) {
+    this->release_buffer(tb);
+    return;
+  }
+
+  size_t len = writer((char *) (rec + 1), LOG_BUF_SIZE, ctx);
+  if (len >= LOG_BUF_SIZE) {
+    len = LOG_BUF_SIZE - 1;
+    stats_add(&(this->get_stats_shard()->truncated), 1);
+  }
+
+  rec->line = line;
+  rec->level = level;
+  rec->uid = uid;
+  rec->len = len;
+  rec->timestamp = this->get_timestamp();
+  rec->seq = this->next_record_seq(tb);
+  rec->file_name = file_name;
+  tb->ring.commit(rec, sizeof(*rec) + len);
+  this->release_buffer(tb);
+}
+
+
+/*
+ * With deferred formatting, do not even format a message whose format
+ * is a literal: store the format pointer, the context of the thread if
+ * any (its length in a byte, then the text) and the raw arguments in
+ * the ring instead. Returns false if the arguments cannot be captured.
+ */
+bool
+logging::Log::async_log_deferred(LOG_FUNC_SIGNATURE,
+                                 const char * fmt,
+                                 va_list args)
+{
+  logging::ThreadBuffer * tb = this->acquire_buffer();
+  logging::ring_record_t * rec = this->reserve_record(tb, level);
+  if (rec == NULL) {
+    this->release_buffer(tb);
+    return true;
+  }
+
+  char * body = (char *) (rec + 1);
+  size_t head = sizeof fmt;
+  uint8_t flags = RECORD_DEFERRED;
+  if (tls_context.len > 0) {
+    body[head] = (char) tls_context.len;
+    memcpy(body + head + 1, tls_context.text, tls_context.len);
+    head += 1 + tls_context.len;
+    flags |= RECORD_CONTEXT;
+  }
+
+  va_list args_copy;
+  va_copy(args_copy, args);
+  ssize_t len = capture_args(body + head, LOG_BUF_SIZE - head, fmt, args_copy);
+  va_end(args_copy);
+  if (len < 0) {
+    // Left uncommitted; the record is reserved again for the fallback.
+    this->release_buffer(tb);
+    return false;
+  }
+  memcpy(body, &fmt, sizeof fmt);
+  len += head;
+
+  rec->flags |= flags;
+  rec->line = line;
+  rec->level = level;
+  rec->uid = uid;
+  rec->len = len;
+  rec->timestamp = this->get_timestamp();
+  rec->seq = this->next_record_seq(tb);
+  rec->file_name = file_name;
+  tb->ring.commit(rec, sizeof(*rec) + len);
+  this->release_buffer(tb);
+  return true;
+}
+
+
+// Output of format_body(): what fits is written, everything is counted.
+typedef struct {
+  char * p;
+  char * end;               // Room for the terminating NUL is kept.
+  size_t len;
+} format_out_t;
+
+
+// Append len bytes of str.
+static inline void
+format_put(format_out_t * out,
+           const char * str,
+           size_t len)
+{
+  size_t room = out->end - out->p;
+  size_t n = (len < room) ? len : room;
+  if (n > 0) {
+    memcpy(out->p, str, n);
+    out->p += n;
+  }
+  out->len += len;
+}
+
+
+// Append n copies of c.
+static inline void
+format_fill(format_out_t * out,
+            char c,
+            size_t n)
+{
+  size_t room = out->end - out->p;
+  size_t m = (n < room) ? n : room;
+  if (m > 0) {
+    memset(out->p, c, m);
+    out->p += m;
+  }
+  out->len += n;
+}
+
+
+/*
+ * Append a converted argument, padded to the width of the placeholder.
+ * Numbers are right aligned by default, and zero padding goes between
+ * the sign and the digits.
+ */
+static void
+format_pad(format_out_t * out,
+           const logging::format_spec_t * spec,
+           bool numeric,
+           const char * sign,
+           const char * str,
+           size_t len)
+{
+  size_t sign_len = strlen(sign);
+  size_t pad = (spec->width > sign_len + len) ? spec->width - sign_len - len : 0;
+  char align = spec->align ? spec->align : (numeric ? '>' : '<');
+
+  if (pad > 0 && align == '>' && !(numeric && spec->zero)) {
+    format_fill(out, ' ', pad);
+  }
+  format_put(out, sign, sign_len);
+  if (pad > 0 && align == '>' && numeric && spec->zero) {
+    format_fill(out, '0', pad);
+  }
+  format_put(out, str, len);
+  if (pad > 0 && align == '<') {
+    format_fill(out, ' ', pad);
+  }
+}
+
+
+/*
+ * Convert v backwards from end, in the base of a placeholder type;
+ * returns the number of characters. Decimal goes two digits at a time.
+ */
+static size_t
+format_uint(char * end,
+            uint64_t v,
+            char type)
+{
+  char * p = end;
+  switch (type) {
+    case 'x':
+      do {
+        *--p = "0123456789abcdef"[v & 0xf];
+        v >>= 4;
+      } while (v);
+      break;
+    case 'X':
+      do {
+        *--p = "0123456789ABCDEF"[v & 0xf];
+        v >>= 4;
+      } while (v);
+      break;
+    case 'o':
+      do {
+        *--p = '0' + (v & 0x7);
+        v >>= 3;
+      } while (v);
+      break;
+    case 'b':
+      do {
+        *--p = '0' + (v & 0x1);
+        v >>= 1;
+      } while (v);
+      break;
+    default:
+      while (v >= 100) {
+        p -= 2;
+        memcpy(p, digit_pairs + (v % 100) * 2, 2);
+        v /= 100;
+      }
+      if (v >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + v * 2, 2);
+      } else {
+        *--p = '0' + v;
+      }
+      break;
+  }
+  return end - p;
+}
+
+
+// Append a floating point argument, through std::to_chars().
+static void
+format_double(format_out_t * out,
+              const logging::format_spec_t * spec,
+              double v)
+{
+  char buf[512];
+  std::to_chars_result res;
+  int precision = spec->precision;
+  switch (spec->type) {
+    case 'f':
+      res = std::to_chars(buf, buf + sizeof buf, v, std::chars_format::fixed,
+                          precision >= 0 ? precision : 6);
+      break;
+    case 'e':
+      res = std::to_chars(buf, buf + sizeof buf, v, std::chars_format::scientific,
+                          precision >= 0 ? precision : 6);
+      break;
+    case 'g':
+      res = std::to_chars(buf, buf + sizeof buf, v, std::chars_format::general,
+                          precision >= 0 ? precision : 6);
+      break;
+    default:
+      // The shortest string that reads back as the same value.
+      if (precision >= 0) {
+        res = std::to_chars(buf, buf + sizeof buf, v, std::chars_format::general,
+                            precision);
+      } else {
+        res = std::to_chars(buf, buf + sizeof buf, v);
+      }
+      break;
+  }
+  if (res.ec != std::errc()) {
+    res.ptr = buf + snprintf(buf, sizeof buf, "%g", v);
+  }
+
+  const char * str = buf;
+  const char * sign = spec->plus ? "+" : "";
+  if (*str == '-') {
+    sign = "-";
+    ++str;
+  }
+  format_pad(out, spec, true, sign, str, res.ptr - str);
+}
+
+
+// Append an argument as its placeholder says.
+static void
+format_arg(format_out_t * out,
+           const logging::format_spec_t * spec,
+           const logging::format_value_t * value)
+{
+  char buf[72];
+  char * end = buf + sizeof buf;
+
+  switch (value->kind) {
+    case logging::FORMAT_INT:
+    case logging::FORMAT_UINT:
+    case logging::FORMAT_CHAR:
+      {
+        bool is_signed = (value->kind != logging::FORMAT_UINT);
+        char type = spec->type;
+        if (type == 'c' || (value->kind == logging::FORMAT_CHAR && type == 0)) {
+          buf[0] = (char) value->i;
+          format_pad(out, spec, false, "", buf, 1);
+          break;
+        }
+        uint64_t v = value->u;
+        const char * sign = spec->plus ? "+" : "";
+        if (is_signed && value->i < 0) {
+          v = -(uint64_t) value->i;
+          sign = "-";
+        }
+        size_t len = format_uint(end, v, type);
+        format_pad(out, spec, true, sign, end - len, len);
+      }
+      break;
+    case logging::FORMAT_BOOL:
+      if (spec->type == 'd') {
+        format_pad(out, spec, true, "", value->u ? "1" : "0", 1);
+      } else {
+        format_pad(out, spec, false, "", value->u ? "true" : "false",
+                   value->u ? 4 : 5);
+      }
+      break;
+    case logging::FORMAT_FLOAT:
+      format_double(out, spec, value->d);
+      break;
+    case logging::FORMAT_STR:
+      if (value->str.ptr == NULL) {
+        format_pad(out, spec, false, "", "(null)", 6);
+      } else {
+        size_t len = value->str.len;
+        if (spec->precision >= 0 && (size_t) spec->precision < len) {
+          len = spec->precision;
+        }
+        format_pad(out, spec, false, "", value->str.ptr, len);
+      }
+      break;
+    case logging::FORMAT_PTR:
+      {
+        size_t len = format_uint(end, (uintptr_t) value->p, 'x');
+        format_pad(out, spec, true, "0x", end - len, len);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+
+// Body writer of the {} messages; see format_arg_t.
+size_t
+logging::format_body(char * buf,
+                     size_t size,
+                     void * ctx)
+{
+  logging::format_ctx_t * msg = (logging::format_ctx_t *) ctx;
+  format_out_t out = { buf, buf + (size > 0 ? size - 1 : 0), 0 };
+
+  size_t arg = 0;
+  for (size_t i = 0; i < msg->count; ++i) {
+    const logging::format_segment_t * seg = &(msg->segs[i]);
+    format_put(&out, msg->fmt + seg->begin, seg->len);
+    if (seg->has_arg) {
+      format_arg(&out, &(seg->spec), &(msg->values[arg++]));
+    }
+  }
+
+  if (size > 0) {
+    *out.p = '\0';
+  }
+  return out.len;
+}
+
+
+// Classes of printf arguments, as far as deferred formatting is concerned.
+typedef enum {
+  ARG_NONE,
+  ARG_INT,
+  ARG_LONG,
+  ARG_LLONG,
+  ARG_SIZE,
+  ARG_INTMAX,
+  ARG_PTRDIFF,
+  ARG_WINT,
+  ARG_DOUBLE,
+  ARG_LDOUBLE,
+  ARG_PTR,
+  ARG_STR,
+  ARG_WSTR,
+  ARG_ERRNO,
+  ARG_UNSUPPORTED,
+} arg_class_t;
+
+// A printf conversion specification.
+typedef struct {
+  size_t len;               // Length of the specification, '%' included.
+  bool star_width;
+  bool star_precision;
+  int precision;            // -1 unless a literal precision is given.
+  arg_class_t arg;
+} fmt_spec_t;
+
+#define NULL_STR_LEN 0xffffffffU
+#define SPEC_MAX_LEN 32
+
+
+// Parse the conversion specification at fmt, which points at a '%'.
+static void
+parse_spec(const char * fmt,
+           fmt_spec_t * spec)
+{
+  const char * p = fmt + 1;
+  spec->star_width = false;
+  spec->star_precision = false;
+  spec->precision = -1;
+  spec->arg = ARG_UNSUPPORTED;
+
+  if (*p == '%') {
+    spec->len = 2;
+    spec->arg = ARG_NONE;
+    return;
+  }
+
+  while (*p && strchr("-+ #0'I", *p)) {
+    ++p;
+  }
+  if (*p == '*') {
+    spec->star_width = true;
+    ++p;
+  } else {
+    while (*p >= '0' && *p <= '9') {
+      ++p;
+    }
+  }
+  if (*p == '.') {
+    ++p;
+    if (*p == '*') {
+      spec->star_precision = true;
+      ++p;
+    } else {
+      spec->precision = 0;
+      while (*p >= '0' && *p <= '9') {
+        spec->precision = spec->precision * 10 + (*p++ - '0');
+      }
+    }
+  }
+
+  // Length modifiers.
+  int longs = 0;
+  char size = 0;
+  while (*p && strchr("hlLqjzt", *p)) {
+    if (*p == 'l' || *p == 'L' || *p == 'q') {
+      ++longs;
+    } else if (*p != 'h') {
+      size = *p;
+    }
+    ++p;
+  }
+
+  switch (*p) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+      if (size == 'z') {
+        spec->arg = ARG_SIZE;
+      } else if (size == 'j') {
+        spec->arg = ARG_INTMAX;
+      } else if (size == 't') {
+        spec->arg = ARG_PTRDIFF;
+      } else if (longs > 1) {
+        spec->arg = ARG_LLONG;
+      } else if (longs == 1) {
+        spec->arg = ARG_LONG;
+      } else {
+        spec->arg = ARG_INT;
+      }
+      break;
+    case 'c':
+      spec->arg = longs ? ARG_WINT : ARG_INT;
+      break;
+    case 'e': case 'E': case 'f': case 'F':
+    case 'g': case 'G': case 'a': case 'A':
+      spec->arg = longs && p[-1] == 'L' ? ARG_LDOUBLE : ARG_DOUBLE;
+      break;
+    case 'p':
+      spec->arg = ARG_PTR;
+      break;
+    case 's':
+      spec->arg = longs ? ARG_WSTR : ARG_STR;
+      break;
+    case 'm':
+      spec->arg = ARG_ERRNO;
+      break;
+    default:
+      // %n, positional arguments and anything unknown.
+      break;
+  }
+
+  spec->len = (*p ? p + 1 : p) - fmt;
+  if (spec->len > SPEC_MAX_LEN) {
+    spec->arg = ARG_UNSUPPORTED;
+  }
+}
+
+
+/*
+ * Copy the arguments of fmt into buf, so that the message can be
+ * formatted later by render_args(). Strings are copied, truncated if
+ * they do not fit. Returns the bytes used, or -1 if the format cannot
+ * be deferred and has to be formatted right away.
+ */
+ssize_t
+logging::capture_args(char * buf,
+                      size_t size,
+                      const char * fmt,
+                      va_list args)
+{
+  int saved_errno = errno;
+  size_t used = 0;
+
+#define CAPTURE(type, value) \
+  do { \
+    type v = (value); \
+    if (used + sizeof v > size) { \
+      return -1; \
+    } \
+    memcpy(buf + used, &v, sizeof v); \
+    used += sizeof v; \
+  } while (0)
+
+  for (const char * p = strchr(fmt, '%'); p; p = strchr(p, '%')) {
+    fmt_spec_t spec;
+    parse_spec(p, &spec);
+    p += spec.len;
+
+    if (spec.star_width) {
+      CAPTURE(int, va_arg(args, int));
+    }
+    if (spec.star_precision) {
+      int precision = va_arg(args, int);
+      CAPTURE(int, precision);
+      spec.precision = precision;
+    }
+
+    switch (spec.arg) {
+      case ARG_NONE:
+        break;
+      case ARG_INT:
+        CAPTURE(int, va_arg(args, int));
+        break;
+      case ARG_LONG:
+        CAPTURE(long, va_arg(args, long));
+        break;
+      case ARG_LLONG:
+        CAPTURE(long long, va_arg(args, long long));
+        break;
+      case ARG_SIZE:
+        CAPTURE(size_t, va_arg(args, size_t));
+        break;
+      case ARG_INTMAX:
+        CAPTURE(intmax_t, va_arg(args, intmax_t));
+        break;
+      case ARG_PTRDIFF:
+        CAPTURE(ptrdiff_t, va_arg(args, ptrdiff_t));
+        break;
+      case ARG_WINT:
+        CAPTURE(wint_t, va_arg(args, wint_t));
+        break;
+      case ARG_DOUBLE:
+        CAPTURE(double, va_arg(args, double));
+        break;
+      case ARG_LDOUBLE:
+        CAPTURE(long double, va_arg(args, long double));
+        break;
+      case ARG_PTR:
+        CAPTURE(void *, va_arg(args, void *));
+        break;
+      case ARG_ERRNO:
+        CAPTURE(int, saved_errno);
+        break;
+      case ARG_STR:
+      case ARG_WSTR:
+        {
+          const char * str = va_arg(args, const char *);
+          uint32_t len = NULL_STR_LEN;
+          size_t unit = (spec.arg == ARG_WSTR) ? sizeof(wchar_t) : 1;
+          if (str && spec.arg == ARG_WSTR) {
+            len = wcslen((const wchar_t *) str) * unit;
+          } else if (str) {
+            len = (spec.precision >= 0) ? strnlen(str, spec.precision)
+                                        : strlen(str);
+          }
+          CAPTURE(uint32_t, len);
+          if (len != NULL_STR_LEN) {
+            // Keep room for the terminator, and truncate to whole units.
+            if (used + len + unit > size) {
+              if (used + unit > size) {
+                return -1;
+              }
+              len = (size - used - unit) / unit * unit;
+              memcpy(buf + used - sizeof len, &len, sizeof len);
+            }
+            memcpy(buf + used, str, len);
+            memset(buf + used + len, 0, unit);
+            used += len + unit;
+          }
+        }
+        break;
+      default:
+        return -1;
+    }
+  }
+
+#undef CAPTURE
+
+  return used;
+}
+
+
+// Format one captured argument with the given specification.
+template <typename T>
+static int
+render_one(char * out,
+           size_t size,
+           const char * spec_str,
+           const fmt_spec_t * spec,
+           int width,
+           int precision,
+           T value)
+{
+  if (spec->star_width && spec->star_precision) {
+    return snprintf(out, size, spec_str, width, precision, value);
+  } else if (spec->star_width) {
+    return snprintf(out, size, spec_str, width, value);
+  } else if (spec->star_precision) {
+    return snprintf(out, size, spec_str, precision, value);
+  }
+  return snprintf(out, size, spec_str, value);
+}
+
+
+/*
+ * Format a message from the arguments saved by capture_args().
+ * Returns the bytes written to out, which is always NUL terminated.
+ */
+size_t
+logging::render_args(char * out,
+                     size_t size,
+                     const char * fmt,
+                     const char * data,
+                     size_t data_len)
+{
+  size_t len = 0;
+  size_t used = 0;
+
+#define FETCH(type, var) \
+  type var; \
+  if (used + sizeof var > data_len) { \
+    break; \
+  } \
+  memcpy(&var, data + used, sizeof var); \
+  used += sizeof var
+
+  while (*fmt && len + 1 < size) {
+    const char * p = strchr(fmt, '%');
+    size_t literal = p ? (size_t) (p - fmt) : strlen(fmt);
+    if (literal > size - len - 1) {
+      literal = size - len - 1;
+    }
+    memcpy(out + len, fmt, literal);
+    len += literal;
+    if (p == NULL || len + 1 >= size) {
+      break;
+    }
+
+    fmt_spec_t spec;
+    parse_spec(p, &spec);
+    fmt = p + spec.len;
+
+    char spec_str[SPEC_MAX_LEN + 1];
+    memcpy(spec_str, p, spec.len);
+    spec_str[spec.len] = '\0';
+
+    int width = 0;
+    int precision = 0;
+    if (spec.star_width) {
+      FETCH(int, w);
+      width = w;
+    }
+    if (spec.star_precision) {
+      FETCH(int, pr);
+      precision = pr;
+    }
+
+    int n = 0;
+    char * dst = out + len;
+    size_t room = size - len;
+    switch (spec.arg) {
+      case ARG_NONE:
+        n = snprintf(dst, room, "%%");
+        break;
+      case ARG_INT:
+        {
+          FETCH(int, v);
+          n = render_one(dst, room, spec_str, &spec, width, precision, v);
+        }
+        break;
+      case ARG_LONG:
+        {
+          FETCH(long, v);
+          n = render_one(dst, room, spec_str, &spec, width, precision, v);
+        }
+        break;
+      case ARG_LLONG:
+        {
+          FETCH(long long, v);
+          n = render_one(dst, room, spec_str, &spec, width, precision, v);
+        }
+        break;
+      case ARG_SIZE:
+        {
+          FETCH(size_t, v);
+          n = render_one(dst, room, spec_str, &spec, width, precision, v);
+        }
+        break;
+      case ARG_INTMAX:
+        {
+          FETCH(intmax_t, v);
+          n = render_one(dst, room, spec_str, &spec, width, precision, v);
+        }
+        break;
+      case ARG_PTRDIFF:
+        {
+          FETCH(ptrdiff_t, v);
+          n = render_one(dst, room, spec_str, &spec, width, precision, v);
+        }
+        break;
+      case ARG_WINT:
+        {
+          FETCH(wint_t, v);
+          n = render_one(dst, room, spec_str, &spec, width, precision, v);
+        }
+        break;
+      case ARG_DOUBLE:
+        {
+          FETCH(double, v);
+          n = render_one(dst, room, spec_str, &spec, width, precision, v);
+        }
+        break;
+      case ARG_LDOUBLE:
+        {
+          FETCH(long double, v);
+          n = render_one(dst, room, spec_str, &spec, width, precision, v);
+        }
+        break;
+      case ARG_PTR:
+        {
+          FETCH(void *, v);
+          n = render_one(dst, room, spec_str, &spec, width, precision, v);
+        }
+        break;
+      case ARG_ERRNO:
+        {
+          FETCH(int, v);
+          char tmp[256];
+          n = snprintf(dst, room, "%s", strerror_r(v, tmp, sizeof tmp));
+        }
+        break;
+      case ARG_STR:
+      case ARG_WSTR:
+        {
+          FETCH(uint32_t, str_len);
+          const char * str = NULL;
+          if (str_len != NULL_STR_LEN) {
+            str = data + used;
+            used += str_len + ((spec.arg == ARG_WSTR) ? sizeof(wchar_t) : 1);
+          }
+          n = render_one(dst, room, spec_str, &spec, width, precision, str);
+        }
+        break;
+      default:
+        break;
+    }
+
+    if (n > 0) {
+      len += ((size_t) n < room) ? (size_t) n : room - 1;
+    }
+  }
+
+#undef FETCH
+
+  out[len] = '\0';
+  return len;
+}
+
+
+/*
+ * Format the message of a deferred ring record, written by
+ * async_log_deferred(), into out of LOG_BUF_SIZE bytes, context first.
+ * Returns its length.
+ */
+static size_t
+render_deferred(char * out,
+                const logging::ring_record_t * rec)
+{
+  const char * body = (const char *) (rec + 1);
+  const char * fmt;
+  memcpy(&fmt, body, sizeof fmt);
+  size_t head = sizeof fmt;
+  size_t len = 0;
+  if (rec->flags & RECORD_CONTEXT) {
+    len = (uint8_t) body[head];
+    memcpy(out, body + head + 1, len);
+    head += 1 + len;
+  }
+  return len + logging::render_args(out + len, LOG_BUF_SIZE - len, fmt,
+                                    body + head, rec->len - head);
+}
+
+
+/*
+ * Write out the records of every thread ring, oldest first.
+ * Records stamped after the drain started are left for the next pass,
+ * so that a busy thread cannot keep the others waiting. The final pass
+ * also reports all the repeats still counted.
+ */
+size_t
+logging::Log::drain_rings(bool final)
+{
+  uint64_t cutoff = this->get_timestamp();
+  size_t count = 0;
+  size_t out_len = 0;
+  size_t out_count = 0;
+
+  pthread_mutex_lock(&(this->threads_mutex));
+  __atomic_store_n(&(this->draining), true, __ATOMIC_RELEASE);
+  while (!__atomic_load_n(&crash_in_progress, __ATOMIC_ACQUIRE)) {
+    logging::ThreadBuffer * owner = NULL;
+    logging::ring_record_t * rec = NULL;
+    for (logging::ThreadBuffer * tb = this->threads; tb; tb = tb->next) {
+      logging::ring_record_t * r = tb->ring.peek();
+      if (r && r->timestamp <= cutoff &&
+          (rec == NULL || r->timestamp < rec->timestamp ||
+           (r->timestamp == rec->timestamp && r->seq < rec->seq))) {
+        rec = r;
+        owner = tb;
+      }
+    }
+    if (rec == NULL) {
+      break;
+    }
+
+    /*
+     * Repeats of a message within dedup_msec are only counted; a record
+     * is compared as it is in the ring, arguments or text.
+     */
+    if (this->dedup_slots && rec->level > ERROR) {
+      uint64_t hash = this->dedup_by_site ? 0 :
+          std::hash<std::string_view>()(std::string_view((const char *) (rec + 1),
+                                                         rec->len));
+      logging::dedup_slot_t prev;
+      bool repeat = this->collapse_repeat((logging::log_level_t) rec->level,
+                                          rec->file_name, rec->line, rec->uid,
+                                          hash, rec->timestamp, &prev);
+      if (prev.repeats > 0) {
+        this->out_repeats(&prev, &out_len, &out_count);
+      }
+      if (repeat) {
+        owner->ring.release(rec);
+        ++count;
+        continue;
+      }
+    }
+
+    // Room for the prefix, the message and the newline.
+    size_t max_len = (rec->flags & RECORD_DEFERRED) ? LOG_BUF_SIZE : rec->len;
+    size_t len = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+      len = this->format_prefix(this->out_buf + out_len,
+                                ASYNC_OUT_BUF_SIZE - out_len,
+                                (logging::log_level_t) rec->level,
+                                rec->file_name, rec->line, rec->uid,
+                                rec->timestamp);
+      if ((out_len + len + max_len + 1 < ASYNC_OUT_BUF_SIZE &&
+           out_count < ASYNC_OUT_RECS) || out_len == 0) {
+        break;
+      }
+      uint64_t start = monotonic_ns();
+      pthread_mutex_lock(&(this->io_mutex));
+      this->dispatch(this->out_recs, out_count);
+      pthread_mutex_unlock(&(this->io_mutex));
+      this->record_flush(logging::FLUSH_FULL, start);
+      out_len = 0;
+      out_count = 0;
+    }
+    if (out_len + len + max_len + 1 >= ASYNC_OUT_BUF_SIZE) {
+      // Even an empty buffer cannot hold this record; drop it.
+      owner->ring.release(rec);
+      stats_add(&(this->get_stats_shard()->dropped), 1);
+      continue;
+    }
+    logging::log_record_t * out = &(this->out_recs[out_count++]);
+    out->level = (logging::log_level_t) rec->level;
+    out->timestamp = rec->timestamp;
+    out->str = this->out_buf + out_len;
+    out_len += len;
+    if (rec->flags & RECORD_DEFERRED) {
+      out_len += render_deferred(this->out_buf + out_len, rec);
+    } else {
+      memcpy(this->out_buf + out_len, rec + 1, rec->len);
+      out_len += rec->len;
+    }
+    this->out_buf[out_len++] = '\n';
+    out->len = this->out_buf + out_len - out->str;
+
+    owner->ring.release(rec);
+    ++count;
+  }
+
+  // Report the messages dropped because their ring was full.
+  uint64_t dropped = __atomic_exchange_n(&(this->async_dropped), 0,
+                                         __ATOMIC_RELAXED);
+  if (dropped > 0) {
+    if (out_len + LOG_BUF_SIZE >= ASYNC_OUT_BUF_SIZE ||
+        out_count == ASYNC_OUT_RECS) {
+      pthread_mutex_lock(&(this->io_mutex));
+      this->dispatch(this->out_recs, out_count);
+      pthread_mutex_unlock(&(this->io_mutex));
+      out_len = 0;
+      out_count = 0;
+    }
+    logging::log_record_t * out = &(this->out_recs[out_count++]);
+    out->level = WARNING;
+    out->timestamp = this->get_timestamp();
+    out->str = this->out_buf + out_len;
+    out->len = this->format_drops(this->out_buf + out_len, LOG_BUF_SIZE,
+                                  dropped, out->timestamp);
+    out_len += out->len;
+  }
+
+  // Repeats whose window has closed; at the end, all of them.
+  logging::dedup_slot_t slot;
+  while (this->dedup_slots &&
+         this->take_expired_repeats(final ? UINT64_MAX : cutoff, &slot)) {
+    this->out_repeats(&slot, &out_len, &out_count);
+  }
+
+  if (out_count > 0) {
+    uint64_t start = monotonic_ns();
+    pthread_mutex_lock(&(this->io_mutex));
+    this->dispatch(this->out_recs, out_count);
+    pthread_mutex_unlock(&(this->io_mutex));
+    this->record_flush(logging::FLUSH_TIMER, start);
+  }
+
+  // Free the buffers of exited threads once they are empty.
+  logging::ThreadBuffer ** prev = &(this->threads);
+  while (*prev) {
+    logging::ThreadBuffer * tb = *prev;
+    if (__atomic_load_n(&(tb->orphaned), __ATOMIC_ACQUIRE) &&
+        tb->ring.peek() == NULL) {
+      *prev = tb->next;
+      delete tb;
+    } else {
+      prev = &(tb->next);
+    }
+  }
+  __atomic_store_n(&(this->draining), false, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&(this->threads_mutex));
+
+  return count;
+}
+
+
+/*
+ * Runner thread that flushes the log buffer every 5 minutes.
+ * In ASYNC_LOGGING mode it is the backend that drains the thread
+ * rings every poll interval.
+ */
+void *
+logging::Runner(void *arg)
+{
+  logging::Log * log = (logging::Log *) arg;
+  bool async = (log->mode == logging::ASYNC_LOGGING);
+  uint64_t next_flush = get_time_ns() + (uint64_t) FLUSH_INTERVAL_SEC * 1000000000ULL;
+  uint64_t stats_ns = (uint64_t) log->stats_sec * 1000000000ULL;
+  uint64_t next_stats = get_time_ns() + stats_ns;
+  uint64_t timer_ns = (uint64_t) log->timer_sec * 1000000000ULL;
+  uint64_t next_timers = get_time_ns() + timer_ns;
+
+  pthread_mutex_lock(&(log->runner_mutex));
+  while (!log->kill_runner) {
+    if (log->flush_done == log->flush_requests && !log->handoff_requested) {
+      // Wake up in time for the sink with the tightest latency bound.
+      uint64_t wait_usec = async ? log->poll_usec
+                                 : (uint64_t) FLUSH_INTERVAL_SEC * 1000000;
+      uint64_t tick_usec =
+          (uint64_t) __atomic_load_n(&(log->tick_msec), __ATOMIC_RELAXED) * 1000;
+      if (tick_usec > 0 && tick_usec < wait_usec) {
+        wait_usec = tick_usec;
+      }
+      if (stats_ns > 0 && stats_ns / 1000 < wait_usec) {
+        wait_usec = stats_ns / 1000;
+      }
+      if (log->dedup_ns > 0 && log->dedup_ns / 1000 < wait_usec) {
+        wait_usec = log->dedup_ns / 1000;
+      }
+      if (timer_ns > 0 && timer_ns / 1000 < wait_usec) {
+        wait_usec = timer_ns / 1000;
+      }
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      uint64_t nsec = ts.tv_nsec + wait_usec * 1000;
+      ts.tv_sec += nsec / 1000000000ULL;
+      ts.tv_nsec = nsec % 1000000000ULL;
+      pthread_cond_timedwait(&(log->runner_cond), &(log->runner_mutex), &ts);
+      if (log->kill_runner) {
+        break;
+      }
+    }
+    uint64_t ticket = log->flush_requests;
+    log->handoff_requested = false;
+    pthread_mutex_unlock(&(log->runner_mutex));
+
+    uint64_t now = get_time_ns();
+    log->write_pending();
+    if (async) {
+      log->drain_rings(false);
+      log->tick_sinks();
+    } else if (ticket != log->flush_done || now >= next_flush) {
+      log->flush_buffer(ticket != log->flush_done ? logging::FLUSH_REQUEST
+                                                  : logging::FLUSH_TIMER);
+      next_flush = now + (uint64_t) FLUSH_INTERVAL_SEC * 1000000000ULL;
+    } else {
+      log->tick_sinks();
+    }
+    if (!async && log->dedup_slots) {
+      log->expire_repeats(log->get_timestamp());
+    }
+    log->reopen_sinks();
+    reload_site_rules_if_requested();
+    if (stats_ns > 0 && now >= next_stats) {
+      log->log_stats();
+      next_stats = now + stats_ns;
+    }
+    if (timer_ns > 0 && now >= next_timers) {
+      log->log_timers();
+      next_timers = now + timer_ns;
+    }
+
+    pthread_mutex_lock(&(log->runner_mutex));
+    log->flush_done = ticket;
+    pthread_cond_broadcast(&(log->flush_cond));
+  }
+  pthread_mutex_unlock(&(log->runner_mutex));
+
+  // Final pass, so that nothing queued before stop_logging() is lost.
+  if (timer_ns > 0) {
+    log->log_timers();
+  }
+  if (async) {
+    log->drain_rings(true);
+  }
+
+  pthread_mutex_lock(&(log->runner_mutex));
+  log->runner_alive = false;
+  pthread_cond_broadcast(&(log->flush_cond));
+  pthread_mutex_unlock(&(log->runner_mutex));
+
+  return NULL;
+}
+
+
+// Ring constructor; capacity must be a power of two.
+logging::Ring::Ring(size_t capacity)
+{
+  this->buf = new char[capacity];
+  this->capacity = capacity;
+  this->head = 0;
+  this->tail = 0;
+}
+
+
+// Ring destructor.
+logging::Ring::~Ring()
+{
+  delete[] this->buf;
+}
+
+
+/*
+ * Reserve a contiguous record of up to len bytes, or return NULL
+ * if the ring is full. If the record would not fit before the end of
+ * the ring, the remainder is published as a wrap marker.
+ */
+logging::ring_record_t *
+logging::Ring::reserve(size_t len)
+{
+  len = RECORD_ALIGN(len);
+  uint64_t tail = this->tail;
+  uint64_t head = __atomic_load_n(&(this->head), __ATOMIC_ACQUIRE);
+  size_t offset = tail & (this->capacity - 1);
+  size_t contiguous = this->capacity - offset;
+  size_t needed = (contiguous < len) ? contiguous + len : len;
+
+  if (this->capacity - (tail - head) < needed) {
+    return NULL;
+  }
+
+  if (contiguous < len) {
+    logging::ring_record_t * wrap = (logging::ring_record_t *) (this->buf + offset);
+    wrap->size = contiguous;
+    wrap->flags = RECORD_WRAP;
+    tail += contiguous;
+    __atomic_store_n(&(this->tail), tail, __ATOMIC_RELEASE);
+    offset = 0;
+  }
+
+  logging::ring_record_t * rec = (logging::ring_record_t *) (this->buf + offset);
+  rec->flags = 0;
+  return rec;
+}
+
+
+// Publish a reserved record, trimmed to len bytes.
+void
+logging::Ring::commit(logging::ring_record_t * rec,
+                      size_t len)
+{
+  rec->size = RECORD_ALIGN(len);
+  __atomic_store_n(&(this->tail), this->tail + rec->size, __ATOMIC_RELEASE);
+}
+
+
+// Get the oldest record in the ring, or NULL if it is empty.
+logging::ring_record_t *
+logging::Ring::peek(void)
+{
+  uint64_t tail = __atomic_load_n(&(this->tail), __ATOMIC_ACQUIRE);
+  while (this->head != tail) {
+    logging::ring_record_t * rec =
+        (logging::ring_record_t *) (this->buf + (this->head & (this->capacity - 1)));
+    if (!(rec->flags & RECORD_WRAP)) {
+      return rec;
+    }
+    __atomic_store_n(&(this->head), this->head + rec->size, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+
+// Give the space of the oldest record back to the producer.
+void
+logging::Ring::release(logging::ring_record_t * rec)
+{
+  __atomic_store_n(&(this->head), this->head + rec->size, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Map a flight recorder file of at least size bytes of ring. A file
+ * left with lines that never reached the sinks is kept as path.prev.
+ */
+logging::Recorder::Recorder(const std::string& path,
+                            size_t size)
+{
+  size_t capacity = 4096;
+  while (capacity < size) {
+    capacity <<= 1;
+  }
+
+  int old_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (old_fd >= 0) {
+    logging::recorder_header_t old;
+    if (read(old_fd, &old, sizeof old) == (ssize_t) sizeof old &&
+        old.magic == RECORDER_MAGIC && old.head > old.flushed) {
+      rename(path.c_str(), (path + ".prev").c_str());
+    }
+    close(old_fd);
+  }
+
+  this->fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (this->fd < 0) {
+    throw "Unable to open the flight recorder file";
+  }
+  this->map_size = sizeof(logging::recorder_header_t) + capacity;
+  void * map = MAP_FAILED;
+  if (ftruncate(this->fd, this->map_size) == 0) {
+    map = mmap(NULL, this->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               this->fd, 0);
+  }
+  if (map == MAP_FAILED) {
+    close(this->fd);
+    throw "Unable to map the flight recorder file";
+  }
+
+  this->header = (logging::recorder_header_t *) map;
+  this->data = (char *) map + sizeof(logging::recorder_header_t);
+  this->header->version = RECORDER_VERSION;
+  this->header->capacity = capacity;
+  this->header->head = 0;
+  this->header->flushed = 0;
+  this->header->pid = getpid();
+  __atomic_store_n(&(this->header->magic), RECORDER_MAGIC, __ATOMIC_RELEASE);
+}
+
+
+// Unmap the recorder; the file stays, with nothing left unflushed.
+logging::Recorder::~Recorder()
+{
+  munmap(this->header, this->map_size);
+  close(this->fd);
+}
+
+
+// Append a line, overwriting the oldest ones once the ring is full.
+void
+logging::Recorder::append(const char * str,
+                          size_t len)
+{
+  uint64_t head = this->header->head;
+  size_t capacity = this->header->capacity;
+  if (len > capacity) {
+    str += len - capacity;
+    len = capacity;
+  }
+
+  size_t off = head & (capacity - 1);
+  size_t first = (len < capacity - off) ? len : capacity - off;
+  memcpy(this->data + off, str, first);
+  memcpy(this->data, str + first, len - first);
+  __atomic_store_n(&(this->header->head), head + len, __ATOMIC_RELEASE);
+}
+
+
+// Bytes written to the recorder so far.
+uint64_t
+logging::Recorder::get_head(void)
+{
+  return __atomic_load_n(&(this->header->head), __ATOMIC_ACQUIRE);
+}
+
+
+// Mark everything before pos as written to the sinks.
+void
+logging::Recorder::set_flushed(uint64_t pos)
+{
+  if (pos > this->header->flushed) {
+    __atomic_store_n(&(this->header->flushed), pos, __ATOMIC_RELEASE);
+  }
+}
+
+
+/*
+ * Read the lines of a flight recorder file that never reached the
+ * sinks, or all the lines it still holds if all is true, into *out.
+ * Returns false if the file is missing or is not a recorder file.
+ */
+bool
+logging::recover_recorder(const std::string& path,
+                          bool all,
+                          std::string * out)
+{
+  out->clear();
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  logging::recorder_header_t header;
+  if (fstat(fd, &st) != 0 ||
+      read(fd, &header, sizeof header) != (ssize_t) sizeof header ||
+      header.magic != RECORDER_MAGIC || header.version != RECORDER_VERSION ||
+      header.capacity == 0 || (header.capacity & (header.capacity - 1)) ||
+      (uint64_t) st.st_size < sizeof header + header.capacity) {
+    close(fd);
+    return false;
+  }
+
+  char * data = new char[header.capacity];
+  bool ok = (pread(fd, data, header.capacity, sizeof header) ==
+             (ssize_t) header.capacity);
+  close(fd);
+  if (ok) {
+    // Only the last capacity bytes are still there, from a line boundary.
+    uint64_t start = all ? 0 : header.flushed;
+    bool partial = false;
+    if (header.head > header.capacity && start < header.head - header.capacity) {
+      start = header.head - header.capacity;
+      partial = true;
+    }
+    for (uint64_t pos = start; pos < header.head; ++pos) {
+      char c = data[pos & (header.capacity - 1)];
+      if (partial) {
+        partial = (c != '\n');
+        continue;
+      }
+      out->push_back(c);
+    }
+  }
+  delete[] data;
+  return ok;
+}
+
+
+// History constructor.
+logging::History::History(size_t size)
+{
+  this->entries = new logging::history_entry_t[size];
+  this->size = size;
+  this->head = 0;
+  this->dumped = 0;
+  this->orphaned = false;
+  this->next = NULL;
+}
+
+
+// History destructor.
+logging::History::~History()
+{
+  delete[] this->entries;
+}
+
+
+// ThreadBuffer constructor.
+logging::ThreadBuffer::ThreadBuffer(size_t ring_size,
+                                   bool per_cpu)
+  : ring(ring_size)
+{
+  this->orphaned = false;
+  this->per_cpu = per_cpu;
+  pthread_mutex_init(&(this->mutex), NULL);
+  this->next = NULL;
+}
+
+
+// ThreadBuffer destructor.
+logging::ThreadBuffer::~ThreadBuffer()
+{
+  pthread_mutex_destroy(&(this->mutex));
+}
+
+
+// Write all of buf to fd, retrying partial writes; async-signal-safe.
+static void
+write_all(int fd,
+          const char * buf,
+          size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+
+// Write all of iov to fd, retrying partial writes.
+static void
+writev_all(int fd,
+           struct iovec * iov,
+           int iovcnt)
+{
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+
+// Sink constructor.
+logging::Sink::Sink(logging::log_level_t level)
+{
+  this->level = level;
+}
+
+
+// Sink destructor.
+logging::Sink::~Sink()
+{
+}
+
+
+// Write out whatever the sink holds back; nothing by default.
+void
+logging::Sink::flush(void)
+{
+}
+
+
+// Called by the runner every get_tick_msec(); nothing by default.
+void
+logging::Sink::tick(uint64_t now)
+{
+}
+
+
+// How often the sink wants tick() to be called; 0 for never.
+unsigned int
+logging::Sink::get_tick_msec(void)
+{
+  return 0;
+}
+
+
+// Rotate or reopen the destination of the sink; nothing by default.
+void
+logging::Sink::reopen(uint64_t now,
+                      bool force,
+                      pthread_mutex_t * lock)
+{
+}
+
+
+// Nothing for the crash handler to write to by default.
+int
+logging::Sink::crash_fd(void)
+{
+  return -1;
+}
+
+
+// Get the level of the sink.
+logging::log_level_t
+logging::Sink::get_level(void)
+{
+  return __atomic_load_n(&(this->level), __ATOMIC_RELAXED);
+}
+
+
+// Set the level of the sink.
+void
+logging::Sink::set_level(logging::log_level_t level)
+{
+  __atomic_store_n(&(this->level), level, __ATOMIC_RELAXED);
+}
+
+
+// FdSink constructor.
+logging::FdSink::FdSink(int fd,
+                        logging::log_level_t level,
+                        size_t batch_size,
+                        unsigned int batch_msec)
+  : Sink(level)
+{
+  this->fd = fd;
+  this->owns_fd = false;
+  this->batch_size = batch_size;
+  this->batch_msec = batch_msec;
+  this->pending = (batch_size > 0) ? new char[batch_size] : NULL;
+  this->pending_len = 0;
+  this->pending_since = 0;
+}
+
+
+// FdSink destructor.
+logging::FdSink::~FdSink()
+{
+  this->flush();
+  if (this->owns_fd) {
+    close(this->fd);
+  }
+  delete[] this->pending;
+}
+
+
+/*
+ * Write the pending bytes and the records in one writev().
+ * Records that are next to each other in memory share an iovec.
+ */
+void
+logging::FdSink::write_pending(const logging::log_record_t * records,
+                               size_t count)
+{
+  struct iovec iov[SINK_IOV_MAX];
+  int n = 0;
+
+  if (this->pending_len > 0) {
+    iov[n].iov_base = this->pending;
+    iov[n].iov_len = this->pending_len;
+    ++n;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    if (n > 0 &&
+        (char *) iov[n - 1].iov_base + iov[n - 1].iov_len == records[i].str) {
+      iov[n - 1].iov_len += records[i].len;
+      continue;
+    }
+    if (n == SINK_IOV_MAX) {
+      writev_all(this->fd, iov, n);
+      n = 0;
+    }
+    iov[n].iov_base = (void *) records[i].str;
+    iov[n].iov_len = records[i].len;
+    ++n;
+  }
+  if (n > 0) {
+    writev_all(this->fd, iov, n);
+  }
+  this->pending_len = 0;
+}
+
+
+// Write the records, or hold them back until a batch is full.
+void
+logging::FdSink::write(const logging::log_record_t * records,
+                       size_t count)
+{
+  size_t len = 0;
+  for (size_t i = 0; i < count; ++i) {
+    len += records[i].len;
+  }
+
+  if (this->pending_len + len < this->batch_size) {
+    if (this->pending_len == 0) {
+      this->pending_since = get_time_ns();
+    }
+    for (size_t i = 0; i < count; ++i) {
+      memcpy(this->pending + this->pending_len, records[i].str, records[i].len);
+      this->pending_len += records[i].len;
+    }
+    return;
+  }
+
+  this->write_pending(records, count);
+}
+
+
+// Write out the pending batch.
+void
+logging::FdSink::flush(void)
+{
+  if (this->pending_len > 0) {
+    this->write_pending(NULL, 0);
+  }
+}
+
+
+// Write out the pending batch once its oldest record is batch_msec old.
+void
+logging::FdSink::tick(uint64_t now)
+{
+  if (this->pending_len > 0 &&
+      now - this->pending_since >= (uint64_t) this->batch_msec * 1000000) {
+    this->write_pending(NULL, 0);
+  }
+}
+
+
+// Write out the pending batch with write(2) only, for the crash handler.
+int
+logging::FdSink::crash_fd(void)
+{
+  write_all(this->fd, this->pending, this->pending_len);
+  this->pending_len = 0;
+  return this->fd;
+}
+
+
+// A batching sink wants a tick every batch_msec.
+unsigned int
+logging::FdSink::get_tick_msec(void)
+{
+  return (this->batch_size > 0) ? this->batch_msec : 0;
+}
+
+
+// FileSink constructor.
+logging::FileSink::FileSink(const std::string& path,
+                            logging::log_level_t level,
+                            size_t batch_size,
+                            unsigned int batch_msec)
+  : FdSink(-1, level, batch_size, batch_msec)
+{
+  this->path = path;
+  this->fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (this->fd < 0) {
+    throw "Unable to create log file";
+  }
+  this->owns_fd = true;
+
+  struct stat st;
+  this->file_size = (fstat(this->fd, &st) == 0) ? st.st_size : 0;
+  this->rotate_bytes = 0;
+  this->rotate_sec = 0;
+  this->rotate_naming = ROTATE_NUMBERED;
+  this->rotate_keep = 0;
+  this->next_rotation = 0;
+  this->index_fd = -1;
+  this->index_bytes = 0;
+  this->index_records = 0;
+  this->index_count = 0;
+  this->lock_fd = -1;
+}
+
+
+// FileSink destructor; the last block of records is indexed.
+logging::FileSink::~FileSink()
+{
+  if (this->index_fd >= 0) {
+    this->write_index_block();
+    close(this->index_fd);
+  }
+  if (this->lock_fd >= 0) {
+    close(this->lock_fd);
+  }
+}
+
+
+// Rotate the file at max_bytes and/or every interval_sec; 0 disables.
+void
+logging::FileSink::set_rotation(size_t max_bytes,
+                                unsigned int interval_sec,
+                                logging::rotate_naming_t naming,
+                                unsigned int keep)
+{
+  this->rotate_bytes = max_bytes;
+  this->rotate_sec = interval_sec;
+  this->rotate_naming = naming;
+  this->rotate_keep = keep;
+  this->next_rotation = 0;
+  if (interval_sec > 0) {
+    uint64_t interval = (uint64_t) interval_sec * 1000000000ULL;
+    this->next_rotation = (get_time_ns() / interval + 1) * interval;
+  }
+}
+
+
+/*
+ * Share the file with other processes, each with its own FileSink on
+ * it: records are already appended whole, one writev() per batch, and
+ * this makes rotation take turns under a lock on <path>.lock, and
+ * follow a rotation done by another process. Throws if the lock file
+ * cannot be opened. The file is not indexed in this mode.
+ */
+void
+logging::FileSink::set_multi_process(bool enabled)
+{
+  if (enabled && this->lock_fd < 0) {
+    std::string path = this->path + ".lock";
+    this->lock_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (this->lock_fd < 0) {
+      throw "Unable to create log lock file";
+    }
+    this->set_index(0, 0);
+  } else if (!enabled && this->lock_fd >= 0) {
+    close(this->lock_fd);
+    this->lock_fd = -1;
+  }
+}
+
+
+// Whether the file at path is no longer the one written to.
+bool
+logging::FileSink::file_moved(void)
+{
+  struct stat path_st, fd_st;
+  if (stat(this->path.c_str(), &path_st) != 0) {
+    return true;
+  }
+  return fstat(this->fd, &fd_st) == 0 &&
+         (path_st.st_ino != fd_st.st_ino || path_st.st_dev != fd_st.st_dev);
+}
+
+
+/*
+ * Index the file every every_bytes bytes and/or every_records records
+ * written to it; both 0 stops indexing.
+ */
+void
+logging::FileSink::set_index(size_t every_bytes,
+                             size_t every_records)
+{
+  if (this->lock_fd >= 0) {
+    // Other processes write to the file too: offsets are not known.
+    every_bytes = 0;
+    every_records = 0;
+  }
+  this->index_bytes = every_bytes;
+  this->index_records = every_records;
+  if (every_bytes == 0 && every_records == 0) {
+    if (this->index_fd >= 0) {
+      this->write_index_block();
+      close(this->index_fd);
+      this->index_fd = -1;
+    }
+  } else if (this->index_fd < 0) {
+    this->index_fd = this->open_index(this->file_size == 0);
+  }
+}
+
+
+/*
+ * Open the index of the file, with a header if it is new. The index of
+ * an empty file is truncated: it was left by a file moved away.
+ */
+int
+logging::FileSink::open_index(bool truncate)
+{
+  std::string path = this->path + ".idx";
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC |
+                              (truncate ? O_TRUNC : 0), 0666);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size == 0) {
+    logging::index_header_t header = { INDEX_MAGIC, INDEX_VERSION, { 0, 0 } };
+    write_all(fd, (const char *) &header, sizeof header);
+  }
+  return fd;
+}
+
+
+// Add a record, written at offset in the file, to the current block.
+void
+logging::FileSink::index_record(const logging::log_record_t& record,
+                                uint64_t offset)
+{
+  logging::index_entry_t * block = &(this->index_block);
+  if (this->index_count == 0) {
+    block->offset = offset;
+    block->min_ns = record.timestamp;
+    block->max_ns = record.timestamp;
+  } else if (record.timestamp < block->min_ns) {
+    block->min_ns = record.timestamp;
+  } else if (record.timestamp > block->max_ns) {
+    block->max_ns = record.timestamp;
+  }
+  block->size = offset + record.len - block->offset;
+  ++this->index_count;
+
+  if ((this->index_bytes > 0 && block->size >= this->index_bytes) ||
+      (this->index_records > 0 && this->index_count >= this->index_records)) {
+    this->write_index_block();
+  }
+}
+
+
+// Append the current block, if any, to the index.
+void
+logging::FileSink::write_index_block(void)
+{
+  if (this->index_count > 0) {
+    write_all(this->index_fd, (const char *) &(this->index_block),
+              sizeof this->index_block);
+    this->index_count = 0;
+  }
+}
+
+
+// Count the bytes written, for rotation by size, and index them.
+void
+logging::FileSink::write(const logging::log_record_t * records,
+                         size_t count)
+{
+  uint64_t offset = __atomic_load_n(&(this->file_size), __ATOMIC_RELAXED);
+  uint64_t len = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (this->index_fd >= 0) {
+      this->index_record(records[i], offset + len);
+    }
+    len += records[i].len;
+  }
+  __atomic_add_fetch(&(this->file_size), len, __ATOMIC_RELAXED);
+  logging::FdSink::write(records, count);
+}
+
+
+// A file sink checks for rotation and reopen requests regularly.
+unsigned int
+logging::FileSink::get_tick_msec(void)
+{
+  unsigned int tick_msec = logging::FdSink::get_tick_msec();
+  if (tick_msec == 0 || tick_msec > REOPEN_CHECK_MSEC) {
+    tick_msec = REOPEN_CHECK_MSEC;
+  }
+  return tick_msec;
+}
+
+
+// Rename a log file, and its index if it has one.
+static void
+rename_log_file(const char * from,
+                const char * to)
+{
+  rename(from, to);
+  std::string from_index = std::string(from) + ".idx";
+  std::string to_index = std::string(to) + ".idx";
+  rename(from_index.c_str(), to_index.c_str());
+}
+
+
+// Remove a log file, and its index if it has one.
+static void
+unlink_log_file(const char * path)
+{
+  unlink(path);
+  unlink((std::string(path) + ".idx").c_str());
+}
+
+
+// Rename the file, and the older ones, out of the way.
+void
+logging::FileSink::rotate_files(uint64_t now)
+{
+  char name[PATH_MAX];
+
+  if (this->rotate_naming == ROTATE_TIMESTAMP) {
+    struct tm tm;
+    time_t sec = now / 1000000000ULL;
+    localtime_r(&sec, &tm);
+    size_t len = snprintf(name, sizeof name, "%s.", this->path.c_str());
+    strftime(name + len, sizeof name - len, "%Y%m%d-%H%M%S", &tm);
+    len = strlen(name);
+    // Two rotations in the same second get a counter.
+    struct stat st;
+    for (int n = 1; stat(name, &st) == 0; ++n) {
+      snprintf(name + len, sizeof name - len, ".%d", n);
+    }
+    rename_log_file(this->path.c_str(), name);
+    this->prune_files();
+    return;
+  }
+
+  // Numbered: shift log.txt.N to log.txt.N+1, dropping the last kept.
+  unsigned int last = this->rotate_keep;
+  if (last == 0) {
+    struct stat st;
+    do {
+      snprintf(name, sizeof name, "%s.%u", this->path.c_str(), ++last);
+    } while (stat(name, &st) == 0);
+  } else {
+    snprintf(name, sizeof name, "%s.%u", this->path.c_str(), last);
+    unlink_log_file(name);
+  }
+  for (unsigned int n = last; n > 1; --n) {
+    char from[PATH_MAX];
+    snprintf(from, sizeof from, "%s.%u", this->path.c_str(), n - 1);
+    snprintf(name, sizeof name, "%s.%u", this->path.c_str(), n);
+    rename_log_file(from, name);
+  }
+  snprintf(name, sizeof name, "%s.1", this->path.c_str());
+  rename_log_file(this->path.c_str(), name);
+}
+
+
+// Remove the oldest timestamped files beyond rotate_keep.
+void
+logging::FileSink::prune_files(void)
+{
+  if (this->rotate_keep == 0) {
+    return;
+  }
+
+  size_t slash = this->path.rfind('/');
+  std::string dir = (slash == std::string::npos) ? "." :
+                    (slash == 0) ? "/" : this->path.substr(0, slash);
+  std::string prefix = this->path.substr(slash + 1) + ".";
+  DIR * dp = opendir(dir.c_str());
+  if (dp == NULL) {
+    return;
+  }
+
+  // YYYYMMDD-HHMMSS, then maybe a counter; indexes go with their file.
+  std::vector<std::string> names;
+  struct dirent * entry;
+  while ((entry = readdir(dp)) != NULL) {
+    const char * name = entry->d_name;
+    size_t len = strlen(name);
+    if (strncmp(name, prefix.c_str(), prefix.size()) == 0 &&
+        len >= prefix.size() + 15 &&
+        !(len > 4 && strcmp(name + len - 4, ".idx") == 0) &&
+        name[prefix.size() + 8] == '-' &&
+        strspn(name + prefix.size(), "0123456789") == 8) {
+      names.push_back(name);
+    }
+  }
+  closedir(dp);
+
+  if (names.size() > this->rotate_keep) {
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size() - this->rotate_keep; ++i) {
+      unlink_log_file((dir + "/" + names[i]).c_str());
+    }
+  }
+}
+
+
+/*
+ * Rotate the file if it is due, or reopen it if forced to. The old file
+ * keeps getting the records until the new one is swapped in under lock.
+ * In multi-process mode, the size is that of the file, which all the
+ * processes write to; the first of them to find the rotation due does
+ * it, under the file lock, and the others just reopen the file. Files
+ * are only rotated while path still names the file written to, so that
+ * a reopen that failed is retried without rotating them again.
+ */
+void
+logging::FileSink::reopen(uint64_t now,
+                          bool force,
+                          pthread_mutex_t * lock)
+{
+  uint64_t size = __atomic_load_n(&(this->file_size), __ATOMIC_RELAXED);
+  struct stat st;
+  if (this->lock_fd >= 0 && this->rotate_bytes > 0 &&
+      fstat(this->fd, &st) == 0) {
+    size = st.st_size;
+  }
+  bool rotate =
+      (this->rotate_bytes > 0 && size >= this->rotate_bytes) ||
+      (this->next_rotation > 0 && now >= this->next_rotation);
+  bool moved = (this->lock_fd >= 0 || rotate) && this->file_moved();
+  if (!rotate && !force && !moved) {
+    return;
+  }
+
+  if (rotate && !moved && this->lock_fd >= 0) {
+    // flock() is released by the kernel, even if the process dies.
+    while (flock(this->lock_fd, LOCK_EX) != 0 && errno == EINTR) {
+    }
+    if (!this->file_moved()) {
+      this->rotate_files(now);
+    }
+    flock(this->lock_fd, LOCK_UN);
+  } else if (rotate && !moved) {
+    this->rotate_files(now);
+  }
+  int fd = open(this->path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    // Keep writing where we were, and only retry the open when the
+    // rotation is next due.
+    __atomic_store_n(&(this->file_size), 0, __ATOMIC_RELAXED);
+    if (this->rotate_sec > 0) {
+      uint64_t interval = (uint64_t) this->rotate_sec * 1000000000ULL;
+      this->next_rotation = (now / interval + 1) * interval;
+    }
+    return;
+  }
+  uint64_t file_size = (fstat(fd, &st) == 0) ? st.st_size : 0;
+
+  pthread_mutex_lock(lock);
+  this->flush();
+  int old_fd = this->fd;
+  this->fd = fd;
+  __atomic_store_n(&(this->file_size), file_size, __ATOMIC_RELAXED);
+  int old_index_fd = this->index_fd;
+  if (old_index_fd >= 0) {
+    // The index of the old file may be where the new one is to go.
+    this->write_index_block();
+    this->index_fd = this->open_index(file_size == 0);
+  }
+  pthread_mutex_unlock(lock);
+  close(old_fd);
+  if (old_index_fd >= 0) {
+    close(old_index_fd);
+  }
+
+  if (this->rotate_sec > 0) {
+    uint64_t interval = (uint64_t) this->rotate_sec * 1000000000ULL;
+    this->next_rotation = (now / interval + 1) * interval;
+  }
+}
+
+
+// The date and time last parsed by parse_time(), to spare a mktime() a line.
+typedef struct {
+  char str[32];               // Up to the seconds, then the zone.
+  size_t len;
+  time_t sec;
+} time_parse_cache_t;
+
+// Read n decimal digits.
+static bool
+get_digits(const char * p,
+           int n,
+           int * v)
+{
+  *v = 0;
+  for (int i = 0; i < n; ++i) {
+    if (p[i] < '0' || p[i] > '9') {
+      return false;
+    }
+    *v = *v * 10 + (p[i] - '0');
+  }
+  return true;
+}
+
+
+/*
+ * parse_log_time(), with an optional cache; *unit is set to the
+ * precision of the time, in nanoseconds.
+ */
+static size_t
+parse_time(const char * str,
+           size_t len,
+           bool utc,
+           time_parse_cache_t * cache,
+           uint64_t * ns,
+           uint64_t * unit)
+{
+  if (len < 19) {
+    return 0;
+  }
+  bool iso8601 = (str[4] == '-' && str[7] == '-' && str[10] == 'T');
+  if (!iso8601 && !(str[2] == '-' && str[5] == '-' && str[10] == ' ')) {
+    return 0;
+  }
+
+  struct tm tm;
+  memset(&tm, 0, sizeof tm);
+  bool ok = iso8601 ? get_digits(str, 4, &tm.tm_year) &&
+                      get_digits(str + 5, 2, &tm.tm_mon) &&
+                      get_digits(str + 8, 2, &tm.tm_mday)
+                    : get_digits(str, 2, &tm.tm_mday) &&
+                      get_digits(str + 3, 2, &tm.tm_mon) &&
+                      get_digits(str + 6, 4, &tm.tm_year);
+  if (!ok || str[13] != ':' || str[16] != ':' ||
+      !get_digits(str + 11, 2, &tm.tm_hour) ||
+      !get_digits(str + 14, 2, &tm.tm_min) ||
+      !get_digits(str + 17, 2, &tm.tm_sec)) {
+    return 0;
+  }
+
+  // Fraction of a second, to the nanosecond.
+  size_t pos = 19;
+  uint64_t frac = 0;
+  *unit = 1000000000ULL;
+  if (pos < len && str[pos] == '.') {
+    int digits = 0;
+    for (++pos; pos < len && str[pos] >= '0' && str[pos] <= '9'; ++pos) {
+      if (digits++ < 9) {
+        frac = frac * 10 + (str[pos] - '0');
+      }
+    }
+    if (digits == 0) {
+      return 0;
+    }
+    for (*unit = 1; digits < 9; ++digits) {
+      frac *= 10;
+      *unit *= 10;
+    }
+  }
+
+  // Zone designator, for ISO 8601 only.
+  size_t zone = pos;
+  bool zoned = false;
+  long offset = 0;
+  int hours, minutes;
+  if (iso8601 && pos < len && str[pos] == 'Z') {
+    zoned = true;
+    ++pos;
+  } else if (iso8601 && pos + 6 <= len &&
+             (str[pos] == '+' || str[pos] == '-') && str[pos + 3] == ':' &&
+             get_digits(str + pos + 1, 2, &hours) &&
+             get_digits(str + pos + 4, 2, &minutes)) {
+    zoned = true;
+    offset = (hours * 60 + minutes) * 60 * (str[pos] == '-' ? -1 : 1);
+    pos += 6;
+  }
+
+  time_t sec;
+  size_t key_len = 19 + pos - zone;
+  if (cache && cache->len == key_len && memcmp(cache->str, str, 19) == 0 &&
+      memcmp(cache->str + 19, str + zone, pos - zone) == 0) {
+    sec = cache->sec;
+  } else {
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    sec = (zoned || utc) ? timegm(&tm) - offset : mktime(&tm);
+    if (cache && key_len <= sizeof cache->str) {
+      memcpy(cache->str, str, 19);
+      memcpy(cache->str + 19, str + zone, pos - zone);
+      cache->len = key_len;
+      cache->sec = sec;
+    }
+  }
+  if (sec < 0) {
+    return 0;
+  }
+
+  *ns = (uint64_t) sec * 1000000000ULL + frac;
+  return pos;
+}
+
+
+/*
+ * Parse a time as format_time() writes it, DD-MM-YYYY HH:MM:SS or
+ * YYYY-MM-DDTHH:MM:SS, with any fraction of a second and, in ISO 8601,
+ * zone designator; times without one are local, or UTC if utc is true.
+ * Returns the length parsed, or 0 if str does not start with a time.
+ */
+size_t
+logging::parse_log_time(const char * str,
+                        size_t len,
+                        bool utc,
+                        uint64_t * ns)
+{
+  uint64_t unit;
+  return parse_time(str, len, utc, NULL, ns, &unit);
+}
+
+
+/*
+ * Parse a time given on a command line: as the log writes it (see
+ * parse_log_time()), or @<seconds since the epoch>, with any fraction.
+ */
+bool
+logging::parse_time_arg(const char * arg,
+                        bool utc,
+                        uint64_t * ns)
+{
+  if (arg[0] == '@') {
+    char * end;
+    double sec = strtod(arg + 1, &end);
+    *ns = (uint64_t) (sec * 1e9);
+    return end != arg + 1 && *end == '\0' && sec >= 0;
+  }
+  size_t len = strlen(arg);
+  return len > 0 && logging::parse_log_time(arg, len, utc, ns) == len;
+}
+
+
+/*
+ * Parse the prefix of a log line, as format_prefix() writes it, for its
+ * time (and its precision), level and thread. Returns false for the
+ * lines of a message that follow its first one.
+ */
+static bool
+parse_prefix(const char * p,
+             size_t len,
+             bool utc,
+             time_parse_cache_t * cache,
+             uint64_t * ns,
+             uint64_t * unit,
+             int * level,
+             int64_t * thread)
+{
+  size_t pos = parse_time(p, len, utc, cache, ns, unit);
+  if (pos == 0 || pos + 2 + 7 + 8 + 5 > len ||
+      p[pos] != ',' || p[pos + 1] != ' ') {
+    return false;
+  }
+
+  // The level is right aligned in 7 characters.
+  const char * level_str = p + pos + 2;
+  *level = -1;
+  for (int l = 0; l < logging::TOTAL_LOG_LEVELS && *level < 0; ++l) {
+    const char * name = logging::log_level_str[l];
+    size_t name_len = strlen(name);
+    if (memcmp(level_str + 7 - name_len, name, name_len) == 0) {
+      *level = l;
+    }
+  }
+  if (*level < 0 || memcmp(level_str + 7, " Thread ", 8) != 0) {
+    return false;
+  }
+
+  const char * end = p + len;
+  const char * q = level_str + 15;
+  while (q < end && *q == ' ') {
+    ++q;
+  }
+  const char * digits = q;
+  *thread = 0;
+  for (; q < end && *q >= '0' && *q <= '9'; ++q) {
+    *thread = *thread * 10 + (*q - '0');
+  }
+  return q > digits;
+}
+
+
+/*
+ * Read the index of a log file of file_size bytes. Entries stop at the
+ * first one that does not fit the file: the index is of another file.
+ */
+static void
+read_index(const std::string& path,
+           uint64_t file_size,
+           std::vector<logging::index_entry_t> * index)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  logging::index_header_t header;
+  if (fstat(fd, &st) == 0 &&
+      read(fd, &header, sizeof header) == (ssize_t) sizeof header &&
+      header.magic == INDEX_MAGIC && header.version == INDEX_VERSION) {
+    size_t count = (st.st_size - sizeof header) / sizeof(logging::index_entry_t);
+    index->resize(count);
+    ssize_t len = pread(fd, index->data(), count * sizeof(logging::index_entry_t),
+                        sizeof header);
+    count = (len > 0) ? len / sizeof(logging::index_entry_t) : 0;
+    uint64_t end = 0;
+    for (size_t i = 0; i < count; ++i) {
+      const logging::index_entry_t& entry = (*index)[i];
+      if (entry.offset < end || entry.offset + entry.size > file_size ||
+          entry.min_ns > entry.max_ns) {
+        count = i;
+        break;
+      }
+      end = entry.offset + entry.size;
+    }
+    index->resize(count);
+  }
+  close(fd);
+}
+
+
+/*
+ * Write the lines of a log file that the query selects to out_fd. Only
+ * the blocks of the index that may hold lines of the time range are
+ * scanned, along with the parts of the file the index does not cover.
+ * Returns the messages written, or -1 if the file cannot be read.
+ */
+static ssize_t
+query_file(const std::string& path,
+           const logging::log_query_t& query,
+           int out_fd,
+           uint64_t * scanned)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  uint64_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return 0;
+  }
+  char * data = (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  /*
+   * A line only shows the time to its precision: it is selected if the
+   * range holds any time it may stand for. So a block is only left out
+   * if the range is past the second of its latest record, or before
+   * that of its earliest one.
+   */
+  std::vector<logging::index_entry_t> index;
+  read_index(path + ".idx", size, &index);
+  std::vector<std::pair<uint64_t, uint64_t> > ranges;
+  uint64_t pos = 0;
+  for (size_t i = 0; i <= index.size(); ++i) {
+    uint64_t start = (i < index.size()) ? index[i].offset : size;
+    if (start > pos) {
+      ranges.push_back(std::make_pair(pos, start));
+    }
+    if (i == index.size()) {
+      break;
+    }
+    const logging::index_entry_t& entry = index[i];
+    if (entry.max_ns >= query.from_ns / 1000000000ULL * 1000000000ULL &&
+        entry.min_ns / 1000000000ULL * 1000000000ULL < query.to_ns) {
+      if (!ranges.empty() && ranges.back().second == entry.offset) {
+        ranges.back().second = entry.offset + entry.size;
+      } else {
+        ranges.push_back(std::make_pair(entry.offset,
+                                        entry.offset + entry.size));
+      }
+    }
+    pos = entry.offset + entry.size;
+  }
+
+  // Lines that follow the first one of a message go with it.
+  ssize_t matched = 0;
+  time_parse_cache_t cache = { "", 0, 0 };
+  for (size_t r = 0; r < ranges.size(); ++r) {
+    const char * p = data + ranges[r].first;
+    const char * end = data + ranges[r].second;
+    const char * run = NULL;
+    bool wanted = false;
+    while (p < end) {
+      const char * nl = (const char *) memchr(p, '\n', end - p);
+      const char * next = nl ? nl + 1 : end;
+      uint64_t ns, unit;
+      int level;
+      int64_t thread;
+      if (parse_prefix(p, next - p, query.utc, &cache, &ns, &unit, &level,
+                       &thread)) {
+        wanted = ns + unit > query.from_ns && ns < query.to_ns &&
+                 level <= query.level &&
+                 (query.thread < 0 || thread == query.thread);
+        matched += wanted;
+      }
+      if (wanted && run == NULL) {
+        run = p;
+      } else if (!wanted && run) {
+        write_all(out_fd, run, p - run);
+        run = NULL;
+      }
+      p = next;
+    }
+    if (run) {
+      write_all(out_fd, run, end - run);
+    }
+    *scanned += ranges[r].second - ranges[r].first;
+  }
+
+  munmap(data, size);
+  return matched;
+}
+
+
+/*
+ * Write the lines of log files that a query selects to fd. The files
+ * may be the segments of a rotated log, given in any order: they are
+ * read in the order of the time of their first line. Index files
+ * (.idx) among them are skipped. Returns the messages written, or -1
+ * if none of the files can be read; the bytes scanned go to *scanned.
+ */
+ssize_t
+logging::query_log(const std::vector<std::string>& files,
+                   const logging::log_query_t& query,
+                   int fd,
+                   uint64_t * scanned)
+{
+  std::vector<std::pair<uint64_t, size_t> > order;
+  for (size_t i = 0; i < files.size(); ++i) {
+    const std::string& path = files[i];
+    if (path.size() > 4 && path.compare(path.size() - 4, 4, ".idx") == 0) {
+      continue;
+    }
+    char buf[64];
+    uint64_t ns = UINT64_MAX, unit;
+    int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in >= 0) {
+      ssize_t len = read(in, buf, sizeof buf);
+      if (len <= 0 || parse_time(buf, len, query.utc, NULL, &ns, &unit) == 0) {
+        ns = UINT64_MAX;
+      }
+      close(in);
+    }
+    order.push_back(std::make_pair(ns, i));
+  }
+  std::stable_sort(order.begin(), order.end());
+
+  uint64_t bytes = 0;
+  ssize_t matched = -1;
+  for (size_t i = 0; i < order.size(); ++i) {
+    ssize_t n = query_file(files[order[i].second], query, fd, &bytes);
+    if (n >= 0) {
+      matched = (matched < 0) ? n : matched + n;
+    }
+  }
+  if (scanned) {
+    *scanned = bytes;
+  }
+  return matched;
+}
+
+
+// Length bytes beyond the 15 that fit in the nibble of a token.
+static char *
+lz_put_length(char * op,
+              size_t len)
+{
+  for (; len >= 255; len -= 255) {
+    *op++ = (char) 255;
+  }
+  *op++ = (char) len;
+  return op;
+}
+
+
+/*
+ * Compress src with an LZ77 codec, in the LZ4 block format: sequences
+ * of literals followed by a match of 4 bytes or more, up to 64 KB back,
+ * found through a hash table of the last position of every 4 bytes.
+ * Returns the compressed length, or 0 if it does not fit in size bytes.
+ */
+size_t
+logging::lz_compress(const char * src,
+                     size_t len,
+                     char * dst,
+                     size_t size)
+{
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof table);
+  const unsigned char * in = (const unsigned char *) src;
+  char * op = dst;
+  char * end = dst + size;
+  size_t anchor = 0;
+
+  // The last match starts 12 bytes before the end, and ends 5 before it.
+  size_t limit = (len > 12) ? len - 12 : 0;
+  size_t ip = 0;
+  while (ip < limit) {
+    uint32_t v, r;
+    memcpy(&v, in + ip, 4);
+    uint32_t h = (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+    size_t ref = table[h];
+    table[h] = ip;
+    memcpy(&r, in + ref, 4);
+    if (ref >= ip || ip - ref > 65535 || r != v) {
+      // Skip faster through data that does not compress.
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+    while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]) {
+      --ip;
+      --ref;
+    }
+    size_t match = 4;
+    while (ip + match < len - 5 && in[ref + match] == in[ip + match]) {
+      ++match;
+    }
+
+    size_t literals = ip - anchor;
+    if (op + literals + literals / 255 + match / 255 + 8 > end) {
+      return 0;
+    }
+    char * token = op++;
+    *token = (char) (((literals < 15) ? literals : 15) << 4);
+    if (literals >= 15) {
+      op = lz_put_length(op, literals - 15);
+    }
+    memcpy(op, in + anchor, literals);
+    op += literals;
+    *op++ = (char) ((ip - ref) & 0xff);
+    *op++ = (char) ((ip - ref) >> 8);
+    if (match - 4 >= 15) {
+      *token |= 15;
+      op = lz_put_length(op, match - 4 - 15);
+    } else {
+      *token |= (char) (match - 4);
+    }
+    ip += match;
+    anchor = ip;
+  }
+
+  size_t literals = len - anchor;
+  if (op + literals + literals / 255 + 2 > end) {
+    return 0;
+  }
+  *op++ = (char) (((literals < 15) ? literals : 15) << 4);
+  if (literals >= 15) {
+    op = lz_put_length(op, literals - 15);
+  }
+  memcpy(op, in + anchor, literals);
+  op += literals;
+  return op - dst;
+}
+
+
+/*
+ * Decompress what lz_compress() wrote into dst, of size bytes. Returns
+ * the decompressed length, or -1 if src is corrupt or dst too small.
+ */
+ssize_t
+logging::lz_decompress(const char * src,
+                       size_t len,
+                       char * dst,
+                       size_t size)
+{
+  const unsigned char * in = (const unsigned char *) src;
+  size_t ip = 0;
+  size_t op = 0;
+  while (ip < len) {
+    unsigned int token = in[ip++];
+    size_t literals = token >> 4;
+    if (literals == 15) {
+      unsigned int b;
+      do {
+        if (ip >= len) {
+          return -1;
+        }
+        b = in[ip++];
+        literals += b;
+      } while (b == 255);
+    }
+    if (literals > len - ip || literals > size - op) {
+      return -1;
+    }
+    memcpy(dst + op, in + ip, literals);
+    ip += literals;
+    op += literals;
+    if (ip == len) {
+      // The last sequence has no match.
+      break;
+    }
+
+    if (len - ip < 2) {
+      return -1;
+    }
+    size_t offset = in[ip] | (in[ip + 1] << 8);
+    ip += 2;
+    size_t match = token & 15;
+    if (match == 15) {
+      unsigned int b;
+      do {
+        if (ip >= len) {
+          return -1;
+        }
+        b = in[ip++];
+        match += b;
+      } while (b == 255);
+    }
+    match += 4;
+    if (offset == 0 || offset > op || match > size - op) {
+      return -1;
+    }
+    if (offset >= match) {
+      memcpy(dst + op, dst + op - offset, match);
+    } else {
+      // Overlapping: a run repeating the last offset bytes.
+      for (size_t i = 0; i < match; ++i) {
+        dst[op + i] = dst[op + i - offset];
+      }
+    }
+    op += match;
+  }
+  return op;
+}
+
+
+// BlockFileSink constructor.
+logging::BlockFileSink::BlockFileSink(const std::string& path,
+                                      logging::log_level_t level,
+                                      size_t block_size,
+                                      unsigned int block_msec)
+  : Sink(level)
+{
+  this->path = path;
+  this->fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (this->fd < 0) {
+    throw "Unable to create log file";
+  }
+
+  // A block holds at least a whole message.
+  this->block_size = (block_size < LOG_BUF_SIZE) ? LOG_BUF_SIZE :
+                     (block_size > BLOCK_SIZE_MAX) ? BLOCK_SIZE_MAX : block_size;
+  this->block_msec = block_msec;
+  for (size_t i = 0; i < BLOCK_BUFFERS; ++i) {
+    this->blocks[i].data = new char[this->block_size];
+    this->blocks[i].len = 0;
+  }
+  this->filled = 0;
+  this->written = 0;
+  this->stop_writer = false;
+  this->out = new char[this->block_size];
+  pthread_mutex_init(&(this->mutex), NULL);
+  pthread_cond_init(&(this->cond), NULL);
+  pthread_mutex_init(&(this->fd_mutex), NULL);
+  pthread_create(&(this->writer_id), NULL, writer, this);
+}
+
+
+// BlockFileSink destructor; the blocks left are written out first.
+logging::BlockFileSink::~BlockFileSink()
+{
+  this->flush();
+  pthread_mutex_lock(&(this->mutex));
+  this->stop_writer = true;
+  pthread_cond_broadcast(&(this->cond));
+  pthread_mutex_unlock(&(this->mutex));
+  pthread_join(this->writer_id, NULL);
+
+  close(this->fd);
+  for (size_t i = 0; i < BLOCK_BUFFERS; ++i) {
+    delete[] this->blocks[i].data;
+  }
+  delete[] this->out;
+  pthread_mutex_destroy(&(this->mutex));
+  pthread_cond_destroy(&(this->cond));
+  pthread_mutex_destroy(&(this->fd_mutex));
+}
+
+
+/*
+ * Hand the block being filled to the writer, and wait until the next
+ * one is free, if the writer is that far behind.
+ */
+void
+logging::BlockFileSink::seal_block(void)
+{
+  pthread_mutex_lock(&(this->mutex));
+  ++this->filled;
+  pthread_cond_broadcast(&(this->cond));
+  while (this->filled - this->written >= BLOCK_BUFFERS) {
+    pthread_cond_wait(&(this->cond), &(this->mutex));
+  }
+  pthread_mutex_unlock(&(this->mutex));
+}
+
+
+// Copy the records into the block being filled; a full one is sealed.
+void
+logging::BlockFileSink::write(const logging::log_record_t * records,
+                              size_t count)
+{
+  for (size_t i = 0; i < count; ++i) {
+    const char * str = records[i].str;
+    size_t len = records[i].len;
+    logging::block_buffer_t * block = &(this->blocks[this->filled % BLOCK_BUFFERS]);
+    if (block->len > 0 && block->len + len > this->block_size) {
+      this->seal_block();
+      block = &(this->blocks[this->filled % BLOCK_BUFFERS]);
+    }
+
+    while (len > 0) {
+      if (block->len == 0) {
+        block->min_ns = records[i].timestamp;
+        block->max_ns = records[i].timestamp;
+        block->since = get_time_ns();
+      } else if (records[i].timestamp < block->min_ns) {
+        block->min_ns = records[i].timestamp;
+      } else if (records[i].timestamp > block->max_ns) {
+        block->max_ns = records[i].timestamp;
+      }
+      size_t n = std::min(len, this->block_size - block->len);
+      memcpy(block->data + block->len, str, n);
+      block->len += n;
+      str += n;
+      len -= n;
+      if (block->len == this->block_size) {
+        this->seal_block();
+        block = &(this->blocks[this->filled % BLOCK_BUFFERS]);
+      }
+    }
+  }
+}
+
+
+// Hand the records gathered so far to the writer, without waiting for it.
+void
+logging::BlockFileSink::flush(void)
+{
+  if (this->blocks[this->filled % BLOCK_BUFFERS].len > 0) {
+    this->seal_block();
+  }
+}
+
+
+// Hand the block being filled to the writer once it is block_msec old.
+void
+logging::BlockFileSink::tick(uint64_t now)
+{
+  logging::block_buffer_t * block = &(this->blocks[this->filled % BLOCK_BUFFERS]);
+  if (block->len > 0 && this->block_msec > 0 &&
+      now - block->since >= (uint64_t) this->block_msec * 1000000) {
+    this->seal_block();
+  }
+}
+
+
+// The sink wants a tick every block_msec.
+unsigned int
+logging::BlockFileSink::get_tick_msec(void)
+{
+  return this->block_msec;
+}
+
+
+/*
+ * Reopen the file if forced to, e.g. once logrotate has moved it; the
+ * writer is kept off the descriptor while it is switched.
+ */
+void
+logging::BlockFileSink::reopen(uint64_t now,
+                               bool force,
+                               pthread_mutex_t * lock)
+{
+  if (!force) {
+    return;
+  }
+  int fd = open(this->path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    // Keep writing where we were.
+    return;
+  }
+  pthread_mutex_lock(&(this->fd_mutex));
+  int old_fd = this->fd;
+  this->fd = fd;
+  pthread_mutex_unlock(&(this->fd_mutex));
+  close(old_fd);
+}
+
+
+/*
+ * Write a full block out with a block_header_t, compressed unless it
+ * does not get any smaller. Called by the writer only.
+ */
+void
+logging::BlockFileSink::write_block(const logging::block_buffer_t * block)
+{
+  logging::block_header_t header;
+  memset(&header, 0, sizeof header);
+  header.magic = BLOCK_MAGIC;
+  header.version = BLOCK_VERSION;
+  header.raw_size = block->len;
+  header.min_ns = block->min_ns;
+  header.max_ns = block->max_ns;
+  size_t size = lz_compress(block->data, block->len, this->out, block->len);
+
+  struct iovec iov[2];
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof header;
+  if (size > 0) {
+    header.codec = logging::BLOCK_LZ;
+    header.size = size;
+    iov[1].iov_base = this->out;
+  } else {
+    header.codec = logging::BLOCK_STORED;
+    header.size = block->len;
+    iov[1].iov_base = block->data;
+  }
+  iov[1].iov_len = header.size;
+
+  pthread_mutex_lock(&(this->fd_mutex));
+  writev_all(this->fd, iov, 2);
+  pthread_mutex_unlock(&(this->fd_mutex));
+}
+
+
+// Thread of the sink, writing out the full blocks in order.
+void *
+logging::BlockFileSink::writer(void * arg)
+{
+  logging::BlockFileSink * sink = (logging::BlockFileSink *) arg;
+  pthread_mutex_lock(&(sink->mutex));
+  while (1) {
+    while (sink->written == sink->filled && !sink->stop_writer) {
+      pthread_cond_wait(&(sink->cond), &(sink->mutex));
+    }
+    if (sink->written == sink->filled) {
+      break;
+    }
+    logging::block_buffer_t * block = &(sink->blocks[sink->written % BLOCK_BUFFERS]);
+    pthread_mutex_unlock(&(sink->mutex));
+
+    sink->write_block(block);
+
+    pthread_mutex_lock(&(sink->mutex));
+    block->len = 0;
+    ++sink->written;
+    pthread_cond_broadcast(&(sink->cond));
+  }
+  pthread_mutex_unlock(&(sink->mutex));
+  return NULL;
+}
+
+
+/*
+ * Write out the blocks not written yet, uncompressed, for the crash
+ * handler. The one the writer is on may end up in the file twice. The
+ * crash report then follows as plain text.
+ */
+int
+logging::BlockFileSink::crash_fd(void)
+{
+  for (uint64_t i = this->written; i <= this->filled; ++i) {
+    logging::block_buffer_t * block = &(this->blocks[i % BLOCK_BUFFERS]);
+    if (block->len == 0) {
+      continue;
+    }
+    logging::block_header_t header;
+    memset(&header, 0, sizeof header);
+    header.magic = BLOCK_MAGIC;
+    header.version = BLOCK_VERSION;
+    header.codec = logging::BLOCK_STORED;
+    header.raw_size = block->len;
+    header.size = block->len;
+    header.min_ns = block->min_ns;
+    header.max_ns = block->max_ns;
+    write_all(this->fd, (const char *) &header, sizeof header);
+    write_all(this->fd, block->data, block->len);
+  }
+  return this->fd;
+}
+
+
+// Whether a header read from a block-compressed file can be a real one.
+static bool
+block_header_valid(const logging::block_header_t& header)
+{
+  return header.magic == BLOCK_MAGIC && header.version == BLOCK_VERSION &&
+         header.raw_size <= BLOCK_SIZE_MAX && header.size <= BLOCK_SIZE_MAX &&
+         header.min_ns <= header.max_ns &&
+         ((header.codec == logging::BLOCK_STORED &&
+           header.size == header.raw_size) ||
+          header.codec == logging::BLOCK_LZ);
+}
+
+
+/*
+ * Read from fd until buf holds want bytes past pos, or the input ends.
+ * Returns how many it holds.
+ */
+static size_t
+fill_input(int fd,
+           std::string * buf,
+           size_t * pos,
+           size_t want)
+{
+  if (buf->size() - *pos >= want) {
+    return buf->size() - *pos;
+  }
+  buf->erase(0, *pos);
+  *pos = 0;
+  char chunk[BLOCK_SIZE];
+  while (buf->size() < want) {
+    ssize_t n = read(fd, chunk, sizeof chunk);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    buf->append(chunk, n);
+  }
+  return buf->size();
+}
+
+
+/*
+ * Write out the lines of a block-compressed log file, from the blocks
+ * with records in the time range [from_ns, to_ns); the others are
+ * skipped from their headers, with lseek() if in_fd allows it. Plain
+ * text between the blocks is written out as it is. A block cut short
+ * at the end, by a crash, is left out. Returns the bytes written, or -1
+ * if a block is corrupt.
+ */
+ssize_t
+logging::cat_blocks(int in_fd,
+                    int out_fd,
+                    uint64_t from_ns,
+                    uint64_t to_ns)
+{
+  const size_t header_len = sizeof(logging::block_header_t);
+  const char magic[4] = { 'L', 'B', 'L', 'K' };
+  std::string buf;
+  std::vector<char> raw;
+  size_t pos = 0;
+  ssize_t written = 0;
+  while (1) {
+    size_t avail = fill_input(in_fd, &buf, &pos, header_len);
+    if (avail == 0) {
+      break;
+    }
+    logging::block_header_t header;
+    if (avail >= header_len) {
+      memcpy(&header, buf.data() + pos, header_len);
+    }
+    if (avail < header_len || !block_header_valid(header)) {
+      // Plain text, up to where the next block may start.
+      const char * start = buf.data() + pos;
+      const char * next = (const char *) memmem(start + 1, avail - 1,
+                                                magic, sizeof magic);
+      size_t len = next ? next - start :
+                   (avail < header_len) ? avail : avail - (sizeof magic - 1);
+      write_all(out_fd, start, len);
+      written += len;
+      pos += len;
+      continue;
+    }
+
+    size_t block_len = header_len + header.size;
+    bool wanted = header.max_ns >= from_ns && header.min_ns < to_ns;
+    if (!wanted && avail < block_len &&
+        lseek(in_fd, block_len - avail, SEEK_CUR) >= 0) {
+      buf.clear();
+      pos = 0;
+      continue;
+    }
+    if (fill_input(in_fd, &buf, &pos, block_len) < block_len) {
+      break;
+    }
+    if (wanted) {
+      const char * data = buf.data() + pos + header_len;
+      if (header.codec == logging::BLOCK_LZ) {
+        raw.resize(header.raw_size);
+        if (lz_decompress(data, header.size, raw.data(), raw.size()) !=
+            (ssize_t) header.raw_size) {
+          return -1;
+        }
+        data = raw.data();
+      }
+      write_all(out_fd, data, header.raw_size);
+      written += header.raw_size;
+    }
+    pos += block_len;
+  }
+  return written;
+}
+
+
+// StderrSink constructor.
+logging::StderrSink::StderrSink(logging::log_level_t level)
+  : FdSink(STDERR_FILENO, level)
+{
+}
+
+
+// MemorySink constructor.
+logging::MemorySink::MemorySink(size_t capacity,
+                                logging::log_level_t level)
+  : Sink(level)
+{
+  this->capacity = capacity;
+  pthread_mutex_init(&(this->mutex), NULL);
+}
+
+
+// MemorySink destructor.
+logging::MemorySink::~MemorySink()
+{
+  pthread_mutex_destroy(&(this->mutex));
+}
+
+
+// Append the records, dropping the oldest bytes beyond capacity.
+void
+logging::MemorySink::write(const logging::log_record_t * records,
+                           size_t count)
+{
+  pthread_mutex_lock(&(this->mutex));
+  for (size_t i = 0; i < count; ++i) {
+    this->contents.append(records[i].str, records[i].len);
+  }
+  if (this->contents.size() > this->capacity) {
+    this->contents.erase(0, this->contents.size() - this->capacity);
+  }
+  pthread_mutex_unlock(&(this->mutex));
+}
+
+
+// Get a copy of the lines held.
+std::string
+logging::MemorySink::get_contents(void)
+{
+  pthread_mutex_lock(&(this->mutex));
+  std::string contents = this->contents;
+  pthread_mutex_unlock(&(this->mutex));
+  return contents;
+}
+
+
+// Drop the lines held.
+void
+logging::MemorySink::clear(void)
+{
+  pthread_mutex_lock(&(this->mutex));
+  this->contents.clear();
+  pthread_mutex_unlock(&(this->mutex));
+}
+
+
+// Get the logging severity level in string form.
+const char *
+logging::get_level_str(logging::log_level_t level)
+{
+  if (level >= 0 && level < TOTAL_LOG_LEVELS) {
+    return log_level_str[level];
+  }
+  return NULL;
+}
+
+
+// The thread of a forked child has an id of its own.
+static void
+reset_thread_id(void)
+{
+  tls_thread_id = 0;
+}
+
+
+static void
+register_thread_id_reset(void)
+{
+  pthread_atfork(NULL, NULL, reset_thread_id);
+}
+
+
+/*
+ * Get the kernel id of the current thread, as top and perf show it;
+ * the system call is only made on the first message of the thread.
+ */
+uint32_t
+logging::Log::get_thread_id(void)
+{
+  if (tls_thread_id == 0) {
+    pthread_once(&thread_id_once, register_thread_id_reset);
+    tls_thread_id = syscall(SYS_gettid);
+  }
+  return tls_thread_id;
+}
+
+
+// Preformat the name and the context fields of the calling thread.
+static void
+format_context(void)
+{
+  thread_context_t * c = &tls_context;
+  c->len = 0;
+  if (c->name[0] == '\0' && c->fields == 0) {
+    return;
+  }
+
+  // Fields that do not fit in full are left out.
+  size_t len = 0;
+  c->text[len++] = '[';
+  size_t name_len = strlen(c->name);
+  memcpy(c->text + len, c->name, name_len);
+  len += name_len;
+  for (size_t i = 0; i < c->fields; ++i) {
+    size_t key_len = strlen(c->keys[i]);
+    size_t value_len = strlen(c->values[i]);
+    size_t sep = (len > 1);
+    if (len + sep + key_len + 1 + value_len + 2 >= sizeof c->text) {
+      break;
+    }
+    if (sep) {
+      c->text[len++] = ' ';
+    }
+    memcpy(c->text + len, c->keys[i], key_len);
+    len += key_len;
+    c->text[len++] = '=';
+    memcpy(c->text + len, c->values[i], value_len);
+    len += value_len;
+  }
+  memcpy(c->text + len, "] ", 2);
+  c->len = len + 2;
+}
+
+
+/*
+ * Name the calling thread, for its log lines and, truncated to 15
+ * characters, for the kernel (see pthread_setname_np()). NULL or an
+ * empty name removes it from the log lines.
+ */
+void
+logging::set_thread_name(const char * name)
+{
+  thread_context_t * c = &tls_context;
+  snprintf(c->name, sizeof c->name, "%s", name ? name : "");
+  if (c->name[0] != '\0') {
+    pthread_setname_np(pthread_self(), c->name);
+  }
+  format_context();
+}
+
+
+// Name of the calling thread given to set_thread_name(), or "".
+const char *
+logging::get_thread_name(void)
+{
+  return tls_context.name;
+}
+
+
+/*
+ * Set a context field of the calling thread, such as a request id, to
+ * be shown in all its log lines; a NULL value removes it. Keys and
+ * values are truncated to fit. Returns false if there are already
+ * CONTEXT_FIELDS fields.
+ */
+bool
+logging::set_context(const char * key,
+                     const char * value)
+{
+  thread_context_t * c = &tls_context;
+  size_t i = 0;
+  while (i < c->fields && strncmp(c->keys[i], key, CONTEXT_KEY_SIZE - 1) != 0) {
+    ++i;
+  }
+
+  if (value == NULL) {
+    if (i < c->fields) {
+      --c->fields;
+      for (; i < c->fields; ++i) {
+        memcpy(c->keys[i], c->keys[i + 1], CONTEXT_KEY_SIZE);
+        memcpy(c->values[i], c->values[i + 1], CONTEXT_VALUE_SIZE);
+      }
+      format_context();
+    }
+    return true;
+  }
+
+  if (i == c->fields) {
+    if (c->fields == CONTEXT_FIELDS) {
+      return false;
+    }
+    snprintf(c->keys[i], CONTEXT_KEY_SIZE, "%s", key);
+    ++c->fields;
+  }
+  snprintf(c->values[i], CONTEXT_VALUE_SIZE, "%s", value);
+  format_context();
+  return true;
+}
+
+
+// Value of a context field of the calling thread, or NULL if unset.
+const char *
+logging::get_context(const char * key)
+{
+  thread_context_t * c = &tls_context;
+  for (size_t i = 0; i < c->fields; ++i) {
+    if (strncmp(c->keys[i], key, CONTEXT_KEY_SIZE - 1) == 0) {
+      return c->values[i];
+    }
+  }
+  return NULL;
+}
+
+
+// Remove all the context fields of the calling thread; its name stays.
+void
+logging::clear_context(void)
+{
+  tls_context.fields = 0;
+  format_context();
+}
+
+
+// ScopedContext constructor.
+logging::ScopedContext::ScopedContext(const char * key,
+                                      const char * value)
+{
+  snprintf(this->key, sizeof this->key, "%s", key);
+  const char * old = get_context(key);
+  this->had_value = (old != NULL);
+  snprintf(this->old_value, sizeof this->old_value, "%s", old ? old : "");
+  set_context(key, value);
+}
+
+
+// ScopedContext destructor.
+logging::ScopedContext::~ScopedContext()
+{
+  set_context(this->key, this->had_value ? this->old_value : NULL);
+}
+
+
+/*
+ * Get the scope timer of that name, registering it on first use; NULL
+ * if there are already TIMERS_MAX timers. Timers are never freed.
+ */
+logging::log_timer_t *
+logging::get_timer(const char * name)
+{
+  logging::log_timer_t * timer = NULL;
+  pthread_mutex_lock(&timers_mutex);
+  for (unsigned int i = 0; i < timer_count; ++i) {
+    if (strcmp(timers[i].name, name) == 0) {
+      timer = &timers[i];
+      break;
+    }
+  }
+  if (timer == NULL && timer_count < TIMERS_MAX) {
+    timer = &timers[timer_count];
+    timer->name = strdup(name);
+    timer->id = timer_count++;
+  }
+  pthread_mutex_unlock(&timers_mutex);
+  return timer;
+}
+
+
+/*
+ * Get the timer histograms of the calling thread, creating them on first
+ * use, or taking over those of a thread that has exited.
+ */
+static timer_thread_t *
+get_timer_thread(void)
+{
+  pthread_once(&timer_key_once, create_timer_key);
+
+  timer_thread_t * t;
+  pthread_mutex_lock(&timers_mutex);
+  for (t = timer_threads; t; t = t->next) {
+    if (__atomic_load_n(&(t->orphaned), __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&(t->orphaned), false, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  if (t == NULL) {
+    t = new timer_thread_t();
+    t->next = timer_threads;
+    timer_threads = t;
+  }
+  pthread_mutex_unlock(&timers_mutex);
+
+  pthread_setspecific(timer_key, t);
+  tls_timer_thread = t;
+  return t;
+}
+
+
+/*
+ * Record a duration into the calling thread's histogram of the timer.
+ * The thread is its only writer, so the bucket is a plain load and
+ * store; only a new maximum races with the runner taking it.
+ */
+void
+logging::record_time(logging::log_timer_t * timer,
+                     uint64_t ns)
+{
+  timer_thread_t * t = tls_timer_thread;
+  if (t == NULL) {
+    t = get_timer_thread();
+  }
+  logging::timer_hist_t * hist = t->hists[timer->id];
+  if (hist == NULL) {
+    hist = new logging::timer_hist_t();
+    __atomic_store_n(&(t->hists[timer->id]), hist, __ATOMIC_RELEASE);
+  }
+
+  stats_add(&(hist->buckets[logging::timer_bucket(ns)]), 1);
+  uint64_t max_ns = __atomic_load_n(&(hist->max_ns), __ATOMIC_RELAXED);
+  while (ns > max_ns &&
+         !__atomic_compare_exchange_n(&(hist->max_ns), &max_ns, ns, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+
+// Log the scope timers to the log of init_logging(), see Log::log_timers().
+void
+logging::log_timers(void)
+{
+  logging::Log * log = logging::log;
+  if (log) {
+    log->log_timers();
+  }
+}
+
+
+// Histogram bucket of a duration, see timer_hist_t.
+size_t
+logging::timer_bucket(uint64_t ns)
+{
+  if (ns < (1U << TIMER_SUB_BITS)) {
+    return ns;
+  }
+  unsigned int exp = 63 - __builtin_clzll(ns);
+  return ((size_t) (exp - TIMER_SUB_BITS + 1) << TIMER_SUB_BITS) +
+         ((ns >> (exp - TIMER_SUB_BITS)) & ((1U << TIMER_SUB_BITS) - 1));
+}
+
+
+// Largest duration that falls in a histogram bucket.
+uint64_t
+logging::timer_bucket_max(size_t bucket)
+{
+  if (bucket < (1U << TIMER_SUB_BITS)) {
+    return bucket;
+  }
+  unsigned int exp = (bucket >> TIMER_SUB_BITS) + TIMER_SUB_BITS - 1;
+  uint64_t sub = bucket & ((1U << TIMER_SUB_BITS) - 1);
+  uint64_t lower = ((1ULL << TIMER_SUB_BITS) + sub) << (exp - TIMER_SUB_BITS);
+  return lower + ((1ULL << (exp - TIMER_SUB_BITS)) - 1);
+}
+
+
+// Get the current stack trace.
+char **
+logging::get_stack_trace(size_t *size)
+{
+  void *arr[STACK_TRACE_DEPTH];
+  *size = backtrace(arr, STACK_TRACE_DEPTH);
+  char **str  = backtrace_symbols(arr, *size);
+  return str;
+}
+
+
+// Name of a crash signal; strsignal() is not async-signal-safe.
+static const char *
+crash_signal_name(int sig_no)
+{
+  switch (sig_no) {
+    case SIGSEGV: return "SIGSEGV";
+    case SIGBUS:  return "SIGBUS";
+    case SIGFPE:  return "SIGFPE";
+    case SIGILL:  return "SIGILL";
+    case SIGABRT: return "SIGABRT";
+    default:      return "signal";
+  }
+}
+
+
+// Append str to the crash report.
+static char *
+crash_put_str(char * p,
+              const char * str)
+{
+  size_t len = strlen(str);
+  memcpy(p, str, len);
+  return p + len;
+}
+
+
+// Append v in hexadecimal to the crash report.
+static char *
+crash_put_hex(char * p,
+              uintptr_t v)
+{
+  char digits[2 * sizeof v];
+  int n = 0;
+  do {
+    digits[n++] = "0123456789abcdef"[v & 0xf];
+    v >>= 4;
+  } while (v);
+  p = crash_put_str(p, "0x");
+  while (n > 0) {
+    *p++ = digits[--n];
+  }
+  return p;
+}
+
+
+/*
+ * Find the GNU build id among ELF notes; returns its length, with *id
+ * pointing to it, or 0 if there is none. Async-signal-safe.
+ */
+static size_t
+find_build_id(const char * notes,
+              size_t size,
+              const uint8_t ** id)
+{
+  size_t pos = 0;
+  while (pos + sizeof(ElfW(Nhdr)) <= size) {
+    ElfW(Nhdr) note;
+    memcpy(&note, notes + pos, sizeof note);
+    size_t name = pos + sizeof note;
+    size_t desc = name + ((note.n_namesz + 3) & ~3U);
+    size_t next = desc + ((note.n_descsz + 3) & ~3U);
+    if (next > size) {
+      break;
+    }
+    if (note.n_type == NT_GNU_BUILD_ID && note.n_namesz == 4 &&
+        memcmp(notes + name, "GNU", 4) == 0 && note.n_descsz > 0) {
+      *id = (const uint8_t *) (notes + desc);
+      return note.n_descsz;
+    }
+    pos = next;
+  }
+  return 0;
+}
+
+
+// A loaded module with frames of a stack trace in it.
+typedef struct {
+  uintptr_t base;           // Load bias: addresses in the file are relative to it.
+  const char * name;
+  uint8_t build_id[BUILD_ID_MAX];
+  size_t build_id_len;
+} trace_module_t;
+
+// Frames of a stack trace, and the modules found so far.
+typedef struct {
+  void * const * frames;
+  size_t count;
+  int16_t module_of[STACK_TRACE_LIMIT];   // -1 until found.
+  trace_module_t modules[STACK_TRACE_MODULES];
+  size_t nmodules;
+} trace_modules_t;
+
+
+// dl_iterate_phdr() callback: note the module of the frames inside it.
+static int
+find_trace_modules(struct dl_phdr_info * info,
+                   size_t size,
+                   void * data)
+{
+  trace_modules_t * trace = (trace_modules_t *) data;
+  int index = -1;
+  for (int i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr) * phdr = &(info->dlpi_phdr[i]);
+    if (phdr->p_type != PT_LOAD) {
+      continue;
+    }
+    uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+    uintptr_t end = start + phdr->p_memsz;
+    for (size_t f = 0; f < trace->count; ++f) {
+      uintptr_t pc = (uintptr_t) trace->frames[f];
+      if (trace->module_of[f] >= 0 || pc < start || pc >= end) {
+        continue;
+      }
+      if (index < 0) {
+        if (trace->nmodules == STACK_TRACE_MODULES) {
+          return 1;
+        }
+        index = trace->nmodules++;
+        trace->modules[index].base = info->dlpi_addr;
+        trace->modules[index].name = info->dlpi_name;
+        trace->modules[index].build_id_len = 0;
+      }
+      trace->module_of[f] = index;
+    }
+  }
+
+  if (index >= 0) {
+    trace_module_t * module = &(trace->modules[index]);
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+      const ElfW(Phdr) * phdr = &(info->dlpi_phdr[i]);
+      const uint8_t * id;
+      size_t len;
+      if (phdr->p_type == PT_NOTE &&
+          (len = find_build_id((const char *) (info->dlpi_addr + phdr->p_vaddr),
+                               phdr->p_memsz, &id)) > 0) {
+        module->build_id_len = (len < BUILD_ID_MAX) ? len : BUILD_ID_MAX;
+        memcpy(module->build_id, id, module->build_id_len);
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+
+/*
+ * Write a stack trace compactly into buf, for log_symbolize to resolve
+ * offline: a "@\t<module>+0x<offset>" line per frame, or "@\t?+0x<pc>"
+ * outside any module, then a "@@\t<module> <build id> <path>" line per
+ * module ('-' without a build id). Nothing is symbolized, allocated or
+ * locked but the loader's list of modules, so it is fit for the crash
+ * handler. Frames that do not fit in size are left out. Returns the
+ * length written.
+ */
+size_t
+logging::format_stack_trace(char * buf,
+                            size_t size,
+                            void * const * frames,
+                            size_t count)
+{
+  trace_modules_t trace;
+  trace.frames = frames;
+  trace.count = (count < STACK_TRACE_LIMIT) ? count : STACK_TRACE_LIMIT;
+  trace.nmodules = 0;
+  for (size_t f = 0; f < trace.count; ++f) {
+    trace.module_of[f] = -1;
+  }
+  dl_iterate_phdr(find_trace_modules, &trace);
+
+  char * p = buf;
+  char * end = buf + size;
+  for (size_t f = 0; f < trace.count && end - p > 48; ++f) {
+    int index = trace.module_of[f];
+    uintptr_t pc = (uintptr_t) frames[f];
+    p = crash_put_str(p, "@\t");
+    if (index >= 0) {
+      p = put_uint(p, index, 0);
+      *p++ = '+';
+      p = crash_put_hex(p, pc - trace.modules[index].base);
+    } else {
+      p = crash_put_str(p, "?+");
+      p = crash_put_hex(p, pc);
+    }
+    *p++ = '\n';
+  }
+
+  // The main program has no name in the list.
+  char exe[PATH_MAX];
+  ssize_t exe_len = readlink("/proc/self/exe", exe, sizeof exe - 1);
+  exe[(exe_len > 0) ? exe_len : 0] = '\0';
+
+  for (size_t m = 0; m < trace.nmodules; ++m) {
+    trace_module_t * module = &(trace.modules[m]);
+    const char * name = (module->name && module->name[0]) ? module->name : exe;
+    if ((size_t) (end - p) < 16 + 2 * module->build_id_len + strlen(name)) {
+      break;
+    }
+    p = crash_put_str(p, "@@\t");
+    p = put_uint(p, m, 0);
+    *p++ = ' ';
+    for (size_t i = 0; i < module->build_id_len; ++i) {
+      *p++ = "0123456789abcdef"[module->build_id[i] >> 4];
+      *p++ = "0123456789abcdef"[module->build_id[i] & 0xf];
+    }
+    if (module->build_id_len == 0) {
+      *p++ = '-';
+    }
+    *p++ = ' ';
+    p = crash_put_str(p, name);
+    *p++ = '\n';
+  }
+  return p - buf;
+}
+
+
+// Build id of an ELF file, in hexadecimal; "" if it has none.
+static std::string
+read_build_id(const std::string& path)
+{
+  std::string hex;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return hex;
+  }
+  struct stat st;
+  void * map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(ElfW(Ehdr))) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    return hex;
+  }
+
+  const char * file = (const char *) map;
+  size_t file_size = st.st_size;
+  const ElfW(Ehdr) * ehdr = (const ElfW(Ehdr) *) file;
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) == 0 &&
+      ehdr->e_ident[EI_CLASS] == (sizeof(void *) == 8 ? ELFCLASS64 : ELFCLASS32) &&
+      ehdr->e_phoff + (size_t) ehdr->e_phnum * sizeof(ElfW(Phdr)) <= file_size) {
+    const ElfW(Phdr) * phdrs = (const ElfW(Phdr) *) (file + ehdr->e_phoff);
+    for (int i = 0; i < ehdr->e_phnum && hex.empty(); ++i) {
+      const uint8_t * id;
+      size_t len;
+      if (phdrs[i].p_type == PT_NOTE &&
+          phdrs[i].p_offset + phdrs[i].p_filesz <= file_size &&
+          (len = find_build_id(file + phdrs[i].p_offset, phdrs[i].p_filesz,
+                               &id)) > 0) {
+        for (size_t b = 0; b < len; ++b) {
+          hex += "0123456789abcdef"[id[b] >> 4];
+          hex += "0123456789abcdef"[id[b] & 0xf];
+        }
+      }
+    }
+  }
+  munmap(map, file_size);
+  return hex;
+}
+
+
+/*
+ * The file to symbolize a module of a stack trace with: its separate
+ * debug info under debug_dir/.build-id, or the file it was loaded from,
+ * unless that has been replaced by another build since.
+ */
+static bool
+find_module_file(const std::string& build_id,
+                 const std::string& path,
+                 const std::string& debug_dir,
+                 std::string * file)
+{
+  if (build_id != "-" && build_id.size() > 2 && !debug_dir.empty()) {
+    *file = debug_dir + "/.build-id/" + build_id.substr(0, 2) + "/" +
+            build_id.substr(2) + ".debug";
+    if (access(file->c_str(), R_OK) == 0) {
+      return true;
+    }
+  }
+  *file = path;
+  return access(path.c_str(), R_OK) == 0 &&
+         (build_id == "-" || read_build_id(path) == build_id);
+}
+
+
+/*
+ * Run llvm-symbolizer, or addr2line, which gets the names of inlined
+ * functions wrong, on offsets of file, and give the (function, location)
+ * pairs of each, innermost first when functions were inlined.
+ */
+static bool
+run_symbolizer(bool llvm,
+               const std::string& file,
+               const std::vector<uint64_t>& offsets,
+               std::vector<std::vector<std::pair<std::string, std::string> > > * frames)
+{
+  std::vector<std::string> args;
+  args.push_back(llvm ? "llvm-symbolizer" : "addr2line");
+  args.push_back("-C");
+  args.push_back("-f");
+  args.push_back("-i");
+  args.push_back("-a");
+  args.push_back(llvm ? "--obj=" + file : "-e");
+  if (!llvm) {
+    args.push_back(file);
+  }
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    char hex[24];
+    // A return address; the call is the instruction before it.
+    snprintf(hex, sizeof hex, "0x%" PRIx64, offsets[i] - (offsets[i] > 0));
+    args.push_back(hex);
+  }
+  std::vector<char *> argv;
+  for (size_t i = 0; i < args.size(); ++i) {
+    argv.push_back(&args[i][0]);
+  }
+  argv.push_back(NULL);
+
+  int pipe_fds[2];
+  if (pipe(pipe_fds) != 0) {
+    return false;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(pipe_fds[1], STDOUT_FILENO);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDERR_FILENO);
+    execvp(argv[0], &argv[0]);
+    _exit(127);
+  }
+  close(pipe_fds[1]);
+  std::string output;
+  char buf[4096];
+  ssize_t n;
+  while (pid > 0 && ((n = read(pipe_fds[0], buf, sizeof buf)) > 0 ||
+                     (n < 0 && errno == EINTR))) {
+    output.append(buf, n > 0 ? n : 0);
+  }
+  close(pipe_fds[0]);
+  int status = 0;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+      !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    return false;
+  }
+
+  /*
+   * Each address is echoed first, then a function and a location per
+   * frame; llvm-symbolizer adds a blank line.
+   */
+  frames->clear();
+  std::vector<std::string> lines;
+  size_t pos = 0;
+  while (pos < output.size()) {
+    size_t eol = output.find('\n', pos);
+    if (eol == std::string::npos) {
+      eol = output.size();
+    }
+    if (eol > pos) {
+      lines.push_back(output.substr(pos, eol - pos));
+    }
+    pos = eol + 1;
+  }
+  for (size_t i = 0; i < lines.size(); ++i) {
+    if (lines[i].compare(0, 2, "0x") == 0) {
+      frames->resize(frames->size() + 1);
+    } else if (!frames->empty() && i + 1 < lines.size()) {
+      frames->back().push_back(std::make_pair(lines[i], lines[i + 1]));
+      ++i;
+    }
+  }
+  return frames->size() == offsets.size();
+}
+
+
+/*
+ * Symbolize the lines of a stack trace written by format_stack_trace()
+ * into out. Lines that cannot be resolved are kept as they are.
+ * Returns the number of frames resolved.
+ */
+static size_t
+symbolize_trace(const std::vector<std::string>& block,
+                const std::string& debug_dir,
+                std::string * out)
+{
+  // The modules, then the frames in each of them.
+  std::vector<std::string> build_ids, paths;
+  for (size_t i = 0; i < block.size(); ++i) {
+    if (block[i].compare(0, 3, "@@\t") != 0) {
+      continue;
+    }
+    std::string line = block[i].substr(3, block[i].find('\n') - 3);
+    char * end;
+    unsigned long index = strtoul(line.c_str(), &end, 10);
+    size_t id = end - line.c_str() + 1;
+    size_t path = line.find(' ', id);
+    if (*end != ' ' || path == std::string::npos ||
+        index >= STACK_TRACE_MODULES) {
+      continue;
+    }
+    if (index >= paths.size()) {
+      build_ids.resize(index + 1);
+      paths.resize(index + 1);
+    }
+    build_ids[index] = line.substr(id, path - id);
+    paths[index] = line.substr(path + 1);
+  }
+
+  std::vector<int> module_of(block.size(), -1);
+  std::vector<size_t> slot_of(block.size(), 0);
+  std::vector<std::vector<uint64_t> > offsets(paths.size());
+  for (size_t i = 0; i < block.size(); ++i) {
+    const char * line = block[i].c_str();
+    char * end;
+    unsigned long index = strtoul(line + 2, &end, 10);
+    if (block[i].compare(0, 2, "@\t") != 0 || end == line + 2 ||
+        strncmp(end, "+0x", 3) != 0 || index >= paths.size()) {
+      continue;
+    }
+    module_of[i] = index;
+    slot_of[i] = offsets[index].size();
+    offsets[index].push_back(strtoull(end + 3, NULL, 16));
+  }
+
+  std::vector<std::vector<std::vector<std::pair<std::string, std::string> > > >
+      symbols(paths.size());
+  for (size_t m = 0; m < paths.size(); ++m) {
+    std::string file;
+    if (!offsets[m].empty() &&
+        find_module_file(build_ids[m], paths[m], debug_dir, &file)) {
+      if (!run_symbolizer(true, file, offsets[m], &symbols[m])) {
+        run_symbolizer(false, file, offsets[m], &symbols[m]);
+      }
+    }
+  }
+
+  size_t resolved = 0;
+  for (size_t i = 0; i < block.size(); ++i) {
+    int m = module_of[i];
+    if (m < 0 || symbols[m].empty() || symbols[m][slot_of[i]].empty() ||
+        symbols[m][slot_of[i]][0].first == "??") {
+      out->append(block[i]);
+      continue;
+    }
+    const std::vector<std::pair<std::string, std::string> >& frame =
+        symbols[m][slot_of[i]];
+    const std::string& path = paths[m];
+    char offset[24];
+    snprintf(offset, sizeof offset, "+0x%" PRIx64, offsets[m][slot_of[i]]);
+    for (size_t f = 0; f < frame.size(); ++f) {
+      out->append(f == 0 ? "@\t" : "@\t    (inlined by) ");
+      out->append(frame[f].first + " at " + frame[f].second);
+      if (f == 0) {
+        out->append(" [" + path.substr(path.rfind('/') + 1) + offset + "]");
+      }
+      out->append("\n");
+    }
+    ++resolved;
+  }
+  return resolved;
+}
+
+
+/*
+ * Copy a log from in_fd to out_fd, with the function, file and line of
+ * the frames of its stack traces, inlined calls included, resolved by
+ * llvm-symbolizer or addr2line from the modules the traces list. Separate debug info is
+ * looked for under debug_dir. Returns the number of frames resolved,
+ * or -1 if in_fd cannot be read.
+ */
+ssize_t
+logging::symbolize_log(int in_fd,
+                       int out_fd,
+                       const std::string& debug_dir)
+{
+  int fd = dup(in_fd);
+  FILE * in = (fd >= 0) ? fdopen(fd, "r") : NULL;
+  if (in == NULL) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  ssize_t resolved = 0;
+  std::vector<std::string> block;
+  std::string out;
+  char * line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, in)) >= 0) {
+    if ((len > 2 && line[0] == '@' && line[1] == '\t') ||
+        (len > 3 && line[0] == '@' && line[1] == '@' && line[2] == '\t')) {
+      block.push_back(std::string(line, len));
+      continue;
+    }
+    if (!block.empty()) {
+      resolved += symbolize_trace(block, debug_dir, &out);
+      block.clear();
+    }
+    out.append(line, len);
+    if (out.size() >= ASYNC_OUT_BUF_SIZE) {
+      write_all(out_fd, out.data(), out.size());
+      out.clear();
+    }
+  }
+  if (!block.empty()) {
+    resolved += symbolize_trace(block, debug_dir, &out);
+  }
+  write_all(out_fd, out.data(), out.size());
+  free(line);
+  fclose(in);
+  return resolved;
+}
+
+
+// Write len bytes of buf to each of the crash descriptors.
+static void
+crash_write(const int * fds,
+            size_t nfds,
+            const char * buf,
+            size_t len)
+{
+  for (size_t i = 0; i < nfds; ++i) {
+    write_all(fds[i], buf, len);
+  }
+}
+
+
+/*
+ * Write out what the log holds, for the crash handler: the log buffer,
+ * the batches held back by the sinks, (in ASYNC_LOGGING mode) the thread
+ * rings and the debug history, with write(2) straight to the sink
+ * descriptors. They are put in fds; returns how many there are.
+ */
+size_t
+logging::Log::crash_dump(int * fds)
+{
+  size_t nfds = 0;
+  for (size_t s = 0; s < this->sinks.size() && nfds < CRASH_MAX_FDS; ++s) {
+    int fd = this->sinks[s]->crash_fd();
+    if (fd >= 0) {
+      fds[nfds++] = fd;
+    }
+  }
+
+  // Messages still in the log buffer, and in those waiting for the runner.
+  for (logging::log_buffer_t * lb = this->pending; lb; lb = lb->next) {
+    crash_write(fds, nfds, lb->buf,
+                (lb->size < 2 * LOG_BUF_SIZE) ? lb->size : 2 * LOG_BUF_SIZE);
+  }
+  size_t len = this->log_buf_size;
+  crash_write(fds, nfds, this->log_buf,
+              (len < 2 * LOG_BUF_SIZE) ? len : 2 * LOG_BUF_SIZE);
+
+  /*
+   * Messages still in the thread rings. The runner stops draining once
+   * it sees crash_in_progress; give it a moment to get out of the way.
+   */
+  if (this->mode == logging::ASYNC_LOGGING) {
+    struct timespec ts = { 0, 1000000 };
+    for (int i = 0; i < 100 &&
+                    __atomic_load_n(&(this->draining), __ATOMIC_ACQUIRE); ++i) {
+      nanosleep(&ts, NULL);
+    }
+    if (!__atomic_load_n(&(this->draining), __ATOMIC_ACQUIRE)) {
+      for (logging::ThreadBuffer * tb = this->threads; tb; tb = tb->next) {
+        logging::ring_record_t * rec;
+        while ((rec = tb->ring.peek()) != NULL) {
+          // format_prefix() uses the timestamp cache of this thread.
+          len = this->format_prefix(crash_buf, sizeof crash_buf,
+                                    (logging::log_level_t) rec->level,
+                                    rec->file_name, rec->line, rec->uid,
+                                    rec->timestamp);
+          if (rec->flags & RECORD_DEFERRED) {
+            len += render_deferred(crash_buf + len, rec);
+          } else if (len + rec->len < sizeof crash_buf) {
+            memcpy(crash_buf + len, rec + 1, rec->len);
+            len += rec->len;
+          }
+          crash_buf[len++] = '\n';
+          crash_write(fds, nfds, crash_buf, len);
+          tb->ring.release(rec);
+        }
+      }
+    }
+  }
+
+  // The debug history not written yet, thread by thread.
+  for (logging::History * history =
+           __atomic_load_n(&(this->histories), __ATOMIC_ACQUIRE);
+       history; history = history->next) {
+    uint64_t head = __atomic_load_n(&(history->head), __ATOMIC_ACQUIRE);
+    uint64_t start = (head > history->size) ? head - history->size : 0;
+    if (start < history->dumped) {
+      start = history->dumped;
+    }
+    for (uint64_t i = start; i < head; ++i) {
+      len = this->format_history(crash_buf,
+                                 &(history->entries[i % history->size]));
+      crash_write(fds, nfds, crash_buf, len);
+    }
+  }
+  return nfds;
+}
+
+
+/*
+ * Crash handler, for SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT.
+ * It never takes a lock or allocates: what every log holds is written
+ * out with crash_dump(), followed by the crash report and the stack
+ * trace, in the root log, or if there is none, in that of a named logger.
+ */
+void
+logging::detect_sigsegv(int sig_no,
+                        siginfo_t * info,
+                        void * context)
+{
+  logging::Log * log = logging::log;
+  for (logging::logger_t * logger = __atomic_load_n(&loggers, __ATOMIC_ACQUIRE);
+       logger && log == NULL; logger = logger->next) {
+    log = __atomic_load_n(&(logger->own_log), __ATOMIC_ACQUIRE);
+  }
+  if (log == NULL) {
+    // The default action was restored by SA_RESETHAND.
+    raise(sig_no);
+    return;
+  }
+  if (__atomic_exchange_n(&crash_in_progress, 1, __ATOMIC_ACQ_REL)) {
+    // Another thread is reporting a crash, and will exit.
+    while (1) {
+      pause();
+    }
+  }
+
+  // The named loggers with a log of their own write to it.
+  int fds[CRASH_MAX_FDS];
+  for (logging::logger_t * logger = __atomic_load_n(&loggers, __ATOMIC_ACQUIRE);
+       logger; logger = logger->next) {
+    logging::Log * own = __atomic_load_n(&(logger->own_log), __ATOMIC_ACQUIRE);
+    if (own && own != log) {
+      own->crash_dump(fds);
+    }
+  }
+  size_t nfds = log->crash_dump(fds);
+  size_t len;
+
+  // The crash report.
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  char * p = crash_buf;
+  p = crash_put_str(p, "\n*** Aborted at ");
+  p = put_uint(p, now.tv_sec, 0);
+  p = crash_put_str(p, " (unix time) ***\n*** ");
+  p = crash_put_str(p, crash_signal_name(sig_no));
+  if (info && sig_no != SIGABRT) {
+    p = crash_put_str(p, " (@");
+    p = crash_put_hex(p, (uintptr_t) info->si_addr);
+    p = crash_put_str(p, ", code ");
+    int code = info->si_code;
+    if (code < 0) {
+      *p++ = '-';
+      code = -code;
+    }
+    p = put_uint(p, code, 0);
+    p = crash_put_str(p, ")");
+  }
+  p = crash_put_str(p, " received by PID ");
+  p = put_uint(p, getpid(), 0);
+  p = crash_put_str(p, " (thread ");
+  p = put_uint(p, log->get_thread_id(), 0);
+  p = crash_put_str(p, "); stack trace: ***\n");
+  crash_write(fds, nfds, crash_buf, p - crash_buf);
+
+  int size = backtrace(crash_frames, log->stack_trace_depth);
+  len = format_stack_trace(crash_buf, sizeof crash_buf, crash_frames, size);
+  crash_write(fds, nfds, crash_buf, len);
+
+  _exit(EXIT_STATUS_SIGSEGV);
 }
 
 
@@ -39,17 +39,62 @@
 #define LOG_H__
 
 #include <string>
+#include <vector>
+#include <type_traits>
 
 #include <stdio.h>
 #include <stdarg.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 
 #define LOG_BUF_SIZE 4096
 #define TIME_BUF_SIZE 20
-#define STACK_TRACE_LIMIT 10
+#define TIME_STR_SIZE 40
+#define STACK_TRACE_LIMIT 256
+#define STACK_TRACE_DEPTH 64
+#define STACK_TRACE_MODULES 32
+#define BUILD_ID_MAX 32
+#define FLUSH_INTERVAL_SEC 300
+#define ASYNC_RING_SIZE 65536
+#define ASYNC_OUT_BUF_SIZE 65536
+#define ASYNC_POLL_USEC 1000
+#define LOG_BUF_RECS 256
+#define REOPEN_CHECK_MSEC 1000
+#define CRASH_STACK_SIZE 65536
+#define CRASH_MAX_FDS 16
+#define ASYNC_OUT_RECS (ASYNC_OUT_BUF_SIZE / 32)
+#define STATS_SHARDS 64
+#define STATS_HIST_BUCKETS 32
+#define OVERFLOW_WAIT_USEC 1000
+#define OVERFLOW_MAX_BYTES (1024 * 1024)
+#define RECORDER_SIZE (1024 * 1024)
+#define RECORDER_MAGIC 0x52474f4cU    // "LOGR"
+#define RECORDER_VERSION 1
+#define HISTORY_ENTRY_SIZE 256
+#define INDEX_MAGIC 0x5844494cU       // "LIDX"
+#define INDEX_VERSION 1
+#define INDEX_BYTES (64 * 1024)
+#define BLOCK_MAGIC 0x4b4c424cU       // "LBLK"
+#define BLOCK_VERSION 1
+#define BLOCK_SIZE (64 * 1024)
+#define BLOCK_SIZE_MAX (16 * 1024 * 1024)
+#define BLOCK_BUFFERS 4
+#define BLOCK_MSEC 1000
+#define LZ_HASH_BITS 12
+#define HISTORY_ENTRIES 64
+#define DEDUP_SLOTS 64
+#define THREAD_NAME_SIZE 16
+#define CONTEXT_FIELDS 8
+#define CONTEXT_KEY_SIZE 32
+#define CONTEXT_VALUE_SIZE 64
+#define CONTEXT_SIZE 256
+#define TIMERS_MAX 64
+#define TIMER_SUB_BITS 3
+#define TIMER_BUCKETS ((64 - TIMER_SUB_BITS + 1) << TIMER_SUB_BITS)
 
 #define EXIT_STATUS_SIGSEGV 123
 #define EXIT_STATUS_FATAL 124
@@ -57,76 +102,265 @@
 #define LOG_FUNC_SIGNATURE logging::log_level_t level, \
                            const char * file_name, \
                            uint16_t line, \
-                           uint16_t uid
+                           uint32_t uid
 
-#define Fatal(fmt, ...) \
+/*
+ * Messages less severe than LOG_COMPILED_MIN_LEVEL are compiled out,
+ * e.g. -DLOG_COMPILED_MIN_LEVEL=logging::INFO removes all Debug() calls.
+ */
+#ifndef LOG_COMPILED_MIN_LEVEL
+#define LOG_COMPILED_MIN_LEVEL logging::DEBUG
+#endif
+
+/*
+ * Every macro expansion has a static descriptor, registered on its
+ * first call, whose state says whether the call site is enabled. It
+ * follows the log level unless a site rule (see enable_sites()) says
+ * otherwise, and is checked with a single load.
+ */
+#define LOG_SITE(level, fmt) \
+  static logging::log_site_t log_site_ = \
+    { __FILE__, __builtin_constant_p(fmt) ? (fmt) : NULL, __LINE__, \
+      (uint8_t) (level), logging::SITE_UNREGISTERED, NULL }
+
+#define LOG_SITE_ENABLED(level) \
+  ((level) <= LOG_COMPILED_MIN_LEVEL && logging::site_enabled(&log_site_))
+
+/*
+ * A site below the log level whose messages still go to the debug
+ * history of the thread (see log_options_t::history_entries).
+ */
+#define LOG_SITE_HISTORY(level) \
+  ((level) <= LOG_COMPILED_MIN_LEVEL && \
+   __atomic_load_n(&log_site_.state, __ATOMIC_RELAXED) == logging::SITE_HISTORY)
+
+#define LOG_HISTORY_CALL(level, fmt, ...) \
   do { \
     if (logging::is_logging_initialized) { \
-      logging::log->log_msg(logging::FATAL, __FILE__, __LINE__, \
-                            logging::log->get_thread_id(), \
-                            fmt, ## __VA_ARGS__); \
-    } else { \
-      fprintf(stderr, "Should call init_logging() first!\n"); \
+      logging::log->log_history(level, __FILE__, __LINE__, \
+                                logging::log->get_thread_id(), \
+                                __builtin_constant_p(fmt), fmt, ## __VA_ARGS__); \
+    } \
+  } while (0)
+
+/*
+ * The level was checked by the call site, so the log does not check it
+ * again. A format that is a string literal outlives the call, so the
+ * runner may format it later (see log_options_t::deferred_format).
+ */
+#define LOG_MSG_CALL_TO(log, level, fmt, ...) \
+  (log)->log_site_msg(level, __FILE__, __LINE__, (log)->get_thread_id(), \
+                      __builtin_constant_p(fmt), fmt, ## __VA_ARGS__)
+
+#define LOG_MSG_CALL(level, fmt, ...) \
+  LOG_MSG_CALL_TO(logging::log, level, fmt, ## __VA_ARGS__)
+
+#define Fatal(fmt, ...) \
+  do { \
+    LOG_SITE(logging::FATAL, fmt); \
+    if (LOG_SITE_ENABLED(logging::FATAL)) { \
+      if (logging::is_logging_initialized) { \
+        LOG_MSG_CALL(logging::FATAL, fmt, ## __VA_ARGS__); \
+      } else { \
+        fprintf(stderr, "Should call init_logging() first!\n"); \
+      } \
+    } else if (LOG_SITE_HISTORY(logging::FATAL)) { \
+      LOG_HISTORY_CALL(logging::FATAL, fmt, ## __VA_ARGS__); \
     } \
   } while (0)
 
 #define Error(fmt, ...) \
   do { \
-    if (logging::is_logging_initialized) { \
-      logging::log->log_msg(logging::ERROR, __FILE__, __LINE__, \
-                            logging::log->get_thread_id(), \
-                            fmt, ## __VA_ARGS__); \
-    } else { \
-      fprintf(stderr, "Should call init_logging() first!\n"); \
+    LOG_SITE(logging::ERROR, fmt); \
+    if (LOG_SITE_ENABLED(logging::ERROR)) { \
+      if (logging::is_logging_initialized) { \
+        LOG_MSG_CALL(logging::ERROR, fmt, ## __VA_ARGS__); \
+      } else { \
+        fprintf(stderr, "Should call init_logging() first!\n"); \
+      } \
+    } else if (LOG_SITE_HISTORY(logging::ERROR)) { \
+      LOG_HISTORY_CALL(logging::ERROR, fmt, ## __VA_ARGS__); \
     } \
   } while (0)
 
 #define Warning(fmt, ...) \
   do { \
-    if (logging::is_logging_initialized) { \
-      logging::log->log_msg(logging::WARNING, __FILE__, __LINE__, \
-                            logging::log->get_thread_id(), \
-                            fmt, ## __VA_ARGS__); \
-    } else { \
-      fprintf(stderr, "Should call init_logging() first!\n"); \
+    LOG_SITE(logging::WARNING, fmt); \
+    if (LOG_SITE_ENABLED(logging::WARNING)) { \
+      if (logging::is_logging_initialized) { \
+        LOG_MSG_CALL(logging::WARNING, fmt, ## __VA_ARGS__); \
+      } else { \
+        fprintf(stderr, "Should call init_logging() first!\n"); \
+      } \
+    } else if (LOG_SITE_HISTORY(logging::WARNING)) { \
+      LOG_HISTORY_CALL(logging::WARNING, fmt, ## __VA_ARGS__); \
     } \
   } while (0)
 
 #define Info(fmt, ...) \
   do { \
-    if (logging::is_logging_initialized) { \
-      logging::log->log_msg(logging::INFO, __FILE__, __LINE__, \
-                            logging::log->get_thread_id(), \
-                            fmt, ## __VA_ARGS__); \
-    } else { \
-      fprintf(stderr, "Should call init_logging() first!\n"); \
+    LOG_SITE(logging::INFO, fmt); \
+    if (LOG_SITE_ENABLED(logging::INFO)) { \
+      if (logging::is_logging_initialized) { \
+        LOG_MSG_CALL(logging::INFO, fmt, ## __VA_ARGS__); \
+      } else { \
+        fprintf(stderr, "Should call init_logging() first!\n"); \
+      } \
+    } else if (LOG_SITE_HISTORY(logging::INFO)) { \
+      LOG_HISTORY_CALL(logging::INFO, fmt, ## __VA_ARGS__); \
     } \
   } while (0)
 
 #define Debug(fmt, ...) \
   do { \
-    if (logging::is_logging_initialized) { \
-      logging::log->log_msg(logging::DEBUG, __FILE__, __LINE__, \
-                            logging::log->get_thread_id(), \
-                            fmt, ## __VA_ARGS__); \
-    } else { \
-      fprintf(stderr, "Should call init_logging() first!\n"); \
+    LOG_SITE(logging::DEBUG, fmt); \
+    if (LOG_SITE_ENABLED(logging::DEBUG)) { \
+      if (logging::is_logging_initialized) { \
+        LOG_MSG_CALL(logging::DEBUG, fmt, ## __VA_ARGS__); \
+      } else { \
+        fprintf(stderr, "Should call init_logging() first!\n"); \
+      } \
+    } else if (LOG_SITE_HISTORY(logging::DEBUG)) { \
+      LOG_HISTORY_CALL(logging::DEBUG, fmt, ## __VA_ARGS__); \
     } \
   } while (0)
 
 #define LOG_IF(type, cond, fmt, ...) \
   do { \
-    if (logging::is_logging_initialized) { \
-      if (cond) { \
-        logging::log->log_msg(type, __FILE__, __LINE__, \
-                              logging::log->get_thread_id(), \
-                              fmt, ## __VA_ARGS__); \
+    logging::log_level_t log_if_level_ = (type); \
+    LOG_SITE(type, fmt); \
+    if (LOG_SITE_ENABLED(log_if_level_)) { \
+      if (logging::is_logging_initialized) { \
+        if (cond) { \
+          LOG_MSG_CALL(log_if_level_, fmt, ## __VA_ARGS__); \
+        } \
+      } else { \
+        fprintf(stderr, "Should call init_logging() first!\n"); \
       } \
-    } else { \
-      fprintf(stderr, "Should call init_logging() first!\n"); \
+    } else if (LOG_SITE_HISTORY(log_if_level_) && (cond)) { \
+      LOG_HISTORY_CALL(log_if_level_, fmt, ## __VA_ARGS__); \
     } \
   } while (0)
 
+/*
+ * Logs if check, an expression on the per-site state log_rate_site_, allows
+ * it. The check sets log_suppressed_ to the number of messages it held
+ * back since the last one, which are then reported in this one.
+ */
+#define LOG_RATE_CALL(type, check, fmt, ...) \
+  do { \
+    logging::log_level_t log_rate_level_ = (type); \
+    LOG_SITE(type, fmt); \
+    if (LOG_SITE_ENABLED(log_rate_level_)) { \
+      if (logging::is_logging_initialized) { \
+        static logging::rate_site_t log_rate_site_; \
+        uint64_t log_suppressed_ = 0; \
+        if (check) { \
+          if (log_suppressed_ == 0) { \
+            LOG_MSG_CALL(log_rate_level_, fmt, ## __VA_ARGS__); \
+          } else { \
+            logging::log->log_msg_suppressed(log_rate_level_, __FILE__, __LINE__, \
+                                             logging::log->get_thread_id(), \
+                                             log_suppressed_, fmt, ## __VA_ARGS__); \
+          } \
+        } \
+      } else { \
+        fprintf(stderr, "Should call init_logging() first!\n"); \
+      } \
+    } \
+  } while (0)
+
+/*
+ * Logs to a named logger (see get_logger()), whose level is checked with
+ * a single load. Site rules and the debug history do not apply:
+ *   static logging::logger_t * rpc_log = logging::get_logger("net.rpc");
+ *   LOG_TO(rpc_log, logging::INFO, "Sent %zu bytes", len);
+ */
+#define LOG_TO(logger, type, fmt, ...) \
+  do { \
+    logging::log_level_t log_to_level_ = (type); \
+    logging::logger_t * log_to_ = (logger); \
+    if (log_to_level_ <= LOG_COMPILED_MIN_LEVEL && \
+        log_to_level_ <= __atomic_load_n(&(log_to_->level), __ATOMIC_RELAXED)) { \
+      logging::Log * log_to_log_ = __atomic_load_n(&(log_to_->log), __ATOMIC_ACQUIRE); \
+      if (log_to_log_) { \
+        LOG_MSG_CALL_TO(log_to_log_, log_to_level_, fmt, ## __VA_ARGS__); \
+      } else { \
+        fprintf(stderr, "Should call init_logging() first!\n"); \
+      } \
+    } \
+  } while (0)
+
+#if __cplusplus >= 201703L
+/*
+ * Logs a message with a type-safe {} format (see format_arg_t), which is
+ * parsed and checked against the arguments at compile time. It needs
+ * C++17; the printf-style macros do not:
+ *   LOG_FORMAT(logging::INFO, "Read {} bytes from {}", len, path);
+ * The local struct turns the literal into a type, so that it can be
+ * used in constant expressions.
+ */
+#define LOG_FORMAT(type, fmt, ...) \
+  do { \
+    LOG_SITE(type, fmt); \
+    if (LOG_SITE_ENABLED(type)) { \
+      if (logging::is_logging_initialized) { \
+        struct log_format_ { \
+          static constexpr const char * get(void) { return fmt; } \
+        }; \
+        logging::log_format<log_format_>(type, __FILE__, __LINE__, \
+                                         logging::log->get_thread_id(), \
+                                         ## __VA_ARGS__); \
+      } else { \
+        fprintf(stderr, "Should call init_logging() first!\n"); \
+      } \
+    } \
+  } while (0)
+
+// Formats a {} format into buf, like snprintf(); returns the full length.
+#define LOG_FORMAT_TO(buf, size, fmt, ...) \
+  ([&]() { \
+    struct log_format_ { \
+      static constexpr const char * get(void) { return fmt; } \
+    }; \
+    return logging::format_to<log_format_>(buf, size, ## __VA_ARGS__); \
+  }())
+#endif
+
+// Logs the 1st, (n+1)th, (2n+1)th ... message from this call site.
+#define LOG_EVERY_N(type, n, fmt, ...) \
+  LOG_RATE_CALL(type, logging::rate_every_n(&log_rate_site_, (n), &log_suppressed_), \
+                fmt, ## __VA_ARGS__)
+
+// Logs the first n messages from this call site.
+#define LOG_FIRST_N(type, n, fmt, ...) \
+  LOG_RATE_CALL(type, logging::rate_first_n(&log_rate_site_, (n), &log_suppressed_), \
+                fmt, ## __VA_ARGS__)
+
+// Logs at most one message every seconds from this call site.
+#define LOG_EVERY_T(type, seconds, fmt, ...) \
+  LOG_RATE_CALL(type, logging::rate_every_t(&log_rate_site_, (seconds), &log_suppressed_), \
+                fmt, ## __VA_ARGS__)
+
+// Logs per_sec messages a second from this call site, in bursts of up to per_sec.
+#define LOG_RATE_LIMITED(type, per_sec, fmt, ...) \
+  LOG_RATE_CALL(type, logging::rate_limit(&log_rate_site_, (per_sec), &log_suppressed_), \
+                fmt, ## __VA_ARGS__)
+
+#define LOG_CONCAT_(a, b) a ## b
+#define LOG_CONCAT(a, b) LOG_CONCAT_(a, b)
+
+/*
+ * Times the rest of the enclosing scope into the timer of that name
+ * (see get_timer()), whose summary the runner logs every timer_sec:
+ *   LOG_SCOPE_TIMER("db.query");
+ */
+#define LOG_SCOPE_TIMER(name) \
+  static logging::log_timer_t * const LOG_CONCAT(log_timer_, __LINE__) = \
+      logging::get_timer(name); \
+  logging::ScopeTimer LOG_CONCAT(log_scope_timer_, __LINE__)( \
+      LOG_CONCAT(log_timer_, __LINE__))
+
 
 namespace logging {
 
@@ -139,10 +373,556 @@ namespace logging {
     TOTAL_LOG_LEVELS,
   } log_level_t;
 
+  /*
+   * SYNC_LOGGING formats and buffers messages on the calling thread
+   * under the log mutex. ASYNC_LOGGING hands every message to a
+   * per-thread ring, and the runner thread does the merging and I/O.
+   */
+  typedef enum {
+    SYNC_LOGGING,
+    ASYNC_LOGGING,
+  } log_mode_t;
+
+  // Sub-second digits appended to the timestamp of every message.
+  typedef enum {
+    TIME_SEC,
+    TIME_MSEC,
+    TIME_USEC,
+    TIME_NSEC,
+  } time_precision_t;
+
+  // Names given to rotated log files.
+  typedef enum {
+    ROTATE_NUMBERED,          // log.txt.1 (newest), log.txt.2, ...
+    ROTATE_TIMESTAMP,         // log.txt.YYYYMMDD-HHMMSS
+  } rotate_naming_t;
+
+  /*
+   * What a buffered message does when the log buffer is full. With
+   * OVERFLOW_FLUSH the calling thread writes the buffer out, as ERROR
+   * messages do. With the others the full buffer is handed to the
+   * runner and the caller carries on with a spare one; the policy only
+   * decides what happens when there is no spare left, because the
+   * runner is still writing. ERROR and FATAL messages are never dropped.
+   */
+  typedef enum {
+    OVERFLOW_FLUSH,
+    OVERFLOW_BLOCK,           // Wait up to overflow_wait_usec, then drop.
+    OVERFLOW_DROP_NEWEST,     // Drop the message.
+    OVERFLOW_DROP_OLDEST,     // Drop the oldest buffered messages no more
+                              // severe than it.
+    OVERFLOW_GROW,            // Add buffers up to overflow_max_bytes,
+                              // then drop the message.
+  } overflow_policy_t;
+
+  // Why the log buffer (or the runner's batch) was written out.
+  typedef enum {
+    FLUSH_FULL,               // The buffer filled up.
+    FLUSH_ERROR,              // An unbuffered message was written.
+    FLUSH_TIMER,              // Periodic flush by the runner.
+    FLUSH_SHUTDOWN,           // stop_logging().
+    FLUSH_REQUEST,            // Any other call to flush_buffer().
+    TOTAL_FLUSH_CAUSES,
+  } flush_cause_t;
+
+  /*
+   * Counters the log keeps about itself, see get_stats(). The flush
+   * histogram counts flushes taking less than 2^(i+1) ns in bucket i;
+   * the last bucket takes the rest.
+   */
+  typedef struct {
+    uint64_t messages[TOTAL_LOG_LEVELS];  // Lines written, by level.
+    uint64_t bytes[TOTAL_LOG_LEVELS];
+    uint64_t flushes[TOTAL_FLUSH_CAUSES];
+    uint64_t dropped;         // Messages lost.
+    uint64_t truncated;       // Messages cut to LOG_BUF_SIZE bytes.
+    uint64_t collapsed;       // Repeats counted instead of written.
+    uint64_t lock_acquires;   // Of the log mutex,
+    uint64_t lock_waits;      // how many found it taken,
+    uint64_t lock_wait_ns;    // and for how long in total.
+    uint64_t flush_ns;        // Total time spent flushing.
+    uint64_t flush_max_ns;
+    uint64_t flush_hist[STATS_HIST_BUCKETS];
+  } log_stats_t;
+
+  // Counters of the threads in one slot, on cache lines of their own.
+  typedef struct {
+    log_stats_t stats;
+  } __attribute__((aligned(64))) stats_shard_t;
+
+  // Options accepted by init_logging(); the constructor sets the defaults.
+  struct log_options_t {
+    bool sigsegv_handling;    // Also SIGBUS, SIGFPE, SIGILL and SIGABRT.
+    bool fatal_handling;
+    log_mode_t mode;
+    size_t ring_size;         // Per-thread ring size in ASYNC_LOGGING mode.
+    unsigned int poll_usec;   // Runner poll interval in ASYNC_LOGGING mode.
+    bool per_cpu_buffers;     // One ring per CPU instead of per thread.
+    bool deferred_format;     // Let the runner format literal formats.
+    time_precision_t time_precision;
+    bool utc_time;            // UTC instead of local time.
+    bool iso8601_time;        // YYYY-MM-DDTHH:MM:SS+hh:mm instead of
+                              // DD-MM-YYYY HH:MM:SS.
+    bool coarse_clock;        // CLOCK_REALTIME_COARSE; cheaper, but only
+                              // as precise as the scheduler tick.
+    size_t batch_size;        // Batching of the log file, see FileSink.
+    unsigned int batch_msec;
+    size_t rotate_bytes;      // Rotate the log file at this size; 0 never.
+    unsigned int rotate_sec;  // Rotate it every rotate_sec seconds, on
+                              // multiples of it since the epoch; 0 never.
+    rotate_naming_t rotate_naming;
+    unsigned int rotate_keep; // Rotated files kept; 0 keeps them all.
+    std::string site_rules_file;  // Loaded at init and on reload_site_rules().
+    unsigned int stats_sec;   // Log the stats this often; 0 never.
+    overflow_policy_t overflow_policy;
+    unsigned int overflow_wait_usec;
+    size_t overflow_max_bytes;  // Memory for the buffers of OVERFLOW_GROW.
+    std::string recorder_path;  // Flight recorder file; empty for none.
+    size_t recorder_size;
+    size_t history_entries;   // Debug history per thread; 0 for none.
+    log_level_t history_level;  // Least severe level kept in the history.
+    bool history_all_threads; // Dump the history of every thread.
+    size_t index_bytes;       // Index the log file every index_bytes bytes
+    size_t index_records;     // and/or index_records records; 0 never.
+    bool multi_process;       // Other processes log to the same file.
+    size_t stack_trace_depth; // Frames in the FATAL and crash stack traces,
+                              // up to STACK_TRACE_LIMIT.
+    unsigned int dedup_msec;  // Collapse the repeats of a message within
+                              // this window; 0 never.
+    bool dedup_by_site;       // Repeats of the call site, whatever the text.
+    size_t block_size;        // Write the log file in compressed blocks of
+                              // this size, see BlockFileSink; 0 never.
+    unsigned int block_msec;  // Write out a block once its oldest record
+                              // is this old; 0 only when it is full.
+    unsigned int timer_sec;   // Log the scope timers this often; 0 never.
+                              // Root log only; see init_logger().
+
+    log_options_t();
+  };
+
+  // Header of a record in a Ring. The message text follows it.
+  typedef struct {
+    uint32_t size;            // Bytes taken in the ring, header included.
+    uint16_t line;
+    uint8_t level;
+    uint8_t flags;
+    uint32_t uid;
+    uint32_t len;             // Length of the message text.
+    uint64_t timestamp;       // Nanoseconds since the epoch.
+    uint64_t seq;             // Order among equal timestamps, per-CPU rings.
+    const char * file_name;
+  } ring_record_t;
+
+  /*
+   * Header of a flight recorder file, followed by the ring of log lines.
+   * head is the number of bytes ever written, and is only advanced once
+   * they are in place; the lines before flushed have reached the sinks.
+   */
+  typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;        // Bytes of the ring, a power of two.
+    uint64_t head;
+    uint64_t flushed;
+    uint64_t pid;
+    char reserved[24];
+  } recorder_header_t;
+
+  /*
+   * Copy of the latest log lines in a file mapped with MAP_SHARED, so
+   * that the kernel keeps them even if the process is killed before the
+   * log buffer is written out. Lines are appended under the log mutex.
+   */
+  class Recorder {
+    private:
+      int fd;
+      recorder_header_t * header;
+      char * data;
+      size_t map_size;
+    public:
+      Recorder(const std::string& path, size_t size);
+      ~Recorder();
+      void append(const char * str, size_t len);
+      uint64_t get_head(void);
+      void set_flushed(uint64_t pos);
+  };
+
+  /*
+   * Sidecar index of a log file, <file>.idx: a header, then one entry
+   * per block of records, giving where the block is in the file and the
+   * range of the timestamps of its records.
+   */
+  typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t reserved[2];
+  } index_header_t;
+
+  typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t min_ns;
+    uint64_t max_ns;
+  } index_entry_t;
+
+  typedef enum {
+    BLOCK_STORED,             // As it is.
+    BLOCK_LZ,                 // With lz_compress().
+  } block_codec_t;
+
+  /*
+   * Header of a block of a block-compressed log file, followed by size
+   * bytes of data, which are raw_size bytes of whole log lines once
+   * decoded. Readers can skip the blocks out of a time range from their
+   * headers alone. Text between the blocks, such as a crash report, is
+   * plain.
+   */
+  typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t codec;
+    uint8_t reserved;
+    uint32_t raw_size;
+    uint32_t size;
+    uint64_t min_ns;
+    uint64_t max_ns;
+  } block_header_t;
+
+  // Records gathered by a BlockFileSink, in a block being filled or full.
+  typedef struct {
+    char * data;              // block_size bytes.
+    size_t len;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t since;           // When the first record came in.
+  } block_buffer_t;
+
+  /*
+   * A message written recently, and the repeats of it counted since: a
+   * slot of the table repeats are looked up in, by call site.
+   */
+  typedef struct {
+    const char * file_name;   // NULL if the slot is free.
+    uint16_t line;
+    uint8_t level;
+    uint32_t uid;             // Of the last repeat.
+    uint64_t hash;            // Of the message text; 0 with dedup_by_site.
+    uint64_t start;           // Timestamp of the message written.
+    uint64_t last;            // Timestamp of the last repeat.
+    uint64_t repeats;
+  } dedup_slot_t;
+
+  // Lines wanted from query_log(); the defaults select them all.
+  struct log_query_t {
+    uint64_t from_ns;         // Lines logged at or after from_ns,
+    uint64_t to_ns;           // and before to_ns.
+    log_level_t level;        // Least severe level wanted.
+    int64_t thread;           // Thread uid, or -1 for any.
+    bool utc;                 // Times without a zone are UTC, not local.
+
+    log_query_t();
+  };
+
+  /*
+   * Lock-free single-producer single-consumer ring of variable sized
+   * records. head and tail only ever grow; the producer owns tail and
+   * the consumer owns head.
+   */
+  class Ring {
+    private:
+      char * buf;
+      size_t capacity;
+      uint64_t head;
+      uint64_t tail;
+    public:
+      Ring(size_t capacity);
+      ~Ring();
+      ring_record_t * reserve(size_t len);
+      void commit(ring_record_t * rec, size_t len);
+      ring_record_t * peek(void);
+      void release(ring_record_t * rec);
+  };
+
+  // A message kept in the debug history, formatted only if it is dumped.
+  typedef struct {
+    uint64_t timestamp;
+    const char * file_name;
+    const char * fmt;         // NULL if data holds the formatted text.
+    uint16_t line;
+    uint8_t level;
+    uint8_t len;              // Bytes used in data.
+    uint32_t uid;
+    char data[HISTORY_ENTRY_SIZE - 32];  // Arguments, see capture_args().
+  } history_entry_t;
+
+  /*
+   * Debug history of a thread: the last messages it logged below the
+   * log level. Only the owning thread writes to it; head only grows,
+   * and entries before dumped have already been written out.
+   */
+  class History {
+    public:
+      history_entry_t * entries;
+      size_t size;
+      uint64_t head;
+      uint64_t dumped;          // Under history_mutex.
+      bool orphaned;            // Set once the owning thread has exited.
+      History * next;
+
+      History(size_t size);
+      ~History();
+  };
+
+  /*
+   * Per-thread state of a Log, registered on the thread's first message;
+   * or, with per_cpu_buffers, per-CPU state, shared by the threads
+   * running on that CPU one at a time, under mutex.
+   */
+  class ThreadBuffer {
+    public:
+      Ring ring;
+      bool orphaned;          // Set once the owning thread has exited.
+      bool per_cpu;
+      pthread_mutex_t mutex;  // With per_cpu only.
+      ThreadBuffer * next;
+
+      ThreadBuffer(size_t ring_size, bool per_cpu = false);
+      ~ThreadBuffer();
+  } __attribute__((aligned(64)));
+
+  // States of a call site.
+  enum {
+    SITE_UNREGISTERED,
+    SITE_ON,
+    SITE_OFF,
+    SITE_HISTORY,             // Off, but kept in the debug history.
+  };
+
+  // Descriptor of a call site of the logging macros.
+  typedef struct log_site_t {
+    const char * file;
+    const char * fmt;         // NULL unless it is a string literal.
+    uint16_t line;
+    uint8_t level;
+    uint8_t state;
+    struct log_site_t * next;
+  } log_site_t;
+
+  /*
+   * State of a rate-limited call site. It is a zero-initialized static,
+   * so it needs no guard, and it is only updated with atomics.
+   */
+  typedef struct {
+    uint64_t count;           // Messages seen.
+    uint64_t next;            // Monotonic time the next one is allowed at.
+    uint64_t suppressed;      // Messages held back since the last one.
+  } rate_site_t;
+
+  /*
+   * Writes the text of a message into buf, and returns its full length
+   * like vsnprintf(), even if that is size or more. It may be called
+   * twice for a message, and buf may be NULL if size is 0.
+   */
+  typedef size_t (*body_writer_t)(char * buf, size_t size, void * ctx);
+
+  // A complete log line, as handed to the sinks.
+  typedef struct {
+    log_level_t level;
+    uint64_t timestamp;
+    const char * str;
+    size_t len;
+  } log_record_t;
+
+  // A full log buffer waiting for the runner, or a spare one.
+  typedef struct log_buffer_t {
+    char * buf;               // 2 * LOG_BUF_SIZE bytes.
+    log_record_t * recs;      // LOG_BUF_RECS records.
+    size_t size;
+    size_t count;
+    uint64_t recorder_end;    // Recorder head once the buffer was full.
+    struct log_buffer_t * next;
+  } log_buffer_t;
+
+  /*
+   * Destination of the log lines. A sink only gets the records at
+   * least as severe as its own level. A Log serializes all the calls
+   * to its sinks, and the records are only valid during the call.
+   * The exception is reopen(), which the runner calls without holding
+   * the lock that serializes the sinks, so that slow renames and opens
+   * do not block logging; the sink takes lock itself around switching
+   * to the new file.
+   * crash_fd() is called from the crash handler, with nothing locked: it
+   * writes out what the sink holds back with write(2), and returns the
+   * descriptor the crash report should go to, or -1.
+   */
+  class Sink {
+    protected:
+      log_level_t level;
+    public:
+      Sink(log_level_t level = DEBUG);
+      virtual ~Sink();
+      virtual void write(const log_record_t * records, size_t count) = 0;
+      virtual void flush(void);
+      virtual void tick(uint64_t now);
+      virtual unsigned int get_tick_msec(void);
+      virtual void reopen(uint64_t now, bool force, pthread_mutex_t * lock);
+      virtual int crash_fd(void);
+      log_level_t get_level(void);
+      void set_level(log_level_t level);
+  };
+
+  /*
+   * Sink writing to a file descriptor, with one writev() per batch.
+   * With a batch_size, records are held back until batch_size bytes are
+   * pending or the oldest is batch_msec old, and then written together
+   * with the batch that fills it up, still in one writev().
+   */
+  class FdSink : public Sink {
+    protected:
+      int fd;
+      bool owns_fd;
+      size_t batch_size;
+      unsigned int batch_msec;
+      char * pending;
+      size_t pending_len;
+      uint64_t pending_since;
+      void write_pending(const log_record_t * records, size_t count);
+    public:
+      FdSink(int fd, log_level_t level = DEBUG, size_t batch_size = 0,
+             unsigned int batch_msec = 0);
+      ~FdSink();
+      void write(const log_record_t * records, size_t count);
+      void flush(void);
+      void tick(uint64_t now);
+      unsigned int get_tick_msec(void);
+      int crash_fd(void);
+  };
+
+  /*
+   * Sink appending to a file; throws if the file cannot be opened.
+   * It can rotate the file by size and/or time, reopen it on request,
+   * and keep a sidecar index of it (see index_entry_t). In multi-process
+   * mode, the processes appending to the file take turns to rotate it.
+   */
+  class FileSink : public FdSink {
+    protected:
+      std::string path;
+      uint64_t file_size;
+      size_t rotate_bytes;
+      unsigned int rotate_sec;
+      rotate_naming_t rotate_naming;
+      unsigned int rotate_keep;
+      uint64_t next_rotation;
+      int index_fd;
+      size_t index_bytes;
+      size_t index_records;
+      index_entry_t index_block;  // Block of records not indexed yet.
+      size_t index_count;
+      int lock_fd;              // <path>.lock, in multi-process mode.
+      void rotate_files(uint64_t now);
+      void prune_files(void);
+      int open_index(bool truncate);
+      void index_record(const log_record_t& record, uint64_t offset);
+      void write_index_block(void);
+      bool file_moved(void);
+    public:
+      FileSink(const std::string& path, log_level_t level = DEBUG,
+               size_t batch_size = 0, unsigned int batch_msec = 0);
+      ~FileSink();
+      void set_rotation(size_t max_bytes, unsigned int interval_sec,
+                        rotate_naming_t naming = ROTATE_NUMBERED,
+                        unsigned int keep = 0);
+      void set_index(size_t every_bytes, size_t every_records = 0);
+      void set_multi_process(bool enabled);
+      void write(const log_record_t * records, size_t count);
+      unsigned int get_tick_msec(void);
+      void reopen(uint64_t now, bool force, pthread_mutex_t * lock);
+  };
+
+  /*
+   * Sink appending to a block-compressed file (see block_header_t);
+   * throws if the file cannot be opened. The records are copied into
+   * blocks of block_size bytes, which a thread of the sink compresses
+   * and writes out, so that compression never runs on the threads that
+   * log. A block is written out once full, once its oldest record is
+   * block_msec old, or on flush(). A line is only split across blocks if
+   * it is longer than a block. The file can be reopened, but not rotated
+   * or indexed.
+   */
+  class BlockFileSink : public Sink {
+    protected:
+      std::string path;
+      int fd;
+      size_t block_size;
+      unsigned int block_msec;
+      block_buffer_t blocks[BLOCK_BUFFERS];  // Used in turn.
+      uint64_t filled;          // Blocks full so far; filled % BLOCK_BUFFERS
+                                // is the one being filled.
+      uint64_t written;         // Blocks written out so far.
+      bool stop_writer;
+      char * out;               // A block, once compressed.
+      pthread_mutex_t mutex;    // Guards filled, written and stop_writer.
+      pthread_cond_t cond;      // A block is full, or written out.
+      pthread_mutex_t fd_mutex; // Held by the writer around write(2).
+      pthread_t writer_id;
+      void seal_block(void);
+      void write_block(const block_buffer_t * block);
+      static void * writer(void * arg);
+    public:
+      BlockFileSink(const std::string& path, log_level_t level = DEBUG,
+                    size_t block_size = BLOCK_SIZE,
+                    unsigned int block_msec = BLOCK_MSEC);
+      ~BlockFileSink();
+      void write(const log_record_t * records, size_t count);
+      void flush(void);
+      void tick(uint64_t now);
+      unsigned int get_tick_msec(void);
+      void reopen(uint64_t now, bool force, pthread_mutex_t * lock);
+      int crash_fd(void);
+  };
+
+  // Sink writing to stderr, unbuffered.
+  class StderrSink : public FdSink {
+    public:
+      StderrSink(log_level_t level = DEBUG);
+  };
+
+  // Sink keeping the most recent capacity bytes of log lines in memory.
+  class MemorySink : public Sink {
+    private:
+      std::string contents;
+      size_t capacity;
+      pthread_mutex_t mutex;
+    public:
+      MemorySink(size_t capacity, log_level_t level = DEBUG);
+      ~MemorySink();
+      void write(const log_record_t * records, size_t count);
+      std::string get_contents(void);
+      void clear(void);
+  };
+
   class Log {
     private:
       std::string path;
-      FILE * outfp;
+      std::vector<Sink *> sinks;
+      Sink * default_sink;
+      size_t batch_size;
+      unsigned int batch_msec;
+      size_t rotate_bytes;
+      unsigned int rotate_sec;
+      rotate_naming_t rotate_naming;
+      unsigned int rotate_keep;
+      size_t index_bytes;
+      size_t index_records;
+      bool multi_process;
+      size_t block_size;
+      unsigned int block_msec;
+      bool reopen_requested;
+      pthread_mutex_t sinks_mutex;
+      unsigned int tick_msec;
+      log_record_t * log_recs;
+      size_t log_recs_count;
+      log_record_t * out_recs;
       log_level_t log_level;
       pthread_mutex_t mutex;
       char * log_buf;
@@ -150,38 +930,621 @@ namespace logging {
       pthread_t runner_id;
       bool kill_runner;
       bool fatal_handling;
+      log_mode_t mode;
+      uint64_t instance_id;
+      pthread_mutex_t runner_mutex;
+      pthread_cond_t runner_cond;
+      pthread_cond_t flush_cond;
+      bool runner_alive;
+      uint64_t flush_requests;
+      uint64_t flush_done;
+      unsigned int poll_usec;
+      size_t ring_size;
+      pthread_key_t thread_key;
+      pthread_mutex_t threads_mutex;
+      ThreadBuffer * threads;
+      ThreadBuffer ** cpu_buffers;  // With per_cpu_buffers, one per CPU.
+      uint64_t record_seq;      // Stamped on the records of cpu_buffers.
+      unsigned int cpu_count;
+      bool draining;            // The runner is draining the rings.
+      char * out_buf;
+      bool deferred_format;
+      time_precision_t time_precision;
+      bool utc_time;
+      bool iso8601_time;
+      clockid_t clock_id;
+      stats_shard_t * stats;    // STATS_SHARDS shards, one per thread slot.
+      unsigned int stats_sec;
+      unsigned int timer_sec;
+      pthread_mutex_t io_mutex; // Serializes the sinks; taken after mutex.
+      overflow_policy_t overflow_policy;
+      unsigned int overflow_wait_usec;
+      size_t overflow_max_bytes;
+      log_buffer_t * pending;   // Full buffers, oldest first.
+      log_buffer_t * spare;
+      size_t buffers_bytes;     // Allocated for pending and spare buffers.
+      pthread_cond_t space_cond;
+      bool handoff_requested;
+      uint64_t overflow_dropped;  // Not reported yet; under mutex.
+      uint64_t async_dropped;
+      Recorder * recorder;
+      size_t history_entries;
+      bool history_all_threads;
+      History * histories;
+      size_t stack_trace_depth;
+      bool sigsegv_handling;
+      uint64_t dedup_ns;
+      bool dedup_by_site;
+      dedup_slot_t * dedup_slots;   // DEDUP_SLOTS, if dedup_msec is set.
+      pthread_key_t history_key;
+      pthread_mutex_t history_mutex;
+
+      void init(const std::string& path, log_level_t level,
+                const log_options_t& options);
+      void vlog_msg(LOG_FUNC_SIGNATURE, bool literal,
+                    const char * fmt, va_list args);
+      void async_log_msg(LOG_FUNC_SIGNATURE, body_writer_t writer,
+                         void * ctx);
+      bool async_log_deferred(LOG_FUNC_SIGNATURE, const char * fmt,
+                              va_list args);
+      ThreadBuffer * get_thread_buffer(void);
+      ThreadBuffer * acquire_buffer(void);
+      void release_buffer(ThreadBuffer * tb);
+      uint64_t next_record_seq(ThreadBuffer * tb);
+      uint64_t get_timestamp(void);
+      size_t format_timestamp(char * buf, uint64_t ns);
+      size_t format_prefix(char * buf, size_t size, LOG_FUNC_SIGNATURE,
+                           uint64_t ns);
+      size_t format_line(char * buf, size_t size, LOG_FUNC_SIGNATURE,
+                         uint64_t ns, body_writer_t writer, void * ctx,
+                         size_t * prefix_len = NULL);
+      void spill_line(size_t len, LOG_FUNC_SIGNATURE, uint64_t ns,
+                      body_writer_t writer, void * ctx);
+      void flush_locked(void);
+      void dispatch(const log_record_t * records, size_t count);
+      void flush_sinks(void);
+      void tick_sinks(void);
+      void reopen_sinks(void);
+      void sync_backend(void);
+      void lock_mutex(void);
+      log_stats_t * get_stats_shard(void);
+      void record_flush(flush_cause_t cause, uint64_t start);
+      void log_stats(void);
+      void log_timers(void);
+      bool hand_off_locked(void);
+      bool make_room_locked(log_level_t level);
+      bool drop_oldest_locked(log_level_t level);
+      size_t format_drops(char * buf, size_t size, uint64_t dropped,
+                          uint64_t ns);
+      void commit_line_locked(log_level_t level, uint64_t ns, size_t len);
+      void flush_if_full_locked(void);
+      bool collapse_repeat(LOG_FUNC_SIGNATURE, uint64_t hash, uint64_t ns,
+                           dedup_slot_t * prev);
+      bool take_expired_repeats(uint64_t now, dedup_slot_t * slot);
+      size_t format_repeats(char * buf, size_t size, const dedup_slot_t * slot);
+      void expire_repeats(uint64_t now);
+      void out_repeats(const dedup_slot_t * slot, size_t * out_len,
+                       size_t * out_count);
+      void write_pending(void);
+      ring_record_t * reserve_record(ThreadBuffer * tb, log_level_t level);
+      History * get_history(void);
+      size_t format_history(char * buf, const history_entry_t * entry);
+      void dump_history(void);
+      size_t crash_dump(int * fds);
     public:
       Log(const std::string& path, log_level_t level,
           bool sigsegv_handling, bool fatal_handling);
+      Log(const std::string& path, log_level_t level,
+          const log_options_t& options);
       ~Log();
-      void flush_buffer(void);
-      void write_to_log(char *str, size_t len);
+      void flush_buffer(flush_cause_t cause = FLUSH_REQUEST);
+      void write_to_log(log_level_t level, uint64_t ns, const char * str,
+                        size_t len);
       void destroy_runner(void);
       void do_cleanup(void);
-      friend void detect_sigsegv(int sig_no);
+      size_t drain_rings(bool final);
+      friend void detect_sigsegv(int sig_no, siginfo_t * info, void * context);
       friend void * Runner(void * arg);
+      friend void log_timers(void);
       friend bool is_log_buf_empty(void);
       friend bool str_in_log_buf(const char * str);
       void set_log_file(const std::string& path);
+      void add_sink(Sink * sink);
+      bool remove_sink(Sink * sink);
+      void reopen(void);
+      void set_log_level(log_level_t level);
+      log_level_t get_log_level(void);
       void log_msg(LOG_FUNC_SIGNATURE, const char * fmt, ...);
-      uint16_t get_thread_id(void);
+      void log_msg_suppressed(LOG_FUNC_SIGNATURE, uint64_t suppressed,
+                              const char * fmt, ...);
+      void log_msg_literal(LOG_FUNC_SIGNATURE, const char * fmt, ...);
+      void log_site_msg(LOG_FUNC_SIGNATURE, bool literal, const char * fmt, ...);
+      void log_body(LOG_FUNC_SIGNATURE, body_writer_t writer, void * ctx,
+                    bool site_enabled = false);
+      void log_history(LOG_FUNC_SIGNATURE, bool literal, const char * fmt, ...);
+      uint32_t get_thread_id(void);
+      void get_stats(log_stats_t * stats);
   };
 
+  /*
+   * A named logger, such as "net.rpc" or "storage.compaction". Names are
+   * dot separated paths: a logger takes the level and the output of its
+   * nearest ancestor that has its own (see set_logger_level() and
+   * init_logger()), up to the root logger "", which is the log of
+   * init_logging(). Loggers are never freed, so get_logger() may be
+   * called once and its result kept.
+   */
+  typedef struct logger_t {
+    const char * name;
+    struct logger_t * parent;
+    struct logger_t * next;   // In the list of all the loggers.
+    log_level_t level;        // In effect; what LOG_TO() checks.
+    Log * log;                // In effect; NULL if there is none.
+    bool has_level;
+    log_level_t own_level;
+    Log * own_log;            // From init_logger(), or the root log.
+  } logger_t;
+
+  /*
+   * A scope timer, from get_timer(). Each thread records its durations
+   * into a log-linear histogram of its own (see timer_hist_t), which the
+   * runner merges with those of the other threads.
+   */
+  typedef struct {
+    const char * name;
+    unsigned int id;          // Index of its histograms, below TIMERS_MAX.
+  } log_timer_t;
+
+  /*
+   * Durations in nanoseconds: values below 2^TIMER_SUB_BITS have a
+   * bucket each, and every power of two above is split in
+   * 2^TIMER_SUB_BITS buckets, so a bucket is within 12.5% of its values.
+   */
+  typedef struct {
+    uint64_t max_ns;          // Since the runner last took it.
+    uint64_t buckets[TIMER_BUCKETS];
+  } timer_hist_t;
+
   extern bool is_logging_initialized;
+  extern log_level_t current_level;
   extern Log * log;
   extern const char * log_level_str[TOTAL_LOG_LEVELS];
 
   void init_logging(const std::string& path, log_level_t level,
                     bool sigsegv_handling = true, bool fatal_handling = true);
+  void init_logging(const std::string& path, log_level_t level,
+                    const log_options_t& options);
   void stop_logging(void);
-  void detect_sigsegv(int sig_no);
+  void set_log_level(log_level_t level);
+  logger_t * get_logger(const char * name);
+  void set_logger_level(const char * name, log_level_t level);
+  void init_logger(const char * name, const std::string& path,
+                   log_level_t level, const log_options_t& options);
+  void stop_logger(const char * name);
+  void add_sink(Sink * sink);
+  bool remove_sink(Sink * sink);
+  void reopen(void);
+  bool get_stats(log_stats_t * stats);
+  size_t format_stats(char * buf, size_t size, const log_stats_t& stats);
+  bool recover_recorder(const std::string& path, bool all, std::string * out);
+  size_t parse_log_time(const char * str, size_t len, bool utc, uint64_t * ns);
+  bool parse_time_arg(const char * arg, bool utc, uint64_t * ns);
+  ssize_t query_log(const std::vector<std::string>& files,
+                    const log_query_t& query, int fd, uint64_t * scanned = NULL);
+  void detect_sigsegv(int sig_no, siginfo_t * info, void * context);
   void * Runner(void * arg);
   const char * get_level_str(log_level_t level);
   void get_current_time(char ** time_str);
+  uint64_t get_time_ns(void);
+  bool rate_every_n(rate_site_t * site, uint64_t n, uint64_t * suppressed);
+  bool rate_first_n(rate_site_t * site, uint64_t n, uint64_t * suppressed);
+  bool rate_every_t(rate_site_t * site, double seconds, uint64_t * suppressed);
+  bool rate_limit(rate_site_t * site, double per_sec, uint64_t * suppressed);
+  size_t format_time(char * buf, uint64_t ns, time_precision_t precision,
+                     bool utc, bool iso8601);
+  ssize_t capture_args(char * buf, size_t size,
+                       const char * fmt, va_list args);
+  size_t render_args(char * out, size_t size, const char * fmt,
+                     const char * data, size_t data_len);
   char ** get_stack_trace(size_t *size);
+  size_t format_stack_trace(char * buf, size_t size,
+                            void * const * frames, size_t count);
+  ssize_t symbolize_log(int in_fd, int out_fd, const std::string& debug_dir);
+  size_t lz_compress(const char * src, size_t len, char * dst, size_t size);
+  ssize_t lz_decompress(const char * src, size_t len, char * dst, size_t size);
+  ssize_t cat_blocks(int in_fd, int out_fd, uint64_t from_ns, uint64_t to_ns);
   bool is_log_buf_empty(void);
   bool str_in_log_buf(const char * str);
   void sigusr1_handler(int sig_no);
+  bool register_site(log_site_t * site);
+  size_t enable_sites(const char * file_glob, unsigned int line = 0,
+                      log_level_t level = DEBUG);
+  size_t disable_sites(const char * file_glob, unsigned int line = 0);
+  void clear_site_rules(void);
+  bool load_site_rules(const char * path);
+  void reload_site_rules(void);
+  size_t get_sites(std::vector<log_site_t *> * sites);
+  void set_thread_name(const char * name);
+  const char * get_thread_name(void);
+  bool set_context(const char * key, const char * value);
+  const char * get_context(const char * key);
+  void clear_context(void);
+  log_timer_t * get_timer(const char * name);
+  void record_time(log_timer_t * timer, uint64_t ns);
+  void log_timers(void);
+  size_t timer_bucket(uint64_t ns);
+  uint64_t timer_bucket_max(size_t bucket);
+
+  /*
+   * Sets a context field of the calling thread for the lifetime of the
+   * object, and puts back its previous value, if any, afterwards:
+   *   logging::ScopedContext ctx("req", req_id);
+   */
+  class ScopedContext {
+    private:
+      char key[CONTEXT_KEY_SIZE];
+      char old_value[CONTEXT_VALUE_SIZE];
+      bool had_value;
+    public:
+      ScopedContext(const char * key, const char * value);
+      ~ScopedContext();
+  };
+
+  /*
+   * Records the time from its construction to its destruction into a
+   * timer; does nothing for a NULL timer. See LOG_SCOPE_TIMER().
+   */
+  class ScopeTimer {
+    private:
+      log_timer_t * timer;
+      uint64_t start;
+    public:
+      ScopeTimer(log_timer_t * timer);
+      ~ScopeTimer();
+  };
+
+  /*
+   * Type-safe {} formats, for LOG_FORMAT(). "{}" is replaced by the next
+   * argument, "{{" and "}}" are literal braces, and a placeholder may
+   * hold a specification, {:[<|>][+][0][width][.precision][type]}:
+   *   integers  d (default), x, X, o, b, c
+   *   floats    shortest round trip (default), f, e, g
+   *   strings   s (default); the precision truncates
+   *   pointers  p (default)
+   *   bool      s (true/false, default), d
+   *   char      c (default), d, x
+   */
+  typedef enum {
+    FORMAT_NONE,
+    FORMAT_INT,
+    FORMAT_UINT,
+    FORMAT_BOOL,
+    FORMAT_CHAR,
+    FORMAT_FLOAT,
+    FORMAT_STR,
+    FORMAT_PTR,
+    FORMAT_UNSUPPORTED,
+  } format_arg_t;
+
+  // Specification of a {} placeholder.
+  typedef struct {
+    char align;               // '<', '>', or 0 for the default.
+    bool plus;
+    bool zero;
+    uint16_t width;
+    int16_t precision;        // -1 if none.
+    char type;                // 0 for the default.
+  } format_spec_t;
+
+  // Literal text of a format, followed by a placeholder if has_arg.
+  typedef struct {
+    uint16_t begin;
+    uint16_t len;
+    bool has_arg;
+    format_spec_t spec;
+  } format_segment_t;
+
+  // A format split into segments at compile time.
+  template <size_t N>
+  struct format_parsed_t {
+    format_segment_t segs[N];
+    size_t args;
+    bool ok;
+  };
+
+  // An argument, with its type erased.
+  typedef struct {
+    format_arg_t kind;
+    union {
+      int64_t i;
+      uint64_t u;
+      double d;
+      const void * p;
+      struct {
+        const char * ptr;
+        size_t len;
+      } str;
+    };
+  } format_value_t;
+
+  // What format_body() needs to format a message.
+  typedef struct {
+    const char * fmt;
+    const format_segment_t * segs;
+    size_t count;
+    const format_value_t * values;
+  } format_ctx_t;
+
+  size_t format_body(char * buf, size_t size, void * ctx);
+
+#if __cplusplus >= 201703L
+  // Number of segments of a format, or 0 if its braces do not match.
+  constexpr size_t
+  format_segments(const char * fmt)
+  {
+    size_t count = 1;
+    for (size_t i = 0; fmt[i]; ++i) {
+      if ((fmt[i] == '{' && fmt[i + 1] == '{') ||
+          (fmt[i] == '}' && fmt[i + 1] == '}')) {
+        ++count;
+        ++i;
+      } else if (fmt[i] == '{') {
+        while (fmt[i] && fmt[i] != '}') {
+          ++i;
+        }
+        if (!fmt[i]) {
+          return 0;
+        }
+        ++count;
+      } else if (fmt[i] == '}') {
+        return 0;
+      }
+    }
+    return count;
+  }
+
+  // Split a format of N segments.
+  template <size_t N>
+  constexpr format_parsed_t<N>
+  format_parse(const char * fmt)
+  {
+    format_parsed_t<N> parsed = {};
+    parsed.ok = true;
+    size_t n = 0;
+    size_t begin = 0;
+    size_t i = 0;
+    for (; fmt[i]; ++i) {
+      if ((fmt[i] == '{' && fmt[i + 1] == '{') ||
+          (fmt[i] == '}' && fmt[i + 1] == '}')) {
+        // The literal ends with the first brace; the second is skipped.
+        parsed.segs[n].begin = begin;
+        parsed.segs[n].len = i + 1 - begin;
+        ++n;
+        begin = i + 2;
+        ++i;
+      } else if (fmt[i] == '{') {
+        format_segment_t& seg = parsed.segs[n];
+        seg.begin = begin;
+        seg.len = i - begin;
+        seg.has_arg = true;
+        seg.spec.precision = -1;
+        ++i;
+        if (fmt[i] == ':') {
+          ++i;
+          if (fmt[i] == '<' || fmt[i] == '>') {
+            seg.spec.align = fmt[i++];
+          }
+          if (fmt[i] == '+') {
+            seg.spec.plus = true;
+            ++i;
+          }
+          if (fmt[i] == '0') {
+            seg.spec.zero = true;
+            ++i;
+          }
+          while (fmt[i] >= '0' && fmt[i] <= '9') {
+            seg.spec.width = seg.spec.width * 10 + (fmt[i++] - '0');
+          }
+          if (fmt[i] == '.') {
+            seg.spec.precision = 0;
+            ++i;
+            while (fmt[i] >= '0' && fmt[i] <= '9') {
+              seg.spec.precision = seg.spec.precision * 10 + (fmt[i++] - '0');
+            }
+          }
+          if (fmt[i] && fmt[i] != '}') {
+            seg.spec.type = fmt[i++];
+          }
+        }
+        if (fmt[i] != '}') {
+          parsed.ok = false;
+          while (fmt[i] && fmt[i] != '}') {
+            ++i;
+          }
+        }
+        ++n;
+        ++parsed.args;
+        begin = i + 1;
+      }
+    }
+    parsed.segs[n].begin = begin;
+    parsed.segs[n].len = i - begin;
+    if (i > 0xffff) {
+      parsed.ok = false;
+    }
+    return parsed;
+  }
+
+  // How an argument type is formatted.
+  template <typename T>
+  constexpr format_arg_t
+  format_kind(void)
+  {
+    typedef typename std::decay<T>::type U;
+    if (std::is_same<U, bool>::value) {
+      return FORMAT_BOOL;
+    } else if (std::is_same<U, char>::value) {
+      return FORMAT_CHAR;
+    } else if (std::is_integral<U>::value) {
+      return std::is_signed<U>::value ? FORMAT_INT : FORMAT_UINT;
+    } else if (std::is_enum<U>::value) {
+      return FORMAT_INT;
+    } else if (std::is_floating_point<U>::value) {
+      return FORMAT_FLOAT;
+    } else if (std::is_same<U, const char *>::value ||
+               std::is_same<U, char *>::value ||
+               std::is_same<U, std::string>::value) {
+      return FORMAT_STR;
+    } else if (std::is_pointer<U>::value) {
+      return FORMAT_PTR;
+    }
+    return FORMAT_UNSUPPORTED;
+  }
+
+  // Whether a placeholder type applies to an argument.
+  constexpr bool
+  format_type_ok(format_arg_t kind, char type)
+  {
+    switch (kind) {
+      case FORMAT_INT:
+      case FORMAT_UINT:
+        return type == 0 || type == 'd' || type == 'x' || type == 'X' ||
+               type == 'o' || type == 'b' || type == 'c';
+      case FORMAT_BOOL:
+        return type == 0 || type == 's' || type == 'd';
+      case FORMAT_CHAR:
+        return type == 0 || type == 'c' || type == 'd' || type == 'x';
+      case FORMAT_FLOAT:
+        return type == 0 || type == 'f' || type == 'e' || type == 'g';
+      case FORMAT_STR:
+        return type == 0 || type == 's';
+      case FORMAT_PTR:
+        return type == 0 || type == 'p';
+      default:
+        return false;
+    }
+  }
+
+  // Whether every placeholder applies to its argument.
+  template <size_t N>
+  constexpr bool
+  format_args_ok(const format_parsed_t<N>& parsed, const format_arg_t * kinds)
+  {
+    size_t arg = 0;
+    for (size_t i = 0; i < N; ++i) {
+      if (parsed.segs[i].has_arg &&
+          !format_type_ok(kinds[arg++], parsed.segs[i].spec.type)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // The format of S::get(), parsed and checked against Args.
+  template <typename S, typename... Args>
+  struct format_checked_t {
+    static constexpr size_t count = format_segments(S::get());
+    static_assert(count > 0, "unmatched brace in the log format");
+    static constexpr format_parsed_t<count ? count : 1> parsed =
+        format_parse<count ? count : 1>(S::get());
+    static_assert(parsed.ok, "malformed {} placeholder in the log format");
+    static_assert(parsed.args == sizeof...(Args),
+                  "the log format does not have one {} per argument");
+    static constexpr format_arg_t kinds[] = { format_kind<Args>()..., FORMAT_NONE };
+    static_assert(format_args_ok(parsed, kinds),
+                  "a log argument does not match its {} placeholder");
+  };
+
+  // Erase the type of an argument.
+  template <typename T>
+  inline format_value_t
+  format_value(const T& v)
+  {
+    typedef typename std::decay<T>::type U;
+    constexpr format_arg_t kind = format_kind<T>();
+    format_value_t value;
+    value.kind = kind;
+    if constexpr (kind == FORMAT_INT || kind == FORMAT_CHAR) {
+      value.i = (int64_t) v;
+    } else if constexpr (kind == FORMAT_UINT || kind == FORMAT_BOOL) {
+      value.u = (uint64_t) v;
+    } else if constexpr (kind == FORMAT_FLOAT) {
+      value.d = (double) v;
+    } else if constexpr (std::is_same<U, std::string>::value) {
+      value.str.ptr = v.data();
+      value.str.len = v.size();
+    } else if constexpr (kind == FORMAT_STR && std::is_array<T>::value) {
+      value.str.ptr = v;
+      value.str.len = strnlen(v, sizeof v);
+    } else if constexpr (kind == FORMAT_STR) {
+      const char * str = v;
+      value.str.ptr = str;
+      value.str.len = str ? strlen(str) : 0;
+    } else if constexpr (kind == FORMAT_PTR) {
+      value.p = (const void *) v;
+    }
+    return value;
+  }
+
+  // Format the {} format of S::get() into buf, like snprintf().
+  template <typename S, typename... Args>
+  inline size_t
+  format_to(char * buf, size_t size, const Args&... args)
+  {
+    typedef format_checked_t<S, Args...> checked;
+    format_value_t values[] = { format_value(args)..., format_value_t() };
+    format_ctx_t ctx = { S::get(), checked::parsed.segs, checked::count, values };
+    return format_body(buf, size, &ctx);
+  }
+
+  // Log a message with the {} format of S::get().
+  template <typename S, typename... Args>
+  inline void
+  log_format(LOG_FUNC_SIGNATURE, const Args&... args)
+  {
+    typedef format_checked_t<S, Args...> checked;
+    format_value_t values[] = { format_value(args)..., format_value_t() };
+    format_ctx_t ctx = { S::get(), checked::parsed.segs, checked::count, values };
+    log->log_body(level, file_name, line, uid, format_body, &ctx, true);
+  }
+#endif
+
+  // True if the call site is enabled; registers it on its first call.
+  inline bool
+  site_enabled(log_site_t * site)
+  {
+    uint8_t state = __atomic_load_n(&(site->state), __ATOMIC_RELAXED);
+    if (state == SITE_UNREGISTERED) {
+      return register_site(site);
+    }
+    return state == SITE_ON;
+  }
+
+  // Monotonic time in nanoseconds, for the scope timers.
+  inline uint64_t
+  timer_now(void)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  // ScopeTimer constructor.
+  inline
+  ScopeTimer::ScopeTimer(log_timer_t * timer)
+  {
+    this->timer = timer;
+    this->start = timer ? timer_now() : 0;
+  }
+
+  // ScopeTimer destructor.
+  inline
+  ScopeTimer::~ScopeTimer()
+  {
+    if (this->timer) {
+      record_time(this->timer, timer_now() - this->start);
+    }
+  }
 
 }
 
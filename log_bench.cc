@@ -0,0 +1,640 @@
+/*
+ * Copyright (c) 2015, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author: Robin Thomas <robinthomas17@gmail.com>
+ *
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <vector>
+
+#include "log.h"
+
+#define ASSEMBLY_ITERATIONS 200000
+#define FORMAT_ITERATIONS 1000000
+#define DEFAULT_MAX_THREADS 8
+#define DEFAULT_THREAD_MSGS 20000
+#define TIMER_MSGS_FACTOR 50
+
+
+// Monotonic time in nanoseconds.
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ * The message assembly of log_msg() before it wrote straight into the
+ * log buffer, kept here as the baseline. Every byte it memsets, formats
+ * or copies is added to *copied.
+ */
+static pthread_mutex_t legacy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char legacy_buf[LOG_BUF_SIZE];
+static size_t legacy_buf_size = 0;
+
+static void
+legacy_log_msg(FILE * outfp,
+               size_t * copied,
+               const char * file_name,
+               uint16_t line,
+               uint32_t uid,
+               const char * fmt,
+               ...)
+{
+  char tmp[LOG_BUF_SIZE];
+  memset(tmp, 0, sizeof tmp);
+  va_list args;
+  va_start(args, fmt);
+  int body = vsnprintf(tmp, sizeof tmp, fmt, args);
+  va_end(args);
+
+  char * time_str = new char[TIME_BUF_SIZE];
+  logging::get_current_time(&time_str);
+
+  char log_str[LOG_BUF_SIZE];
+  memset(log_str, 0, sizeof log_str);
+  int str_size = snprintf(log_str, sizeof log_str,
+                          "%s, %7s Thread %5u, %s:%d => %s\n",
+                          time_str, logging::get_level_str(logging::INFO),
+                          uid, file_name, line, tmp);
+  delete[] time_str;
+
+  *copied += sizeof tmp + body + TIME_BUF_SIZE - 1 + sizeof log_str + str_size;
+
+  pthread_mutex_lock(&legacy_mutex);
+  if (legacy_buf_size + str_size >= LOG_BUF_SIZE) {
+    legacy_buf[legacy_buf_size] = '\0';
+    fputs(legacy_buf, outfp);
+    legacy_buf_size = 0;
+    fputs(log_str, outfp);
+  } else {
+    memcpy(legacy_buf + legacy_buf_size, log_str, str_size);
+    legacy_buf_size += str_size;
+    *copied += str_size;
+  }
+  pthread_mutex_unlock(&legacy_mutex);
+}
+
+
+/*
+ * Cost of assembling one buffered INFO message, before and after
+ * log_msg() started to write the prefix and the message straight into
+ * the log buffer. Output goes to /dev/null in both cases.
+ */
+static void
+bench_assembly(void)
+{
+  static const size_t msg_lens[] = { 16, 128, 1024, 3000 };
+
+  for (size_t i = 0; i < sizeof msg_lens / sizeof msg_lens[0]; ++i) {
+    char * msg = new char[msg_lens[i] + 1];
+    memset(msg, 'm', msg_lens[i]);
+    msg[msg_lens[i]] = '\0';
+
+    // Before.
+    FILE * outfp = fopen("/dev/null", "a");
+    setvbuf(outfp, NULL, _IOLBF, 0);
+    size_t copied = 0;
+    uint64_t start = now_ns();
+    for (int n = 0; n < ASSEMBLY_ITERATIONS; ++n) {
+      legacy_log_msg(outfp, &copied, __FILE__, __LINE__, 1, "%s", msg);
+    }
+    uint64_t elapsed = now_ns() - start;
+    fclose(outfp);
+    printf("{\"bench\": \"assembly\", \"path\": \"legacy\", \"msg_len\": %zu, "
+           "\"ns_per_msg\": %.1f, \"bytes_copied_per_msg\": %.1f}\n",
+           msg_lens[i], (double) elapsed / ASSEMBLY_ITERATIONS,
+           (double) copied / ASSEMBLY_ITERATIONS);
+
+    // After: the line is written once, where it is buffered.
+    logging::init_logging("/dev/null", logging::INFO);
+    char prefix[LOG_BUF_SIZE];
+    size_t line_len = logging::format_time(prefix, logging::get_time_ns(),
+                                           logging::TIME_SEC, false, false) +
+                      snprintf(NULL, 0, ", %7s Thread %5u, %s:%d => \n",
+                               "INFO", logging::log->get_thread_id(),
+                               __FILE__, __LINE__) + msg_lens[i];
+    start = now_ns();
+    for (int n = 0; n < ASSEMBLY_ITERATIONS; ++n) {
+      Info("%s", msg);
+    }
+    elapsed = now_ns() - start;
+    logging::stop_logging();
+    printf("{\"bench\": \"assembly\", \"path\": \"direct\", \"msg_len\": %zu, "
+           "\"ns_per_msg\": %.1f, \"bytes_copied_per_msg\": %.1f}\n",
+           msg_lens[i], (double) elapsed / ASSEMBLY_ITERATIONS,
+           (double) line_len);
+
+    delete[] msg;
+  }
+}
+
+
+// Format with vsnprintf(), as log_msg() does.
+static int
+printf_format(char * buf,
+              size_t size,
+              const char * fmt,
+              ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(buf, size, fmt, args);
+  va_end(args);
+  return len;
+}
+
+
+/*
+ * Cost of formatting the same message body with vsnprintf() and with
+ * the {} formatter of LOG_FORMAT(), without any of the logging around it.
+ */
+static void
+bench_format(void)
+{
+  char buf[LOG_BUF_SIZE];
+  volatile size_t sink = 0;
+
+  uint64_t start = now_ns();
+  for (int n = 0; n < FORMAT_ITERATIONS; ++n) {
+    sink += printf_format(buf, sizeof buf, "Request %d from %s took %.3f ms, %lu bytes",
+                          n, "10.0.0.1", n * 0.001, (unsigned long) n * 512);
+  }
+  uint64_t elapsed = now_ns() - start;
+  printf("{\"bench\": \"format\", \"path\": \"vsnprintf\", "
+         "\"ns_per_msg\": %.1f}\n", (double) elapsed / FORMAT_ITERATIONS);
+
+  start = now_ns();
+  for (int n = 0; n < FORMAT_ITERATIONS; ++n) {
+    sink += LOG_FORMAT_TO(buf, sizeof buf, "Request {} from {} took {:.3f} ms, {} bytes",
+                          n, "10.0.0.1", n * 0.001, (unsigned long) n * 512);
+  }
+  elapsed = now_ns() - start;
+  printf("{\"bench\": \"format\", \"path\": \"template\", "
+         "\"ns_per_msg\": %.1f}\n", (double) elapsed / FORMAT_ITERATIONS);
+
+  start = now_ns();
+  for (int n = 0; n < FORMAT_ITERATIONS; ++n) {
+    sink += printf_format(buf, sizeof buf, "Value %d, %d, %d, %g",
+                          n, -n, n * 7, n * 0.5);
+  }
+  elapsed = now_ns() - start;
+  printf("{\"bench\": \"format\", \"path\": \"vsnprintf_numbers\", "
+         "\"ns_per_msg\": %.1f}\n", (double) elapsed / FORMAT_ITERATIONS);
+
+  start = now_ns();
+  for (int n = 0; n < FORMAT_ITERATIONS; ++n) {
+    sink += LOG_FORMAT_TO(buf, sizeof buf, "Value {}, {}, {}, {}",
+                          n, -n, n * 7, n * 0.5);
+  }
+  elapsed = now_ns() - start;
+  printf("{\"bench\": \"format\", \"path\": \"template_numbers\", "
+         "\"ns_per_msg\": %.1f}\n", (double) elapsed / FORMAT_ITERATIONS);
+}
+
+
+// Paths through log_msg() measured by the throughput benchmark.
+typedef enum {
+  PATH_BUFFERED,              // INFO, appended to the log buffer.
+  PATH_UNBUFFERED,            // ERROR, written out on every call.
+  PATH_DISABLED,              // DEBUG below the log level.
+  PATH_HISTORY,               // DEBUG kept in the debug history.
+} bench_path_t;
+
+static const char * path_names[] = { "buffered_info", "unbuffered_error",
+                                     "disabled_debug", "history_debug" };
+
+// One producer thread of a run.
+typedef struct {
+  bench_path_t path;
+  size_t msgs;
+  pthread_barrier_t * barrier;
+  std::vector<uint64_t> * lat;  // Per-call latency in ns, one per message.
+  uint64_t start;             // When the producer started and ended.
+  uint64_t end;
+} producer_t;
+
+// Result of one run, over all its producer threads.
+typedef struct {
+  double msgs_per_sec;
+  uint64_t p50;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+} run_result_t;
+
+
+// Log prod->msgs messages on the path of the run, timing every call.
+static void *
+producer(void * arg)
+{
+  producer_t * prod = (producer_t *) arg;
+  std::vector<uint64_t>& lat = *prod->lat;
+
+  pthread_barrier_wait(prod->barrier);
+  prod->start = now_ns();
+  for (size_t n = 0; n < prod->msgs; ++n) {
+    uint64_t start = now_ns();
+    switch (prod->path) {
+      case PATH_BUFFERED:
+        Info("Benchmark message %zu, status = %d", n, 0);
+        break;
+      case PATH_UNBUFFERED:
+        Error("Benchmark message %zu, status = %d", n, 0);
+        break;
+      case PATH_DISABLED:
+      case PATH_HISTORY:
+        Debug("Benchmark message %zu, status = %d", n, 0);
+        break;
+    }
+    lat[n] = now_ns() - start;
+  }
+  prod->end = now_ns();
+  return NULL;
+}
+
+
+// Percentile pct (0 to 100) of the sorted latencies.
+static uint64_t
+percentile(const std::vector<uint64_t>& sorted,
+           double pct)
+{
+  size_t idx = (size_t) (pct / 100.0 * (sorted.size() - 1) + 0.5);
+  return sorted[idx];
+}
+
+
+/*
+ * Log msgs messages from each of threads producers, all started at
+ * once, to a log already initialized by the caller. The throughput is
+ * taken from the first producer's start to the last one's end, so it
+ * does not include the flush at stop_logging().
+ */
+static run_result_t
+run_producers(bench_path_t path,
+              size_t threads,
+              size_t msgs)
+{
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, threads + 1);
+
+  std::vector<pthread_t> tids(threads);
+  std::vector<producer_t> prods(threads);
+  std::vector<std::vector<uint64_t> > lats(threads, std::vector<uint64_t>(msgs));
+  for (size_t i = 0; i < threads; ++i) {
+    prods[i].path = path;
+    prods[i].msgs = msgs;
+    prods[i].barrier = &barrier;
+    prods[i].lat = &lats[i];
+    pthread_create(&tids[i], NULL, producer, &prods[i]);
+  }
+
+  pthread_barrier_wait(&barrier);
+  for (size_t i = 0; i < threads; ++i) {
+    pthread_join(tids[i], NULL);
+  }
+  pthread_barrier_destroy(&barrier);
+
+  uint64_t start = UINT64_MAX, end = 0;
+  std::vector<uint64_t> all;
+  all.reserve(threads * msgs);
+  for (size_t i = 0; i < threads; ++i) {
+    start = std::min(start, prods[i].start);
+    end = std::max(end, prods[i].end);
+    all.insert(all.end(), lats[i].begin(), lats[i].end());
+  }
+  uint64_t elapsed = end - start;
+  std::sort(all.begin(), all.end());
+
+  run_result_t res;
+  res.msgs_per_sec = (double) all.size() * 1e9 / (elapsed ? elapsed : 1);
+  res.p50 = percentile(all, 50.0);
+  res.p99 = percentile(all, 99.0);
+  res.p999 = percentile(all, 99.9);
+  res.max = all.back();
+  return res;
+}
+
+
+/*
+ * Throughput and per-call latency of log_msg() for 1, 2, 4, ... up to
+ * max_threads producers, on every path and to every output. The stderr
+ * runs write to whatever stderr is, so redirect it.
+ */
+static void
+bench_throughput(size_t max_threads,
+                 size_t msgs)
+{
+  char file_path[64];
+  snprintf(file_path, sizeof file_path, "/tmp/log_bench.%d.txt", (int) getpid());
+  const char * targets[] = { "stderr", "file", "devnull" };
+  const char * paths[] = { "", file_path, "/dev/null" };
+
+  for (size_t t = 0; t < sizeof targets / sizeof targets[0]; ++t) {
+    for (int p = PATH_BUFFERED; p <= PATH_HISTORY; ++p) {
+      for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        logging::log_options_t options;
+        if (p == PATH_HISTORY) {
+          options.history_entries = HISTORY_ENTRIES;
+        }
+        logging::init_logging(paths[t], logging::INFO, options);
+        run_result_t res = run_producers((bench_path_t) p, threads, msgs);
+        logging::stop_logging();
+        if (paths[t] == file_path) {
+          remove(file_path);
+        }
+
+        printf("{\"bench\": \"throughput\", \"target\": \"%s\", "
+               "\"path\": \"%s\", \"threads\": %zu, \"msgs\": %zu, "
+               "\"msgs_per_sec\": %.0f, \"p50_ns\": %lu, \"p99_ns\": %lu, "
+               "\"p999_ns\": %lu, \"max_ns\": %lu}\n",
+               targets[t], path_names[p], threads, threads * msgs,
+               res.msgs_per_sec, (unsigned long) res.p50,
+               (unsigned long) res.p99, (unsigned long) res.p999,
+               (unsigned long) res.max);
+        fflush(stdout);
+      }
+    }
+  }
+}
+
+
+/*
+ * Buffered INFO to /dev/null from more and more threads. In
+ * SYNC_LOGGING mode every call takes the one log mutex, so the total
+ * throughput stops growing, and then drops, as threads are added;
+ * "scaling" is the throughput relative to a single thread. The same
+ * runs in ASYNC_LOGGING mode, where producers only touch their own
+ * ring, or that of their CPU, are given for comparison.
+ */
+static void
+bench_contention(size_t max_threads,
+                 size_t msgs)
+{
+  const logging::log_mode_t modes[] = { logging::SYNC_LOGGING,
+                                        logging::ASYNC_LOGGING,
+                                        logging::ASYNC_LOGGING };
+  const char * mode_names[] = { "sync", "async", "async_per_cpu" };
+
+  for (size_t m = 0; m < sizeof modes / sizeof modes[0]; ++m) {
+    double single = 0;
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+      logging::log_options_t options;
+      options.mode = modes[m];
+      options.per_cpu_buffers = (m == 2);
+      logging::init_logging("/dev/null", logging::INFO, options);
+      run_result_t res = run_producers(PATH_BUFFERED, threads, msgs);
+      logging::stop_logging();
+
+      if (threads == 1) {
+        single = res.msgs_per_sec;
+      }
+      printf("{\"bench\": \"contention\", \"mode\": \"%s\", "
+             "\"threads\": %zu, \"msgs_per_sec\": %.0f, \"scaling\": %.2f, "
+             "\"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, "
+             "\"max_ns\": %lu}\n",
+             mode_names[m], threads, res.msgs_per_sec,
+             res.msgs_per_sec / single, (unsigned long) res.p50,
+             (unsigned long) res.p99, (unsigned long) res.p999,
+             (unsigned long) res.max);
+      fflush(stdout);
+    }
+  }
+}
+
+
+/*
+ * Buffered INFO from 1, 2, 4, ... up to max_procs processes, all
+ * appending to the same file in multi_process mode, without and with
+ * batching. Each process writes whole records with one writev() per
+ * batch, so torn_lines, the lines that are not one whole message,
+ * must be 0; "scaling" is the throughput relative to one process.
+ */
+static void
+bench_processes(size_t max_procs,
+                size_t msgs)
+{
+  char file_path[64];
+  snprintf(file_path, sizeof file_path, "/tmp/log_bench.%d.txt", (int) getpid());
+  const size_t batch_sizes[] = { 0, 64 * 1024 };
+
+  for (size_t b = 0; b < sizeof batch_sizes / sizeof batch_sizes[0]; ++b) {
+    double single = 0;
+    for (size_t procs = 1; procs <= max_procs; procs *= 2) {
+      uint64_t start = now_ns();
+      for (size_t p = 0; p < procs; ++p) {
+        if (fork() == 0) {
+          logging::log_options_t options;
+          options.multi_process = true;
+          options.batch_size = batch_sizes[b];
+          options.batch_msec = 100;
+          logging::init_logging(file_path, logging::INFO, options);
+          for (size_t n = 0; n < msgs; ++n) {
+            Info("Benchmark message %zu from process %zu, status = %d", n, p, 0);
+          }
+          logging::stop_logging();
+          _exit(0);
+        }
+      }
+      while (wait(NULL) > 0) {
+      }
+      uint64_t elapsed = now_ns() - start;
+
+      size_t lines = 0, torn = 0;
+      FILE * fp = fopen(file_path, "r");
+      if (fp) {
+        char line[LOG_BUF_SIZE];
+        while (fgets(line, sizeof line, fp)) {
+          ++lines;
+          torn += strstr(line, ", status = 0\n") == NULL || line[2] != '-';
+        }
+        fclose(fp);
+      }
+      remove(file_path);
+      remove((std::string(file_path) + ".lock").c_str());
+
+      double msgs_per_sec = (double) procs * msgs * 1e9 / elapsed;
+      if (procs == 1) {
+        single = msgs_per_sec;
+      }
+      printf("{\"bench\": \"processes\", \"batch_size\": %zu, "
+             "\"processes\": %zu, \"msgs_per_sec\": %.0f, \"scaling\": %.2f, "
+             "\"torn_lines\": %zu, \"missing_lines\": %zu}\n",
+             batch_sizes[b], procs, msgs_per_sec, msgs_per_sec / single,
+             torn, procs * msgs - std::min(lines, procs * msgs));
+      fflush(stdout);
+    }
+  }
+}
+
+
+/*
+ * Buffered INFO to a plain and to a block-compressed log file (the
+ * block_size option), from 1, 2, 4, ... up to max_threads producers.
+ * Blocks are compressed by the writer thread of the sink, so the
+ * latencies should match; "ratio" is the plain size over the file size.
+ */
+static void
+bench_compression(size_t max_threads,
+                  size_t msgs)
+{
+  char file_path[64];
+  snprintf(file_path, sizeof file_path, "/tmp/log_bench.%d.txt", (int) getpid());
+  const size_t block_sizes[] = { 0, BLOCK_SIZE };
+
+  for (size_t b = 0; b < sizeof block_sizes / sizeof block_sizes[0]; ++b) {
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+      logging::log_options_t options;
+      options.block_size = block_sizes[b];
+      logging::init_logging(file_path, logging::INFO, options);
+      run_result_t res = run_producers(PATH_BUFFERED, threads, msgs);
+      logging::log_stats_t stats;
+      logging::get_stats(&stats);
+      logging::stop_logging();
+
+      struct stat st;
+      uint64_t file_bytes = (stat(file_path, &st) == 0) ? st.st_size : 0;
+      remove(file_path);
+      uint64_t bytes = stats.bytes[logging::INFO];
+      printf("{\"bench\": \"compression\", \"block_size\": %zu, "
+             "\"threads\": %zu, \"msgs_per_sec\": %.0f, \"bytes\": %lu, "
+             "\"file_bytes\": %lu, \"ratio\": %.2f, \"p50_ns\": %lu, "
+             "\"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}\n",
+             block_sizes[b], threads, res.msgs_per_sec, (unsigned long) bytes,
+             (unsigned long) file_bytes,
+             file_bytes ? (double) bytes / file_bytes : 0.0,
+             (unsigned long) res.p50, (unsigned long) res.p99,
+             (unsigned long) res.p999, (unsigned long) res.max);
+      fflush(stdout);
+    }
+  }
+}
+
+
+// Time msgs empty scopes with LOG_SCOPE_TIMER().
+static void *
+timer_producer(void * arg)
+{
+  size_t msgs = *(size_t *) arg;
+  for (size_t n = 0; n < msgs; ++n) {
+    LOG_SCOPE_TIMER("bench.scope");
+  }
+  return NULL;
+}
+
+
+/*
+ * Cost of an empty LOG_SCOPE_TIMER() scope, two clock reads and a
+ * histogram update, from 1, 2, 4, ... up to max_threads threads, while
+ * the runner merges the histograms every second.
+ */
+static void
+bench_timers(size_t max_threads,
+             size_t msgs)
+{
+  msgs *= TIMER_MSGS_FACTOR;
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    logging::log_options_t options;
+    options.timer_sec = 1;
+    logging::init_logging("/dev/null", logging::INFO, options);
+    pthread_t * ids = new pthread_t[threads];
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < threads; ++i) {
+      pthread_create(&ids[i], NULL, timer_producer, &msgs);
+    }
+    for (size_t i = 0; i < threads; ++i) {
+      pthread_join(ids[i], NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+    logging::stop_logging();
+    delete[] ids;
+    printf("{\"bench\": \"timers\", \"threads\": %zu, "
+           "\"ns_per_scope\": %.1f}\n", threads, (double) elapsed / msgs);
+    fflush(stdout);
+  }
+}
+
+
+int main(int argc, char ** argv) {
+  const char * bench = (argc > 1) ? argv[1] : "all";
+  size_t max_threads = (argc > 2) ? strtoul(argv[2], NULL, 10) : DEFAULT_MAX_THREADS;
+  size_t msgs = (argc > 3) ? strtoul(argv[3], NULL, 10) : DEFAULT_THREAD_MSGS;
+
+  const char * benches[] = { "all", "assembly", "format", "throughput",
+                             "contention", "processes", "compression",
+                             "timers" };
+  bool known = false;
+  for (size_t i = 0; i < sizeof benches / sizeof benches[0]; ++i) {
+    known = known || strcmp(bench, benches[i]) == 0;
+  }
+  if (!known || max_threads == 0 || msgs == 0) {
+    fprintf(stderr, "Usage: %s [all|assembly|format|throughput|contention|"
+            "processes|compression|timers] [max_threads] [msgs_per_thread]\n", argv[0]);
+    return 1;
+  }
+
+  bool all = (strcmp(bench, "all") == 0);
+  if (all || strcmp(bench, "assembly") == 0) {
+    bench_assembly();
+  }
+  if (all || strcmp(bench, "format") == 0) {
+    bench_format();
+  }
+  if (all || strcmp(bench, "throughput") == 0) {
+    bench_throughput(max_threads, msgs);
+  }
+  if (all || strcmp(bench, "contention") == 0) {
+    bench_contention(max_threads, msgs);
+  }
+  if (all || strcmp(bench, "processes") == 0) {
+    bench_processes(max_threads, msgs);
+  }
+  if (all || strcmp(bench, "compression") == 0) {
+    bench_compression(max_threads, msgs);
+  }
+  if (all || strcmp(bench, "timers") == 0) {
+    bench_timers(max_threads, msgs);
+  }
+
+  return 0;
+}
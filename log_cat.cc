@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2015, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author: Robin Thomas <robinthomas17@gmail.com>
+ *
+ */
+
+
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "log.h"
+
+
+/*
+ * Print block-compressed log files (the block_size option) as plain
+ * text, in the order given; stdin without a file. With a time range
+ * [from, to), only the blocks with records in it are decompressed; the
+ * others are skipped from their headers.
+ */
+int main(int argc, char ** argv) {
+  const char * from = NULL;
+  const char * to = NULL;
+  uint64_t from_ns = 0;
+  uint64_t to_ns = UINT64_MAX;
+  bool utc = false;
+  bool valid = true;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:t:u")) != -1) {
+    switch (opt) {
+      case 'f':
+        from = optarg;
+        break;
+      case 't':
+        to = optarg;
+        break;
+      case 'u':
+        utc = true;
+        break;
+      default:
+        valid = false;
+        break;
+    }
+  }
+  if (valid && from) {
+    valid = logging::parse_time_arg(from, utc, &from_ns);
+  }
+  if (valid && to) {
+    valid = logging::parse_time_arg(to, utc, &to_ns);
+  }
+  if (!valid) {
+    fprintf(stderr, "Usage: %s [-f <from>] [-t <to>] [-u] [<log file>...]\n"
+            "Times are \"DD-MM-YYYY HH:MM:SS\", \"YYYY-MM-DDTHH:MM:SS\" or "
+            "@<unix time>; -u reads them as UTC.\n", argv[0]);
+    return 1;
+  }
+
+  int status = 0;
+  for (int i = optind; i < argc || i == optind; ++i) {
+    int fd = STDIN_FILENO;
+    if (i < argc && (fd = open(argv[i], O_RDONLY)) < 0) {
+      fprintf(stderr, "Cannot open %s\n", argv[i]);
+      status = 1;
+      continue;
+    }
+    if (logging::cat_blocks(fd, STDOUT_FILENO, from_ns, to_ns) < 0) {
+      fprintf(stderr, "%s has a corrupt block\n", (i < argc) ? argv[i] : "stdin");
+      status = 1;
+    }
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+  }
+  return status;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2015, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author: Robin Thomas <robinthomas17@gmail.com>
+ *
+ */
+
+/*
+ * Checks that log.h, and its printf-style macros, still compile before
+ * C++17; only LOG_FORMAT() and LOG_FORMAT_TO() need it. Compile it with
+ * -std=c++11, there is nothing to run.
+ */
+#include <string.h>
+
+#include "log.h"
+
+
+static_assert(__cplusplus < 201703L, "Compile this check with -std=c++11");
+
+// Use each kind of printf-style macro once.
+void
+log_cxx11_check(void)
+{
+  logging::logger_t * logger = logging::get_logger("check");
+  Info("Checking %s", "C++11");
+  Debug("Checking %d", 11);
+  LOG_IF(logging::WARNING, strlen("C++11") > 0, "Checking %s", "LOG_IF");
+  LOG_EVERY_N(logging::INFO, 10, "Checking %s", "LOG_EVERY_N");
+  LOG_RATE_LIMITED(logging::INFO, 5, "Checking %s", "LOG_RATE_LIMITED");
+  LOG_TO(logger, logging::INFO, "Checking %s", "LOG_TO");
+  LOG_SCOPE_TIMER("check");
+}
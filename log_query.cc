@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2015, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author: Robin Thomas <robinthomas17@gmail.com>
+ *
+ */
+
+
+
+
+
+#include <stdio.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "log.h"
+
+
+/*
+ * Print the lines of log files in a time range [from, to), at least as
+ * severe as a level and/or from one thread. Rotated segments can be
+ * given together, in any order. The sidecar index of a file (the
+ * index_bytes and index_records options) is used when there is one.
+ */
+int main(int argc, char ** argv) {
+  const char * from = NULL;
+  const char * to = NULL;
+  logging::log_query_t query;
+  bool valid = true;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:t:l:T:u")) != -1) {
+    switch (opt) {
+      case 'f':
+        from = optarg;
+        break;
+      case 't':
+        to = optarg;
+        break;
+      case 'l':
+        valid = false;
+        for (int l = 0; l < logging::TOTAL_LOG_LEVELS; ++l) {
+          if (strcasecmp(optarg, logging::log_level_str[l]) == 0) {
+            query.level = (logging::log_level_t) l;
+            valid = true;
+          }
+        }
+        break;
+      case 'T':
+        query.thread = strtoll(optarg, NULL, 10);
+        break;
+      case 'u':
+        query.utc = true;
+        break;
+      default:
+        valid = false;
+        break;
+    }
+    if (!valid) {
+      break;
+    }
+  }
+  if (valid && from) {
+    valid = logging::parse_time_arg(from, query.utc, &query.from_ns);
+  }
+  if (valid && to) {
+    valid = logging::parse_time_arg(to, query.utc, &query.to_ns);
+  }
+  if (!valid || optind == argc) {
+    fprintf(stderr, "Usage: %s [-f <from>] [-t <to>] [-l <level>] "
+            "[-T <thread>] [-u] <log file>...\n"
+            "Times are \"DD-MM-YYYY HH:MM:SS\", \"YYYY-MM-DDTHH:MM:SS\" or "
+            "@<unix time>; -u reads them as UTC.\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<std::string> files(argv + optind, argv + argc);
+  if (logging::query_log(files, query, STDOUT_FILENO) < 0) {
+    fprintf(stderr, "None of the files could be read\n");
+    return 1;
+  }
+  return 0;
+}
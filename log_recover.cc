@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2015, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author: Robin Thomas <robinthomas17@gmail.com>
+ *
+ */
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+
+/*
+ * Print the log lines a process left in its flight recorder file
+ * (the recorder_path option) that never made it to the log: run it
+ * after the process was killed, before it is started again. With -a,
+ * print all the lines the recorder still holds.
+ */
+int main(int argc, char ** argv) {
+  bool all = (argc == 3 && strcmp(argv[1], "-a") == 0);
+  if (argc != 2 + all) {
+    fprintf(stderr, "Usage: %s [-a] <recorder file>\n", argv[0]);
+    return 1;
+  }
+
+  std::string lines;
+  if (!logging::recover_recorder(argv[1 + all], all, &lines)) {
+    fprintf(stderr, "%s is not a flight recorder file\n", argv[1 + all]);
+    return 1;
+  }
+  fwrite(lines.data(), 1, lines.size(), stdout);
+  return 0;
+}
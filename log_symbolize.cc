@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2015, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Author: Robin Thomas <robinthomas17@gmail.com>
+ *
+ */
+
+
+
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "log.h"
+
+
+/*
+ * Print a log with its stack traces symbolized: the raw frames that
+ * FATAL messages and the crash handler write (see format_stack_trace())
+ * are resolved with llvm-symbolizer or addr2line against the binaries
+ * and libraries they list, checked by build id, or their separate debug
+ * info under -d <dir> (/usr/lib/debug by default). Reads stdin without
+ * a file.
+ */
+int main(int argc, char ** argv) {
+  std::string debug_dir = "/usr/lib/debug";
+  bool valid = true;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:")) != -1) {
+    if (opt == 'd') {
+      debug_dir = optarg;
+    } else {
+      valid = false;
+    }
+  }
+  if (!valid || argc - optind > 1) {
+    fprintf(stderr, "Usage: %s [-d <debug dir>] [<log file>]\n", argv[0]);
+    return 1;
+  }
+
+  int fd = STDIN_FILENO;
+  if (optind < argc && (fd = open(argv[optind], O_RDONLY)) < 0) {
+    fprintf(stderr, "Cannot open %s\n", argv[optind]);
+    return 1;
+  }
+  ssize_t resolved = logging::symbolize_log(fd, STDOUT_FILENO, debug_dir);
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+  if (resolved < 0) {
+    fprintf(stderr, "The log could not be read\n");
+    return 1;
+  }
+  return 0;
+}
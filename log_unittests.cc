@@ -38,10 +38,13 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <wchar.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 
 #include "log.h"
 
@@ -49,6 +52,75 @@
 #define GREEN "\x1B[32m"
 #define RESET "\033[0m"
 
+#define ASYNC_TEST_THREADS 4
+#define ASYNC_TEST_MSGS 2000
+#define STATS_TEST_THREADS 70
+#define STATS_TEST_MSGS 500
+
+void * async_producer(void * arg) {
+  long id = (long) arg;
+  for (int i = 0; i < ASYNC_TEST_MSGS; ++i) {
+    Info("Async producer %ld message %d", id, i);
+  }
+  return NULL;
+}
+
+void * stats_producer(void * arg) {
+  for (int i = 0; i < STATS_TEST_MSGS; ++i) {
+    Info("Stats producer message %d", i);
+  }
+  return NULL;
+}
+
+// Sink taking 100 ms per write, to keep the runner busy.
+class SlowSink : public logging::Sink {
+  public:
+    SlowSink() : logging::Sink(logging::DEBUG) {}
+    void write(const logging::log_record_t * records, size_t count) {
+      usleep(100 * 1000);
+    }
+};
+
+// Wait up to msec milliseconds for a file to exist.
+bool wait_for_file(const char * path, int msec) {
+  struct stat st;
+  for (int i = 0; i < msec / 10; ++i) {
+    if (stat(path, &st) == 0) {
+      return true;
+    }
+    usleep(10000);
+  }
+  return stat(path, &st) == 0;
+}
+
+// Capture the arguments of a deferred message.
+ssize_t capture(char * buf, size_t size, const char * fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  ssize_t len = logging::capture_args(buf, size, fmt, args);
+  va_end(args);
+  return len;
+}
+
+// Check that a deferred message renders exactly like vsnprintf().
+bool deferred_matches(const char * fmt, ...) {
+  char expected[LOG_BUF_SIZE];
+  char data[LOG_BUF_SIZE];
+  char rendered[LOG_BUF_SIZE];
+  va_list args, args_copy;
+  va_start(args, fmt);
+  va_copy(args_copy, args);
+  vsnprintf(expected, sizeof expected, fmt, args);
+  ssize_t len = logging::capture_args(data, sizeof data, fmt, args_copy);
+  va_end(args_copy);
+  va_end(args);
+  if (len < 0) {
+    return false;
+  }
+  logging::render_args(rendered, sizeof rendered, fmt, data, len);
+  return strcmp(expected, rendered) == 0;
+}
+
 int main() {
 
   const char * log_file = "/tmp/log_test";
@@ -421,6 +493,1341 @@ int main() {
     }
   }
 
+  // Testing for asynchronous logging through the thread rings.
+  {
+    logging::log_options_t options;
+    options.mode = logging::ASYNC_LOGGING;
+    logging::init_logging(log_file, logging::INFO, options);
+
+    pthread_t threads[ASYNC_TEST_THREADS];
+    for (long i = 0; i < ASYNC_TEST_THREADS; ++i) {
+      pthread_create(&threads[i], NULL, async_producer, (void *) i);
+    }
+    for (int i = 0; i < ASYNC_TEST_THREADS; ++i) {
+      pthread_join(threads[i], NULL);
+    }
+    logging::stop_logging();
+
+    // Every message must be written, in order within each thread.
+    int next[ASYNC_TEST_THREADS] = { 0 };
+    bool ordered = true;
+    FILE * fp = fopen(log_file, "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      while (fgets(line, sizeof line, fp)) {
+        long id;
+        int msg;
+        const char * p = strstr(line, "Async producer");
+        if (p && sscanf(p, "Async producer %ld message %d", &id, &msg) == 2) {
+          if (id < 0 || id >= ASYNC_TEST_THREADS || msg != next[id]++) {
+            ordered = false;
+          }
+        }
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+
+    bool complete = true;
+    for (int i = 0; i < ASYNC_TEST_THREADS; ++i) {
+      complete = complete && (next[i] == ASYNC_TEST_MSGS);
+    }
+
+    if (fp && ordered && complete) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking asynchronous logging.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking asynchronous logging.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing for deferred formatting of raw arguments.
+  {
+    char volatile_str[32];
+    strcpy(volatile_str, "copied string");
+    bool check =
+      deferred_matches("plain text, 100%% literal") &&
+      deferred_matches("%d %5i %-3u %x %#o %c", -42, 7, 3u, 0xbeef, 8, 'z') &&
+      deferred_matches("%ld %lld %zu %jd %td %hhd", -1L, 1LL << 40,
+                       (size_t) 12, (intmax_t) -5, (ptrdiff_t) 9, 300) &&
+      deferred_matches("%f %.3e %g %10.2Lf", 3.5, 1e-9, 0.1, (long double) 2.25) &&
+      deferred_matches("%s|%.4s|%*s|%-*.*s|%s", volatile_str, "truncated",
+                       8, "pad", 6, 2, "ab", (const char *) NULL) &&
+      deferred_matches("%p %ls", (void *) volatile_str, L"wide");
+
+    // The string must be copied, not referenced.
+    char data[LOG_BUF_SIZE];
+    char rendered[LOG_BUF_SIZE];
+    const char * fmt = "value %s";
+    ssize_t len = capture(data, sizeof data, fmt, volatile_str);
+    strcpy(volatile_str, "overwritten");
+    logging::render_args(rendered, sizeof rendered, fmt, data, len);
+    check = check && strcmp(rendered, "value copied string") == 0;
+
+    // End to end, through the runner.
+    logging::log_options_t options;
+    options.mode = logging::ASYNC_LOGGING;
+    options.deferred_format = true;
+    logging::init_logging(log_file, logging::INFO, options);
+    Info("Deferred %s %d %.2f", volatile_str, 17, 0.5);
+    logging::stop_logging();
+
+    FILE * fp = fopen(log_file, "r");
+    char line[LOG_BUF_SIZE] = { 0 };
+    if (fp) {
+      if (!fgets(line, sizeof line, fp)) {
+        line[0] = '\0';
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+    check = check && strstr(line, "Deferred overwritten 17 0.50\n");
+
+    if (check) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking deferred formatting.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking deferred formatting.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing that disabled levels do not evaluate their arguments.
+  {
+    const char * str = "Testing runtime level";
+    int out_pipe[2];
+    int stderr_bk = dup(STDERR_FILENO);
+    if (pipe(out_pipe)) {
+      fprintf(stderr, RED "[FAIL]" RESET " Failed to create pipe.\n");
+      exit(1);
+    }
+    dup2(out_pipe[1], STDERR_FILENO);
+    close(out_pipe[1]);
+
+    int evaluated = 0;
+    logging::init_logging("", logging::INFO);
+    Debug("%s %d", str, ++evaluated);
+    LOG_IF(logging::DEBUG, ++evaluated > 0, "%s", str);
+    bool skipped = (evaluated == 0);
+    logging::log->log_msg(logging::DEBUG, __FILE__, __LINE__,
+                          logging::log->get_thread_id(), "%s directly", str);
+    logging::set_log_level(logging::DEBUG);
+    Debug("%s %d", str, ++evaluated);
+    logging::stop_logging();
+
+    char buf[LOG_BUF_SIZE];
+    memset(buf, 0, LOG_BUF_SIZE);
+    read(out_pipe[0], buf, LOG_BUF_SIZE);
+    dup2(stderr_bk, STDERR_FILENO);
+
+    if (skipped && evaluated == 1 && strstr(buf, str) &&
+        !strstr(buf, "directly")) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking runtime level filtering.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking runtime level filtering.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing for the timestamp formats.
+  {
+    // 14-11-2023 22:13:20 UTC, plus 123456789 ns.
+    uint64_t ns = 1700000000123456789ULL;
+    char str[TIME_STR_SIZE];
+    bool check = true;
+
+    logging::format_time(str, ns, logging::TIME_SEC, true, false);
+    check = check && strcmp(str, "14-11-2023 22:13:20") == 0;
+    logging::format_time(str, ns, logging::TIME_MSEC, true, false);
+    check = check && strcmp(str, "14-11-2023 22:13:20.123") == 0;
+    logging::format_time(str, ns, logging::TIME_NSEC, true, true);
+    check = check && strcmp(str, "2023-11-14T22:13:20.123456789Z") == 0;
+    logging::format_time(str, ns + 1000000000ULL, logging::TIME_USEC, true, true);
+    check = check && strcmp(str, "2023-11-14T22:13:21.123456Z") == 0;
+
+    logging::log_options_t options;
+    options.time_precision = logging::TIME_USEC;
+    options.utc_time = true;
+    options.iso8601_time = true;
+    logging::init_logging(log_file, logging::INFO, options);
+    Error("Testing timestamps");
+    logging::stop_logging();
+
+    FILE * fp = fopen(log_file, "r");
+    char line[LOG_BUF_SIZE] = { 0 };
+    if (fp) {
+      if (!fgets(line, sizeof line, fp)) {
+        line[0] = '\0';
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+    int year, mon, day, hour, min, sec, usec;
+    char zone;
+    check = check &&
+            sscanf(line, "%4d-%2d-%2dT%2d:%2d:%2d.%6d%c,", &year, &mon, &day,
+                   &hour, &min, &sec, &usec, &zone) == 8 &&
+            zone == 'Z' && strstr(line, "Testing timestamps");
+
+    if (check) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking timestamp formats.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking timestamp formats.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing that messages longer than the log buffer are written whole.
+  {
+    const size_t long_len = 3 * LOG_BUF_SIZE;
+    char * long_str = new char[long_len + 1];
+    memset(long_str, 'x', long_len);
+    long_str[long_len] = '\0';
+
+    logging::init_logging(log_file, logging::INFO);
+    for (int i = 0; i < 100; ++i) {
+      Info("Testing buffer fill %d", i);
+    }
+    Info("%s", long_str);
+    Error("%s", long_str);
+    logging::stop_logging();
+
+    int fill_lines = 0;
+    int long_lines = 0;
+    FILE * fp = fopen(log_file, "r");
+    if (fp) {
+      char * line = new char[long_len + LOG_BUF_SIZE];
+      while (fgets(line, long_len + LOG_BUF_SIZE, fp)) {
+        const char * msg = strstr(line, "=> ");
+        if (msg && strncmp(msg + 3, "Testing buffer fill", 19) == 0) {
+          ++fill_lines;
+        } else if (msg && strlen(msg + 3) == long_len + 1) {
+          ++long_lines;
+        }
+      }
+      delete[] line;
+      fclose(fp);
+    }
+    remove(log_file);
+    delete[] long_str;
+
+    if (fill_lines == 100 && long_lines == 2) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking messages longer than the log buffer.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking messages longer than the log buffer.\n");
+      ++fail_count;
+    }
+  }
+
+
+  // Testing sinks, with per-sink levels and a batched log file.
+  {
+    logging::log_options_t options;
+    options.batch_size = 65536;
+    options.batch_msec = 100;
+    logging::init_logging(log_file, logging::INFO, options);
+    logging::MemorySink * sink = new logging::MemorySink(LOG_BUF_SIZE,
+                                                         logging::WARNING);
+    logging::add_sink(sink);
+
+    for (int i = 0; i < 100; ++i) {
+      Info("Testing batched sink %d", i);
+    }
+    struct stat st;
+    bool check = stat(log_file, &st) == 0 && st.st_size == 0;
+    usleep(500000);
+    check = check && stat(log_file, &st) == 0 && st.st_size > 0;
+
+    Warning("Testing warning sink");
+    Error("Testing error sink");
+    std::string contents = sink->get_contents();
+    check = check &&
+            contents.find("Testing batched sink") == std::string::npos &&
+            contents.find("Testing warning sink") != std::string::npos &&
+            contents.find("Testing error sink") != std::string::npos;
+    logging::stop_logging();
+
+    int lines = 0;
+    FILE * fp = fopen(log_file, "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      while (fgets(line, sizeof line, fp)) {
+        ++lines;
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+
+    if (check && lines == 102) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking log sinks.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking log sinks.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing log rotation by size, and reopening on request.
+  {
+    std::string base = log_file;
+    std::string rotated1 = base + ".1";
+    std::string rotated2 = base + ".2";
+    std::string rotated3 = base + ".3";
+    std::string moved = base + ".moved";
+
+    logging::log_options_t options;
+    options.rotate_bytes = 4096;
+    options.rotate_keep = 2;
+    logging::init_logging(log_file, logging::INFO, options);
+
+    bool check = true;
+    for (int round = 0; round < 3; ++round) {
+      for (int i = 0; i < 100; ++i) {
+        Error("Testing rotation %d %d", round, i);
+      }
+      if (round == 0) {
+        check = check && wait_for_file(rotated1.c_str(), 3000);
+      } else if (round == 1) {
+        check = check && wait_for_file(rotated2.c_str(), 3000);
+      } else {
+        usleep(2 * REOPEN_CHECK_MSEC * 1000);
+      }
+    }
+    struct stat st;
+    check = check && stat(rotated3.c_str(), &st) != 0 &&
+            stat(log_file, &st) == 0 && st.st_size < 4096;
+
+    rename(log_file, moved.c_str());
+    logging::reopen();
+    check = check && wait_for_file(log_file, 3000);
+    Error("Testing reopen");
+    logging::stop_logging();
+
+    FILE * fp = fopen(log_file, "r");
+    char line[LOG_BUF_SIZE] = { 0 };
+    if (fp) {
+      if (!fgets(line, sizeof line, fp)) {
+        line[0] = '\0';
+      }
+      fclose(fp);
+    }
+    check = check && strstr(line, "Testing reopen");
+
+    remove(log_file);
+    remove(rotated1.c_str());
+    remove(rotated2.c_str());
+    remove(moved.c_str());
+
+    if (check) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking log rotation.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking log rotation.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing that the crash handler writes out the buffered messages.
+  {
+    bool check = true;
+    const int sigs[] = { SIGABRT, SIGBUS };
+    const char * names[] = { "SIGABRT", "SIGBUS" };
+    for (int i = 0; i < 2; ++i) {
+      pid_t child = fork();
+      if (child == 0) {
+        logging::log_options_t options;
+        options.mode = (i == 0) ? logging::SYNC_LOGGING : logging::ASYNC_LOGGING;
+        logging::init_logging(log_file, logging::INFO, options);
+        Info("Testing crash flush");
+        raise(sigs[i]);
+        exit(1);
+      }
+
+      int status;
+      waitpid(child, &status, 0);
+      bool flushed = false;
+      bool reported = false;
+      FILE * fp = fopen(log_file, "r");
+      if (fp) {
+        char line[LOG_BUF_SIZE];
+        while (fgets(line, sizeof line, fp)) {
+          flushed = flushed || strstr(line, "Testing crash flush");
+          reported = reported || strstr(line, names[i]);
+        }
+        fclose(fp);
+      }
+      remove(log_file);
+      check = check && WIFEXITED(status) &&
+              WEXITSTATUS(status) == EXIT_STATUS_SIGSEGV && flushed && reported;
+    }
+
+    if (check) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking crash handling.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking crash handling.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing rate-limited and sampled logging.
+  {
+    logging::init_logging(log_file, logging::INFO);
+    for (int i = 0; i < 100; ++i) {
+      LOG_EVERY_N(logging::INFO, 10, "Testing every n %d", i);
+      LOG_FIRST_N(logging::INFO, 3, "Testing first n %d", i);
+      LOG_EVERY_T(logging::INFO, 3600, "Testing every t %d", i);
+      LOG_RATE_LIMITED(logging::INFO, 5, "Testing rate limited %d", i);
+      LOG_EVERY_N(logging::DEBUG, 1, "Testing disabled rate site %d", i);
+    }
+    logging::stop_logging();
+
+    int every_n = 0, first_n = 0, every_t = 0, rate_limited = 0, disabled = 0;
+    bool reported = false;
+    FILE * fp = fopen(log_file, "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      while (fgets(line, sizeof line, fp)) {
+        every_n += strstr(line, "Testing every n") != NULL;
+        first_n += strstr(line, "Testing first n") != NULL;
+        every_t += strstr(line, "Testing every t") != NULL;
+        rate_limited += strstr(line, "Testing rate limited") != NULL;
+        disabled += strstr(line, "Testing disabled rate site") != NULL;
+        reported = reported ||
+                   strstr(line, "Testing every n 10 [9 similar messages suppressed]");
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+
+    if (every_n == 10 && first_n == 3 && every_t == 1 && rate_limited == 5 &&
+        disabled == 0 && reported) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking rate-limited logging.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking rate-limited logging.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing per-site rules, from the API and from a control file.
+  {
+    std::string rules_file = std::string(log_file) + ".rules";
+    FILE * fp = fopen(rules_file.c_str(), "w");
+    if (fp) {
+      fputs("# No rules yet\n", fp);
+      fclose(fp);
+    }
+
+    logging::log_options_t options;
+    options.site_rules_file = rules_file;
+    logging::init_logging(log_file, logging::INFO, options);
+
+    size_t matched = 0;
+    for (int i = 0; i < 3; ++i) {
+      Debug("Testing site %d", i);
+      if (i == 0) {
+        matched = logging::enable_sites("*log_unittests.cc", 0, logging::DEBUG);
+      }
+    }
+    logging::clear_site_rules();
+    Debug("Testing cleared site");
+    logging::disable_sites("*log_unittests.cc", __LINE__ + 1);
+    Info("Testing disabled site");
+    Info("Testing other site");
+    logging::clear_site_rules();
+
+    fp = fopen(rules_file.c_str(), "w");
+    if (fp) {
+      fputs("enable *log_unittests.cc DEBUG\n", fp);
+      fclose(fp);
+    }
+    logging::reload_site_rules();
+    usleep(2 * REOPEN_CHECK_MSEC * 1000);
+    Debug("Testing reloaded rules");
+
+    std::vector<logging::log_site_t *> sites;
+    logging::get_sites(&sites);
+    bool registered = false;
+    for (size_t i = 0; i < sites.size(); ++i) {
+      registered = registered ||
+                   (sites[i]->fmt && strcmp(sites[i]->fmt, "Testing site %d") == 0 &&
+                    sites[i]->level == logging::DEBUG);
+    }
+    logging::clear_site_rules();
+    logging::stop_logging();
+
+    int site_lines = 0, cleared = 0, disabled = 0, other = 0, reloaded = 0;
+    fp = fopen(log_file, "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      while (fgets(line, sizeof line, fp)) {
+        site_lines += strstr(line, "Testing site") != NULL;
+        cleared += strstr(line, "Testing cleared site") != NULL;
+        disabled += strstr(line, "Testing disabled site") != NULL;
+        other += strstr(line, "Testing other site") != NULL;
+        reloaded += strstr(line, "Testing reloaded rules") != NULL;
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+    remove(rules_file.c_str());
+
+    if (matched > 0 && registered && site_lines == 2 && cleared == 0 &&
+        disabled == 0 && other == 1 && reloaded == 1) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking per-site rules.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking per-site rules.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing the type-safe {} formatter.
+  {
+    char buf[64];
+    size_t len = LOG_FORMAT_TO(buf, sizeof buf, "{} {:x} {:08.3f} {:>6} {{}} {:<4}|",
+                               -42, 255u, -3.14159, "hi", 'c');
+    bool formatted = (len == strlen(buf)) &&
+                     strcmp(buf, "-42 ff -003.142     hi {} c   |") == 0;
+
+    char small[8];
+    len = LOG_FORMAT_TO(small, sizeof small, "Value {}", 123456789);
+    bool truncated = (len == 15) && strcmp(small, "Value 1") == 0;
+
+    logging::init_logging(log_file, logging::INFO);
+    LOG_FORMAT(logging::INFO, "Testing format {} {} {}", 42, "str", true);
+    LOG_FORMAT(logging::DEBUG, "Testing disabled format {}", 1);
+    logging::stop_logging();
+
+    int logged = 0, disabled = 0;
+    FILE * fp = fopen(log_file, "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      while (fgets(line, sizeof line, fp)) {
+        logged += strstr(line, "=> Testing format 42 str true\n") != NULL;
+        disabled += strstr(line, "Testing disabled format") != NULL;
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+
+    if (formatted && truncated && logged == 1 && disabled == 0) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking type-safe formatting.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking type-safe formatting.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing the log's own counters.
+  {
+    logging::log_stats_t stats;
+    bool before_init = logging::get_stats(&stats);
+
+    logging::log_options_t options;
+    options.stats_sec = 1;
+    logging::init_logging(log_file, logging::INFO, options);
+    for (int i = 0; i < 3; ++i) {
+      Info("Testing stats %d", i);
+    }
+    Debug("Testing disabled stats");
+    Error("Testing stats error");
+    logging::get_stats(&stats);
+    usleep(1500 * 1000);
+    logging::stop_logging();
+
+    uint64_t flushes = 0, hist = 0;
+    for (int i = 0; i < logging::TOTAL_FLUSH_CAUSES; ++i) {
+      flushes += stats.flushes[i];
+    }
+    for (int i = 0; i < STATS_HIST_BUCKETS; ++i) {
+      hist += stats.flush_hist[i];
+    }
+    char line[LOG_BUF_SIZE];
+    logging::format_stats(line, sizeof line, stats);
+
+    int reports = 0;
+    FILE * fp = fopen(log_file, "r");
+    if (fp) {
+      char buf[LOG_BUF_SIZE];
+      while (fgets(buf, sizeof buf, fp)) {
+        reports += strstr(buf, "Logging stats: FATAL=") != NULL;
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+
+    if (!before_init && stats.messages[logging::INFO] == 3 &&
+        stats.messages[logging::ERROR] == 1 &&
+        stats.messages[logging::DEBUG] == 0 && stats.bytes[logging::INFO] > 0 &&
+        stats.flushes[logging::FLUSH_ERROR] == 1 && hist == flushes &&
+        stats.lock_acquires > 0 && strstr(line, "ERROR=1/") &&
+        strstr(line, "flush_error=1") && reports == 1) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking logging stats.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking logging stats.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing the stats with more threads than shards, twice over; the
+  // drops are counted by the threads themselves, without a lock.
+  {
+    logging::log_options_t options;
+    options.mode = logging::ASYNC_LOGGING;
+    options.ring_size = 16384;
+    options.overflow_policy = logging::OVERFLOW_DROP_NEWEST;
+    logging::init_logging(log_file, logging::INFO, options);
+    for (int round = 0; round < 2; ++round) {
+      pthread_t threads[STATS_TEST_THREADS];
+      for (long i = 0; i < STATS_TEST_THREADS; ++i) {
+        pthread_create(&threads[i], NULL, stats_producer, (void *) i);
+      }
+      for (int i = 0; i < STATS_TEST_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+      }
+    }
+    logging::log->flush_buffer();
+    logging::log_stats_t stats;
+    logging::get_stats(&stats);
+    logging::stop_logging();
+    remove(log_file);
+
+    if (stats.messages[logging::INFO] + stats.dropped ==
+        2 * STATS_TEST_THREADS * STATS_TEST_MSGS && stats.dropped > 0) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking logging stats from many threads.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking logging stats from many threads.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing the overflow policies, with the runner stuck in a slow sink.
+  {
+    logging::log_options_t options;
+    options.overflow_policy = logging::OVERFLOW_DROP_NEWEST;
+    logging::init_logging(log_file, logging::DEBUG, options);
+    SlowSink slow_sink;
+    logging::add_sink(&slow_sink);
+
+    uint64_t start = logging::get_time_ns();
+    for (int i = 0; i < 2000; ++i) {
+      Info("Testing overflow %d", i);
+    }
+    uint64_t elapsed = logging::get_time_ns() - start;
+    usleep(500 * 1000);
+    Info("Testing after overflow");
+    Error("Testing overflow error");
+
+    logging::log_stats_t stats;
+    logging::get_stats(&stats);
+    logging::remove_sink(&slow_sink);
+    logging::stop_logging();
+
+    int logged = 0, reported = 0, after = 0, error = 0;
+    FILE * fp = fopen(log_file, "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      while (fgets(line, sizeof line, fp)) {
+        logged += strstr(line, "Testing overflow ") != NULL &&
+                  strstr(line, "error") == NULL;
+        reported += strstr(line, "messages dropped") != NULL;
+        after += strstr(line, "Testing after overflow") != NULL;
+        error += strstr(line, "Testing overflow error") != NULL;
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+
+    // The callers never waited for the sink.
+    if (logged > 0 && logged < 2000 &&
+        (uint64_t) logged + stats.dropped == 2000 && reported == 1 &&
+        after == 1 && error == 1 && elapsed < 100 * 1000000ULL) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking overflow policies.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking overflow policies.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing the flight recorder, with a process killed before flushing.
+  {
+    std::string recorder_file = std::string(log_file) + ".rec";
+    pid_t child = fork();
+    if (child == 0) {
+      logging::log_options_t options;
+      options.recorder_path = recorder_file;
+      logging::init_logging(log_file, logging::INFO, options);
+      Error("Testing recorder error");
+      for (int i = 0; i < 3; ++i) {
+        Info("Testing recorder %d", i);
+      }
+      kill(getpid(), SIGKILL);
+      exit(1);
+    }
+    int status;
+    waitpid(child, &status, 0);
+
+    std::string lost, all;
+    bool recovered = logging::recover_recorder(recorder_file, false, &lost) &&
+                     logging::recover_recorder(recorder_file, true, &all);
+    bool in_log = false;
+    FILE * fp = fopen(log_file, "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      while (fgets(line, sizeof line, fp)) {
+        in_log = in_log || strstr(line, "Testing recorder 0") != NULL;
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+
+    // A clean stop leaves nothing to recover; the old file is kept aside.
+    logging::log_options_t options;
+    options.recorder_path = recorder_file;
+    logging::init_logging(log_file, logging::INFO, options);
+    Info("Testing recorder clean stop");
+    logging::stop_logging();
+    std::string clean, prev;
+    bool clean_ok = logging::recover_recorder(recorder_file, false, &clean) &&
+                    logging::recover_recorder(recorder_file + ".prev", false,
+                                              &prev);
+    remove(log_file);
+    remove(recorder_file.c_str());
+    remove((recorder_file + ".prev").c_str());
+
+    if (WIFSIGNALED(status) && recovered && !in_log &&
+        lost.find("Testing recorder 2\n") != std::string::npos &&
+        lost.find("Testing recorder error") == std::string::npos &&
+        all.find("Testing recorder error") != std::string::npos &&
+        clean_ok && clean.empty() && prev == lost) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking the flight recorder.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking the flight recorder.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing the debug history, dumped before an error.
+  {
+    logging::log_options_t options;
+    options.history_entries = 4;
+    logging::init_logging(log_file, logging::INFO, options);
+    for (int i = 0; i < 6; ++i) {
+      Debug("Testing history %d", i);
+    }
+    Info("Testing history info");
+    Error("Testing history error");
+    Error("Testing history second error");
+    Debug("Testing history after");
+    logging::stop_logging();
+
+    int history = 0, first = 0, after = 0, info = 0, errors = 0;
+    bool ordered = true;
+    FILE * fp = fopen(log_file, "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      while (fgets(line, sizeof line, fp)) {
+        if (strstr(line, "(history) Testing history")) {
+          ++history;
+          ordered = ordered && errors == 0 && info == 1;
+        }
+        first += strstr(line, "Testing history 1\n") != NULL;
+        after += strstr(line, "Testing history after") != NULL;
+        info += strstr(line, "Testing history info") != NULL;
+        errors += strstr(line, "error") != NULL;
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+
+    if (history == 4 && ordered && first == 0 && after == 0 && info == 1 &&
+        errors == 2) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking the debug history.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking the debug history.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing the index of the log file, and queries on it.
+  {
+    logging::log_options_t options;
+    options.index_records = 8;
+    options.time_precision = logging::TIME_NSEC;
+    logging::init_logging(log_file, logging::INFO, options);
+    for (int i = 0; i < 64; ++i) {
+      Info("Testing index %d", i);
+    }
+    usleep(1100 * 1000);
+    uint64_t middle = logging::get_time_ns();
+    for (int i = 64; i < 128; ++i) {
+      Info("Testing index %d", i);
+    }
+    Warning("Testing index warning");
+    logging::stop_logging();
+
+    std::string index_file = std::string(log_file) + ".idx";
+    std::string out_file = std::string(log_file) + ".out";
+    std::vector<std::string> files;
+    files.push_back(log_file);
+    files.push_back(index_file);
+
+    logging::log_query_t query;
+    query.from_ns = middle;
+    int fd = open(out_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    uint64_t scanned = 0;
+    ssize_t recent = logging::query_log(files, query, fd, &scanned);
+    query.from_ns = 0;
+    query.level = logging::WARNING;
+    ssize_t warnings = logging::query_log(files, query, fd);
+    close(fd);
+
+    uint64_t epoch_ns = 0, date_ns = 0, junk_ns = 0;
+    bool args_ok = logging::parse_time_arg("@1.5", true, &epoch_ns) &&
+                   epoch_ns == 1500000000ULL &&
+                   logging::parse_time_arg("01-02-2020 00:00:00", true, &date_ns) &&
+                   date_ns == 1580515200ULL * 1000000000ULL &&
+                   !logging::parse_time_arg("@", true, &junk_ns) &&
+                   !logging::parse_time_arg("01-02-2020 junk", true, &junk_ns);
+
+    struct stat st;
+    uint64_t log_size = (stat(log_file, &st) == 0) ? st.st_size : 0;
+    bool indexed = stat(index_file.c_str(), &st) == 0 &&
+                   st.st_size == sizeof(logging::index_header_t) +
+                                 17 * sizeof(logging::index_entry_t);
+    int first = 0, last = 0, lines = 0;
+    FILE * fp = fopen(out_file.c_str(), "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      while (fgets(line, sizeof line, fp)) {
+        ++lines;
+        first += strstr(line, "Testing index 64\n") != NULL;
+        last += strstr(line, "Testing index 63\n") != NULL;
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+    remove(index_file.c_str());
+    remove(out_file.c_str());
+
+    if (recent == 65 && warnings == 1 && lines == 66 && first == 1 &&
+        last == 0 && indexed && scanned < log_size && args_ok) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking the log file index.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking the log file index.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing processes logging to, and rotating, the same file.
+  {
+    const int procs = 4;
+    const int msgs = 500;
+    for (int p = 0; p < procs; ++p) {
+      if (fork() == 0) {
+        logging::log_options_t options;
+        options.multi_process = true;
+        options.rotate_bytes = 32 * 1024;
+        logging::init_logging(log_file, logging::INFO, options);
+        for (int i = 0; i < msgs; ++i) {
+          Info("Testing process %d message %d, end of message", p, i);
+          if (i == msgs / 2) {
+            usleep(2 * REOPEN_CHECK_MSEC * 1000);
+          }
+        }
+        logging::stop_logging();
+        exit(0);
+      }
+    }
+    while (wait(NULL) > 0) {
+    }
+
+    int files = 0, lines = 0, torn = 0;
+    for (int n = 0; n < 8; ++n) {
+      char path[64];
+      if (n == 0) {
+        snprintf(path, sizeof path, "%s", log_file);
+      } else {
+        snprintf(path, sizeof path, "%s.%d", log_file, n);
+      }
+      FILE * fp = fopen(path, "r");
+      if (fp == NULL) {
+        continue;
+      }
+      ++files;
+      char line[LOG_BUF_SIZE];
+      while (fgets(line, sizeof line, fp)) {
+        ++lines;
+        torn += strstr(line, ", end of message\n") == NULL || line[2] != '-';
+      }
+      fclose(fp);
+      remove(path);
+    }
+    remove((std::string(log_file) + ".lock").c_str());
+
+    if (files >= 2 && lines == procs * msgs && torn == 0) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking multi-process logging.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking multi-process logging.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing asynchronous logging through per-CPU rings.
+  {
+    logging::log_options_t options;
+    options.mode = logging::ASYNC_LOGGING;
+    options.per_cpu_buffers = true;
+    logging::init_logging(log_file, logging::INFO, options);
+
+    pthread_t threads[ASYNC_TEST_THREADS];
+    for (long i = 0; i < ASYNC_TEST_THREADS; ++i) {
+      pthread_create(&threads[i], NULL, async_producer, (void *) i);
+    }
+    for (int i = 0; i < ASYNC_TEST_THREADS; ++i) {
+      pthread_join(threads[i], NULL);
+    }
+    logging::stop_logging();
+
+    // Threads share the rings, but keep their order.
+    int next[ASYNC_TEST_THREADS] = { 0 };
+    bool ordered = true;
+    FILE * fp = fopen(log_file, "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      while (fgets(line, sizeof line, fp)) {
+        long id;
+        int msg;
+        const char * p = strstr(line, "Async producer");
+        if (p && sscanf(p, "Async producer %ld message %d", &id, &msg) == 2) {
+          if (id < 0 || id >= ASYNC_TEST_THREADS || msg != next[id]++) {
+            ordered = false;
+          }
+        }
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+
+    bool complete = true;
+    for (int i = 0; i < ASYNC_TEST_THREADS; ++i) {
+      complete = complete && (next[i] == ASYNC_TEST_MSGS);
+    }
+
+    if (fp && ordered && complete) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking per-CPU buffers.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking per-CPU buffers.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing thread ids, names and context fields.
+  {
+    char thread[32];
+    snprintf(thread, sizeof thread, "Thread %5u, ", (unsigned int) syscall(SYS_gettid));
+    const char * expected[] = {
+      "[context-test req=42] Testing context 1\n",
+      "[context-test req=42 tenant=acme] Testing context 2\n",
+      "[context-test req=42] Testing context 3\n",
+      "[context-test] Testing context 4\n",
+      "[context-test req=7] Testing context 5\n",
+      "[context-test req=7] Testing context 6\n",
+    };
+
+    logging::set_thread_name("context-test");
+    logging::set_context("req", "42");
+    logging::init_logging(log_file, logging::INFO);
+    Info("Testing context %d", 1);
+    {
+      logging::ScopedContext ctx("tenant", "acme");
+      Info("Testing context %d", 2);
+    }
+    Info("Testing context %d", 3);
+    logging::clear_context();
+    Info("Testing context %d", 4);
+    logging::stop_logging();
+
+    // Deferred records carry the context to the runner.
+    logging::log_options_t options;
+    options.mode = logging::ASYNC_LOGGING;
+    options.deferred_format = true;
+    logging::init_logging(log_file, logging::INFO, options);
+    logging::set_context("req", "7");
+    Info("Testing context %d", 5);
+    char fmt[] = "Testing context %d";
+    Info(fmt, 6);
+    logging::stop_logging();
+
+    char name[THREAD_NAME_SIZE] = "";
+    pthread_getname_np(pthread_self(), name, sizeof name);
+    bool fields_ok = strcmp(logging::get_context("req"), "7") == 0 &&
+                     logging::get_context("tenant") == NULL &&
+                     strcmp(logging::get_thread_name(), "context-test") == 0 &&
+                     strcmp(name, "context-test") == 0;
+    logging::set_thread_name(NULL);
+    logging::clear_context();
+
+    int found = 0;
+    FILE * fp = fopen(log_file, "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      for (int i = 0; fgets(line, sizeof line, fp); ++i) {
+        const char * p = strstr(line, " => ");
+        found += (i < 6 && strstr(line, thread) && p &&
+                  strcmp(p + 4, expected[i]) == 0);
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+
+    if (found == 6 && fields_ok) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking thread context.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking thread context.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing the raw stack traces of FATAL messages, and their symbolization.
+  {
+    pid_t child = fork();
+    if (child == 0) {
+      logging::log_options_t options;
+      options.stack_trace_depth = 3;
+      logging::init_logging(log_file, logging::INFO, options);
+      Fatal("Testing stack trace");
+      exit(1);
+    }
+    int status;
+    waitpid(child, &status, 0);
+
+    char exe[LOG_BUF_SIZE] = "";
+    ssize_t exe_len = readlink("/proc/self/exe", exe, sizeof exe - 1);
+    exe[(exe_len > 0) ? exe_len : 0] = '\0';
+    int frames = 0;
+    bool module = false;
+    FILE * fp = fopen(log_file, "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      while (fgets(line, sizeof line, fp)) {
+        frames += strncmp(line, "@\t0+0x", 5) == 0;
+        const char * path = strrchr(line, ' ');
+        module = module || (strncmp(line, "@@\t0 ", 4) == 0 && path &&
+                            strncmp(path + 1, exe, strlen(exe)) == 0);
+      }
+      fclose(fp);
+    }
+
+    // Without a symbolizer installed, the frames are left as they are.
+    std::string out_file = std::string(log_file) + ".sym";
+    int in_fd = open(log_file, O_RDONLY);
+    int out_fd = open(out_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ssize_t resolved = logging::symbolize_log(in_fd, out_fd, "");
+    close(in_fd);
+    close(out_fd);
+    bool symbolized = false;
+    fp = fopen(out_file.c_str(), "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      while (fgets(line, sizeof line, fp)) {
+        symbolized = symbolized ||
+                     strncmp(line, "@\tlogging::Log::log_body(", 24) == 0 ||
+                     (resolved == 0 && strncmp(line, "@\t0+0x", 5) == 0);
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+    remove(out_file.c_str());
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_STATUS_FATAL &&
+        frames == 3 && module && resolved >= 0 && symbolized) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking stack traces.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking stack traces.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing the collapsing of repeated messages.
+  {
+    const char * expected[] = {
+      "Testing repeat 0\n",
+      "last message repeated 99 times\n",
+      "Testing repeat 1\n",
+      "Testing repeat 0\n",
+      "last message repeated 99 times\n",
+      "Testing repeat 1\n",
+      "Testing site 0\n",
+      "last message repeated 9 times\n",
+    };
+
+    logging::log_options_t options;
+    options.dedup_msec = 10000;
+    logging::init_logging(log_file, logging::INFO, options);
+    for (int i = 0; i <= 100; ++i) {
+      Info("Testing repeat %d", i / 100);
+    }
+    logging::log_stats_t stats;
+    logging::get_stats(&stats);
+    logging::stop_logging();
+
+    // The runner collapses the records of the rings, deferred or not.
+    options.mode = logging::ASYNC_LOGGING;
+    options.deferred_format = true;
+    logging::init_logging(log_file, logging::INFO, options);
+    for (int i = 0; i <= 100; ++i) {
+      Info("Testing repeat %d", i / 100);
+    }
+    logging::stop_logging();
+
+    // By call site, whatever the arguments; reported at exit.
+    options.mode = logging::SYNC_LOGGING;
+    options.deferred_format = false;
+    options.dedup_by_site = true;
+    logging::init_logging(log_file, logging::INFO, options);
+    for (int i = 0; i < 10; ++i) {
+      Info("Testing site %d", i);
+    }
+    logging::stop_logging();
+
+    int found = 0;
+    int lines = 0;
+    FILE * fp = fopen(log_file, "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      for (; fgets(line, sizeof line, fp); ++lines) {
+        const char * p = strstr(line, " => ");
+        found += (lines < 8 && p && strcmp(p + 4, expected[lines]) == 0);
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+
+    if (found == 8 && lines == 8 && stats.collapsed == 99) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking repeated-message collapsing.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking repeated-message collapsing.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing named loggers, with levels and logs of their own.
+  {
+    const char * expected[] = {
+      "Testing rpc 2\n",
+      "Testing other 2\n",
+      "Testing other 3\n",
+      "Testing compaction 2\n",
+      "Testing compaction 1\n",
+    };
+    std::string storage_file = std::string(log_file) + ".storage";
+    std::string early_file = std::string(log_file) + ".early";
+
+    // A named log outlives a stop_logging() without a root log.
+    logging::log_options_t options;
+    options.sigsegv_handling = false;
+    logging::init_logger("early", early_file, logging::INFO, options);
+    int stderr_bk = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDERR_FILENO);
+    logging::stop_logging();
+    dup2(stderr_bk, STDERR_FILENO);
+    close(null_fd);
+    close(stderr_bk);
+    logging::logger_t * early = logging::get_logger("early");
+    bool early_kept = (early->log != NULL);
+    LOG_TO(early, logging::INFO, "Testing early %d", 1);
+    logging::stop_logger("early");
+    struct stat st;
+    early_kept = early_kept && stat(early_file.c_str(), &st) == 0 && st.st_size > 0;
+    remove(early_file.c_str());
+
+    logging::init_logging(log_file, logging::INFO);
+    logging::set_logger_level("net", logging::WARNING);
+    logging::init_logger("storage", storage_file, logging::DEBUG, options);
+
+    logging::logger_t * rpc = logging::get_logger("net.rpc");
+    logging::logger_t * compaction = logging::get_logger("storage.compaction");
+    logging::logger_t * other = logging::get_logger("other");
+    LOG_TO(rpc, logging::INFO, "Testing rpc %d", 1);
+    LOG_TO(rpc, logging::WARNING, "Testing rpc %d", 2);
+    LOG_TO(compaction, logging::DEBUG, "Testing compaction %d", 1);
+    LOG_TO(other, logging::DEBUG, "Testing other %d", 1);
+    LOG_TO(other, logging::INFO, "Testing other %d", 2);
+    logging::set_log_level(logging::DEBUG);
+    LOG_TO(other, logging::DEBUG, "Testing other %d", 3);
+    bool handles_ok = logging::get_logger("net.rpc") == rpc &&
+                      rpc->parent == logging::get_logger("net") &&
+                      rpc->parent->parent == logging::get_logger("") &&
+                      rpc->log == logging::log &&
+                      compaction->log != logging::log;
+
+    // Back to the root log, at the level of storage.
+    logging::stop_logger("storage");
+    LOG_TO(compaction, logging::DEBUG, "Testing compaction %d", 2);
+    logging::stop_logging();
+    handles_ok = handles_ok && compaction->log == NULL;
+
+    int found = 0;
+    int lines = 0;
+    const char * files[] = { log_file, storage_file.c_str() };
+    for (size_t f = 0; f < 2; ++f) {
+      FILE * fp = fopen(files[f], "r");
+      if (fp) {
+        char line[LOG_BUF_SIZE];
+        for (; fgets(line, sizeof line, fp); ++lines) {
+          const char * p = strstr(line, " => ");
+          found += (lines < 5 && p && strcmp(p + 4, expected[lines]) == 0);
+        }
+        fclose(fp);
+      }
+      remove(files[f]);
+    }
+
+    if (found == 5 && lines == 5 && handles_ok && early_kept) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking named loggers.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking named loggers.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing the block-compressed log file, and reading it back.
+  {
+    // The codec on its own, on text and on data that does not compress.
+    char text[8192], packed[8192], unpacked[8192];
+    for (size_t i = 0; i < sizeof text; ++i) {
+      text[i] = "Testing the codec, "[i % 19];
+    }
+    size_t packed_len = logging::lz_compress(text, sizeof text, packed, sizeof packed);
+    bool codec_ok = packed_len > 0 && packed_len < sizeof text / 10 &&
+                    logging::lz_decompress(packed, packed_len, unpacked,
+                                           sizeof unpacked) == sizeof text &&
+                    memcmp(text, unpacked, sizeof text) == 0;
+    srand(1);
+    for (size_t i = 0; i < sizeof text; ++i) {
+      text[i] = rand();
+    }
+    codec_ok = codec_ok &&
+               logging::lz_compress(text, sizeof text, packed, sizeof packed) == 0;
+
+    logging::log_options_t options;
+    options.block_size = 4096;
+    logging::init_logging(log_file, logging::INFO, options);
+    for (int i = 0; i < 500; ++i) {
+      Info("Testing block %d", i);
+    }
+    logging::stop_logging();
+
+    struct stat st;
+    off_t file_size = (stat(log_file, &st) == 0) ? st.st_size : 0;
+    std::string out_file = std::string(log_file) + ".txt";
+    int in_fd = open(log_file, O_RDONLY);
+    int out_fd = open(out_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ssize_t len = logging::cat_blocks(in_fd, out_fd, 0, UINT64_MAX);
+    close(out_fd);
+    lseek(in_fd, 0, SEEK_SET);
+    out_fd = open("/dev/null", O_WRONLY);
+    ssize_t none = logging::cat_blocks(in_fd, out_fd, 0, 1);
+    close(out_fd);
+    close(in_fd);
+
+    int found = 0;
+    FILE * fp = fopen(out_file.c_str(), "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE], expected[64];
+      for (int i = 0; fgets(line, sizeof line, fp); ++i) {
+        snprintf(expected, sizeof expected, " => Testing block %d\n", i);
+        const char * p = strstr(line, " => ");
+        found += (p && strcmp(p, expected) == 0);
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+    remove(out_file.c_str());
+
+    if (codec_ok && found == 500 && none == 0 && file_size > 0 &&
+        file_size < len / 2) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking block compression.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking block compression.\n");
+      ++fail_count;
+    }
+  }
+
+  // Testing the scope timers and their summaries.
+  {
+    bool buckets_ok = true;
+    for (uint64_t v = 1; v < (1ULL << 62); v = v * 3 + 1) {
+      size_t b = logging::timer_bucket(v);
+      buckets_ok = buckets_ok && b < TIMER_BUCKETS &&
+                   logging::timer_bucket_max(b) >= v &&
+                   logging::timer_bucket(logging::timer_bucket_max(b)) == b &&
+                   logging::timer_bucket(logging::timer_bucket_max(b) + 1) == b + 1;
+    }
+
+    // The summaries of the runner are written whatever the log level.
+    logging::log_options_t options;
+    options.timer_sec = 3600;
+    options.stats_sec = 1;
+    logging::init_logging(log_file, logging::WARNING, options);
+    logging::log_timer_t * timer = logging::get_timer("test.fixed");
+    bool same = (logging::get_timer("test.fixed") == timer);
+    for (int i = 0; i < 99; ++i) {
+      logging::record_time(timer, 1000);
+    }
+    logging::record_time(timer, 1000000);
+    for (int i = 0; i < 3; ++i) {
+      LOG_SCOPE_TIMER("test.scope");
+    }
+    logging::log_timers();
+    logging::log_timers();
+    usleep(1500 * 1000);
+    logging::stop_logging();
+
+    int fixed = 0, scope = 0, stats = 0;
+    FILE * fp = fopen(log_file, "r");
+    if (fp) {
+      char line[LOG_BUF_SIZE];
+      while (fgets(line, sizeof line, fp)) {
+        fixed += (strstr(line, "Logging timer test.fixed: count=100 "
+                               "p50_ns=1023 p99_ns=1023 max_ns=1000000\n") != NULL);
+        scope += (strstr(line, "Logging timer test.scope: count=3 ") != NULL);
+        stats += (strstr(line, "Logging stats: ") != NULL);
+      }
+      fclose(fp);
+    }
+    remove(log_file);
+
+    if (buckets_ok && same && fixed == 1 && scope == 1 && stats > 0) {
+      fprintf(stderr, GREEN "[PASS]" RESET " Checking scope timers.\n");
+      ++pass_count;
+    } else {
+      fprintf(stderr, RED "[FAIL]" RESET " Checking scope timers.\n");
+      ++fail_count;
+    }
+  }
 
   if (fail_count == 0) {
     fprintf(stderr, GREEN "\nAll logging tests passed successfully!\n\n" RESET);